@@ -0,0 +1,56 @@
+// Benchmarks.hpp: Definition of class `Benchmarks`.
+
+#ifndef IPASIM_BENCHMARKS_HPP
+#define IPASIM_BENCHMARKS_HPP
+
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/SysTranslator.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace ipasim {
+
+// Host-side microbenchmarks of internals of `IpaSimLibrary`. Each of them
+// compares an optimized path with the approach it replaced and logs time per
+// operation of both. They are run by `ipasim::start` if `RunBenchmarks` is
+// enabled or by `ipaSim_runBenchmarks`. Benchmarks of emulated code are in
+// sample app `IpasimBenchmark`.
+class Benchmarks {
+public:
+  Benchmarks(DynamicLoader &Dyld, SysTranslator &Sys) : Dyld(Dyld), Sys(Sys) {}
+
+  void run();
+  // Compares `DynamicLoader::lookup` (binary search with a last-hit cache) with
+  // a linear scan over all libraries.
+  void lookup();
+  // Compares `SysTranslator::getSignature` (cached) with decoding every
+  // Objective-C type string of loaded images (see `createSignature`).
+  void signatures();
+  // Compares `DeferredCall` and reused argument buffers of `DynamicCaller` with
+  // `std::function` and buffers allocated for every dynamic call.
+  void continuations();
+
+private:
+  DynamicLoader &Dyld;
+  SysTranslator &Sys;
+
+  // Returns average time of one call of `Func` in nanoseconds.
+  template <typename F> static double measure(size_t Count, F &&Func) {
+    auto Start = std::chrono::steady_clock::now();
+    for (size_t I = 0; I != Count; ++I)
+      Func(I);
+    auto Duration = std::chrono::steady_clock::now() - Start;
+    return static_cast<double>(
+               std::chrono::duration_cast<std::chrono::nanoseconds>(Duration)
+                   .count()) /
+           Count;
+  }
+  static void report(const char *Name, size_t N, double Before, double After);
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_BENCHMARKS_HPP)
+#endif
@@ -0,0 +1,74 @@
+// DyldInfo.hpp: Definition of class `DyldInfo`.
+
+#ifndef IPASIM_DYLD_INFO_HPP
+#define IPASIM_DYLD_INFO_HPP
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace llvm {
+namespace MachO {
+struct segment_command;
+struct dyld_info_command;
+struct symtab_command;
+} // namespace MachO
+} // namespace llvm
+
+namespace ipasim {
+
+// Interprets rebase and bind opcodes of a Mach-O image loaded in memory (see
+// `LC_DYLD_INFO` in `<mach-o/loader.h>`). Fixups are applied while the opcodes
+// are being decoded, nothing is allocated per fixup. Inspired by
+// `ImageLoaderMachOCompressed::rebase` and
+// `ImageLoaderMachOCompressed::eachBind`.
+class DyldInfo {
+public:
+  // Returns address of symbol `Sym` from library `Lib` or 0 if it cannot be
+  // found.
+  using Resolver = std::function<uint64_t(const char *Lib, const char *Sym)>;
+  // Returns address which lazy pointer `Ptr` to symbol `Sym` from library `Lib`
+  // should initially point to.
+  using LazyBinder =
+      std::function<uint64_t(uint32_t *Ptr, const char *Lib, const char *Sym)>;
+
+  // `Hdr` is the loaded Mach-O header and `Slide` is the difference between
+  // actual and preferred addresses of the image.
+  DyldInfo(const void *Hdr, uint64_t Slide);
+
+  // Returns `false` if the image has no `LC_DYLD_INFO(_ONLY)` command.
+  bool isValid() { return Info; }
+  // Slides all pointers inside the image.
+  bool rebase();
+  // Binds all non-lazy pointers inside the image. `Resolve` is called once per
+  // each symbol-setting opcode.
+  bool bind(const Resolver &Resolve);
+  // Initializes all lazy pointers inside the image using `Bind`. It's called
+  // for each lazy pointer.
+  bool bindLazy(const LazyBinder &Bind);
+  // Calls `Func` for each external symbol defined in the image (as listed in
+  // `LC_SYMTAB`) with its actual address. Absolute symbols are not slid. Names
+  // point into the loaded image.
+  void forEachSymbol(
+      const std::function<void(const char *Name, uint64_t Addr)> &Func);
+  // Returns names of libraries re-exported by the image. They point into the
+  // loaded image.
+  const std::vector<const char *> &getReexports() { return Reexports; }
+
+private:
+  bool bind(const uint8_t *Begin, const uint8_t *End, const Resolver *Resolve,
+            const LazyBinder *Bind);
+  const uint8_t *getFileData(uint32_t FileOffset, uint32_t Size);
+  bool getAddress(uint32_t SegIndex, uint64_t Offset, uint32_t *&Ptr);
+
+  uint64_t Slide;
+  const llvm::MachO::dyld_info_command *Info;
+  const llvm::MachO::symtab_command *Symtab;
+  std::vector<const llvm::MachO::segment_command *> Segments;
+  std::vector<const char *> Libraries, Reexports;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_DYLD_INFO_HPP)
+#endif
@@ -8,10 +8,17 @@
 #include "ipasim/Emulator.hpp"
 #include "ipasim/LoadedLibrary.hpp"
 #include "ipasim/Logger.hpp"
+#include "ipasim/PerThread.hpp"
+#include "ipasim/PrelinkCache.hpp"
 #include "ipasim/TextBlockStream.hpp"
+#include "ipasim/WorkerPool.hpp"
 
+#include <atomic>
 #include <functional>
 #include <map>
+#include <memory>
+#include <set>
+#include <shared_mutex>
 #include <stack>
 #include <string>
 #include <unicorn/unicorn.h>
@@ -19,11 +26,15 @@
 
 namespace ipasim {
 
+class DyldInfo;
+class IpaArchive;
+
 // Represents a path to a binary file. It can be both `.dll` and `.dylib`. It
 // can also be both user and "our system" binary.
 struct BinaryPath {
   std::string Path;
-  bool Relative; // `true` iff `Path` is relative to install dir
+  bool Relative;         // `true` iff `Path` is relative to install dir
+  bool Archived = false; // `true` iff `Path` is inside the `.ipa` archive
 
   // Checks whether the binary exists.
   bool isFileValid() const;
@@ -56,22 +67,63 @@ public:
   void registerHandler(_dyld_objc_notify_mapped Mapped,
                        _dyld_objc_notify_init Init,
                        _dyld_objc_notify_unmapped Unmapped);
-  // Finds a library that `Addr` is mapped inside.
+  // Finds a library that `Addr` is mapped inside. This is a binary search over
+  // `LLsByAddr` preceded by a check of the last library found by the current
+  // thread. It can be called from any thread.
   LibraryInfo lookup(uint64_t Addr);
+  // Returns library at `Path` if it's already loaded (otherwise `nullptr`).
+  // Unlike `load`, it can be called from any thread.
+  LoadedLibrary *findLoaded(const std::string &Path);
+  // Calls `Func` for every loaded library in order of their addresses. It can
+  // be called from any thread, but `Func` mustn't load libraries.
+  template <typename F> void forEachLoaded(F &&Func) {
+    std::shared_lock<std::shared_mutex> Lock(LLsByAddrMutex);
+    for (auto &[Addr, LI] : LLsByAddr)
+      Func(LI);
+  }
   // Logging helpers
   LogStream::Handler dumpAddr(uint64_t Addr);
   LogStream::Handler dumpAddr(uint64_t Addr, const LibraryInfo &LI);
   LogStream::Handler dumpAddr(uint64_t Addr, const LibraryInfo &LI,
                               ObjCMethod M);
   uint64_t getKernelAddr() { return KernelAddr; }
+  static constexpr size_t NoLazyBinding = static_cast<size_t>(-1);
+  // Returns `true` if `Addr` is inside a lazy binder region (see
+  // `initLazyBindings`). `Binding` is then set to the corresponding lazy
+  // binding (or `NoLazyBinding` if `Addr` is not a valid slot). This is cheap,
+  // so it can be called from hooks, unlike `bindLazy`.
+  bool findLazyBinding(uint64_t Addr, size_t &Binding);
+  // Resolves symbol of lazy `Binding` and patches its lazy pointer. Returns
+  // address of the symbol (or 0 if it cannot be resolved) and sets `Ptr` to the
+  // lazy pointer.
+  uint64_t bindLazy(size_t Binding, uint32_t *&Ptr);
+  size_t getLazyBindCount() { return LazyBindCount; }
+  // Numbers of Mach-O images loaded from and not found in `PrelinkCache`.
+  size_t getPrelinkHits() { return PrelinkHits; }
+  size_t getPrelinkMisses() { return PrelinkMisses; }
+  // Makes the next start cold (see `PrelinkCache::clear`).
+  void clearPrelinkCache() { getPrelinkCache().clear(); }
+  // Makes paths inside the app bundle resolve to entries of `Archive`.
+  void setArchive(IpaArchive *Archive) { this->Archive = Archive; }
   static constexpr uint64_t alignToPageSize(uint64_t Addr) {
     return Addr & (-PageSize);
   }
   static constexpr uint64_t roundToPageSize(uint64_t Addr) {
     return alignToPageSize(Addr + PageSize - 1);
   }
+  // Reserves `Size` bytes of contiguous memory. Its first `Mapped` bytes are a
+  // private copy-on-write view of file mapping `Mapping` at `Offset`, the rest
+  // is zeroed private memory. `Mapped` is set to at most `FileBytes` (the
+  // number of bytes the caller wants from the file) rounded down to
+  // `AllocationGranularity`, because views can only be split from the rest
+  // of the memory at that granularity. Returns `nullptr` (and sets `Mapped` to
+  // 0) if nothing can be mapped.
+  static void *mapFilePrefix(void *Mapping, uint64_t Offset,
+                             uint64_t FileBytes, uint64_t Size,
+                             uint64_t &Mapped);
 
   static constexpr int PageSize = 4096;
+  static constexpr uint64_t AllocationGranularity = 0x10000;
 
 private:
   struct MachOHandler {
@@ -80,21 +132,109 @@ private:
     _dyld_objc_notify_unmapped Unmapped;
   };
 
+  // Mach-O image being loaded by `loadMachO`.
+  struct PendingImage {
+    BinaryPath Path;
+    uint64_t Hash = 0;                  // See `hashBinary`
+    std::unique_ptr<LoadedDylib> Owned; // Moved to `LLs` once prepared
+    LoadedDylib *LL = nullptr;          // `nullptr` if preparation failed
+    const void *Hdr = nullptr;
+    uint64_t Mapped = 0; // Size of the part mapped from file (see `mapMachO`)
+    bool Rebased = false;
+    bool InCycle = false; // Bound before some of its dependencies
+    bool Visited = false; // Discovered by `loadMachO`
+    bool Loaded = false;  // Published by `loadMachO`
+    bool Bound = false;
+    PrelinkedImage Img;
+    std::vector<std::string> Libraries; // Names of libraries it depends on
+    // Pending images of `Libraries` (`nullptr` for other libraries)
+    std::vector<PendingImage *> Deps;
+    uint64_t PrepareTime = 0;           // In microseconds
+  };
+
   bool canSegmentsSlide(LIEF::MachO::Binary &Bin);
   BinaryPath resolvePath(const std::string &Path);
-  LoadedLibrary *loadMachO(const std::string &Path);
+  bool isMachO(const BinaryPath &Path);
+  // Returns hash used to validate `PrelinkCache` entries (or 0 on error).
+  uint64_t hashBinary(const BinaryPath &Path);
+  // Loads Mach-O image at `Path` together with all Mach-O images it depends on
+  // that aren't loaded yet. Those are discovered as the images are prepared on
+  // worker threads (see `prepareMachO`). Then they are published and bound,
+  // and other libraries are loaded, in the same order as if they were loaded
+  // one by one.
+  LoadedLibrary *loadMachO(const BinaryPath &Path);
+  // Parses, maps and rebases an image. Runs on a worker thread, so it mustn't
+  // touch anything but `P`.
+  void prepareMachO(PendingImage &P);
+  WorkerPool<PendingImage> &getWorkers();
+  // Makes a prepared image visible to the emulator and the rest of the loader.
+  void publishMachO(PendingImage &P);
+  void bindMachO(PendingImage &P);
+  // Allocates memory for segments of Mach-O file at `Path`. As much of it as
+  // possible is mapped from the file as a private copy-on-write view, so that
+  // those segments don't have to be copied. That's the leading part of the
+  // image laid out in the file the same way as in memory, i.e., up to the
+  // first segment placed after a zero-fill section (e.g., `__LINKEDIT` after
+  // `__bss`). `Mapped` is set to its size (see `mapFilePrefix`), segments
+  // past it must be copied. Returns `nullptr` if nothing can be mapped.
+  void *mapMachO(const BinaryPath &Path, LIEF::MachO::Binary &Bin,
+                 uint64_t LowAddr, uint64_t Size, uint64_t &Mapped);
   LoadedLibrary *loadPE(const std::string &Path);
+  void initLazyBindings(DyldInfo &Info);
+  void installLazyBindings(size_t First);
+  PrelinkCache &getPrelinkCache();
+  // Maps the image copy-on-write from the cache if possible, so that it's
+  // paged in on demand like images loaded by `mapMachO`.
+  LoadedLibrary *loadPrelinked(const std::string &Path, uint64_t Hash);
+  void addDependency(LoadedLibrary *Lib,
+                     std::set<const LoadedLibrary *> &Deps);
+  // `Deps` are libraries that provided symbols the image was bound to (see
+  // `addDependency`).
+  void storePrelinked(const std::string &Path, uint64_t Hash, LoadedDylib &LL,
+                      PrelinkedImage &Img, size_t FirstLazy,
+                      const std::set<const LoadedLibrary *> &Deps);
   void handleMachOs(size_t HdrOffset, size_t HandlerOffset);
+  // Adds library at `Path` (which must already be in `LLs` and have its
+  // address range set) into `LLsByAddr`.
+  void indexLibrary(const std::string &Path);
 
-  static constexpr int R_SCATTERED = 0x80000000; // From `<mach-o/reloc.h>`
   Emulator &Emu;
+  IpaArchive *Archive;
   uint64_t KernelAddr;
   // Loaded libraries and their paths
   std::map<std::string, std::unique_ptr<LoadedLibrary>> LLs;
+  // Mach-O images published by `loadMachO` that haven't been bound yet
+  std::set<const LoadedLibrary *> Unbound;
+  // Loaded libraries indexed by their `StartAddress`. Their address ranges
+  // don't overlap, so the library containing an address is always the last one
+  // starting before (or at) that address.
+  std::map<uint64_t, LibraryInfo> LLsByAddr;
+  std::shared_mutex LLsByAddrMutex;
+  PerThread<LibraryInfo> LastLookup; // Result of the last successful `lookup`
   // These are used for dyld-objc integration:
   std::vector<const void *> Hdrs; // Registered headers
   std::set<uintptr_t> HdrSet;     // Set of registered headers for faster lookup
   std::vector<MachOHandler> Handlers; // Registered handlers
+  // Lazy binding. Lazy pointers initially point to inaccessible binder slots,
+  // one for each lazy pointer. Slots are allocated in regions, one for each
+  // image.
+  struct LazyBinding {
+    uint32_t *Ptr; // The lazy pointer
+    const char *Lib, *Sym;
+  };
+  struct LazyBinderRegion {
+    uint64_t Size;
+    size_t FirstBinding; // Index into `LazyBindings`
+    size_t Count;
+  };
+  static constexpr uint64_t LazyBinderSlotSize = 4;
+  std::vector<LazyBinding> LazyBindings;
+  std::map<uint64_t, LazyBinderRegion> LazyBinderRegions; // Keyed by address
+  std::atomic<size_t> LazyBindCount;
+  std::unique_ptr<PrelinkCache> Prelink; // Created on first use
+  // Runs `prepareMachO`. Created on first use and shared by all loads.
+  std::unique_ptr<WorkerPool<PendingImage>> Workers;
+  size_t PrelinkHits, PrelinkMisses;
 };
 
 } // namespace ipasim
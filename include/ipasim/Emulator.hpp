@@ -3,12 +3,21 @@
 #ifndef IPASIM_EMULATOR_HPP
 #define IPASIM_EMULATOR_HPP
 
+#include "ipasim/PerThread.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <unicorn/unicorn.h>
 #include <utility>
+#include <vector>
 
 namespace ipasim {
 
 class DynamicLoader;
+class Emulator;
 
 namespace hooks {
 
@@ -32,44 +41,208 @@ struct FunctionHelper<T, RetTy(ArgTys...)> {
 
 } // namespace hooks
 
-// Wraps an instance of the Unicorn emulator. Automatically reports errors.
+// Registers involved in a call across the emulator boundary. They are read all
+// at once by `Emulator::readFrame`.
+struct ArgumentFrame {
+  static constexpr size_t RegArgs = 4;
+
+  uint32_t Args[RegArgs]; // R0-R3
+  uint32_t SP, LR, PC;
+
+  // Emulated stack is mapped at the same address in the host.
+  const uint32_t *getStack() const {
+    return reinterpret_cast<const uint32_t *>(static_cast<uintptr_t>(SP));
+  }
+};
+
+// Owns a hook registered by `Emulator::hook`. The hook is removed when this is
+// destroyed or reset.
+class HookHandle {
+public:
+  HookHandle() : Emu(nullptr), Id(0) {}
+  HookHandle(Emulator &Emu, size_t Id) : Emu(&Emu), Id(Id) {}
+  HookHandle(const HookHandle &) = delete;
+  HookHandle(HookHandle &&H) : Emu(std::exchange(H.Emu, nullptr)), Id(H.Id) {}
+  HookHandle &operator=(HookHandle &&H) {
+    reset();
+    Emu = std::exchange(H.Emu, nullptr);
+    Id = H.Id;
+    return *this;
+  }
+  ~HookHandle() { reset(); }
+
+  void reset();
+  explicit operator bool() const { return Emu; }
+
+private:
+  Emulator *Emu;
+  size_t Id; // Index into `Emulator::Hooks`
+};
+
+// Wraps instances of the Unicorn emulator. Automatically reports errors. Each
+// host thread that runs emulated code gets its own Unicorn engine (and hence
+// its own registers). Engines of exited threads are reused by new ones. All
+// engines share one memory map and the same hooks. Changes to the memory map
+// are recorded and replayed by other engines before they run (see
+// `syncMemory`), because an engine cannot be modified while another thread
+// runs it.
 class Emulator {
 public:
-  Emulator(DynamicLoader &Dyld)
-      : UC(initUC()), Dyld(Dyld), IgnoreError(false) {}
+  Emulator(DynamicLoader &Dyld);
   Emulator(const Emulator &) = delete;
-  Emulator(Emulator &&E)
-      : UC(nullptr), Dyld(E.Dyld), IgnoreError(E.IgnoreError) {
-    std::swap(UC, E.UC);
-  }
   ~Emulator();
 
+  // Register accessors work with the engine of the current thread.
   uint32_t readReg(uc_arm_reg RegId);
   void writeReg(uc_arm_reg RegId, uint32_t Value);
+  // Access `Count` (at most `MaxBatch`) registers with one call into Unicorn.
+  void readRegs(const uc_arm_reg *RegIds, uint32_t *Values, size_t Count);
+  void writeRegs(const uc_arm_reg *RegIds, const uint32_t *Values,
+                 size_t Count);
+  ArgumentFrame readFrame();
+  // Reads emulated memory through the current thread's engine. Returns `false`
+  // (instead of faulting) if it's not mapped.
+  bool readMemory(uint64_t Addr, void *Data, size_t Size);
+  // Writes `Count` (at most 4) words into registers R0-R3.
+  void writeArgs(const uint32_t *Args, size_t Count);
+  // Maps host memory at `Addr` to the same emulated address. Parts of existing
+  // regions it overlaps get protection `Perms`. Existing mappings are never
+  // unmapped by this (that would flush Unicorn's translation cache), only the
+  // unmapped parts are mapped.
   void mapMemory(uint64_t Addr, uint64_t Size, uc_prot Perms);
-  void start(uint64_t Addr);
+  // Unmaps all mapped parts of the given range.
+  void unmapMemory(uint64_t Addr, uint64_t Size);
+  // Shrinks range [`Start`, `End`) containing `Addr` so that it doesn't overlap
+  // any mapping. Returns `false` if `Addr` itself is mapped (e.g., some other
+  // thread has just mapped it).
+  bool clipToUnmapped(uint64_t Addr, uint64_t &Start, uint64_t &End);
+  size_t getRegionCount();
+  // Applies changes made to the memory map by other threads to the engine of
+  // the current thread. Returns `true` if `Addr` is mapped afterwards.
+  bool syncMemory(uint64_t Addr);
+  size_t getEngineCount() { return Engines.size(); }
+  // Logs all mapped regions.
+  void dumpMemoryMap();
+  // Starts emulation at `Addr` in the current thread. If `Until` is non-zero,
+  // emulation stops (without an error) when it reaches that address. Returns
+  // `true` if it was stopped by `interrupt` before reaching `Until` without an
+  // error, so that it can be resumed at the current PC.
+  bool start(uint64_t Addr, uint64_t Until = 0);
   void stop();
+  // Stops emulation in all threads that are currently emulating. It can be
+  // called from any thread.
+  void interrupt();
+  // Unicorn cannot be re-entered from its hooks. So when a hook calls native
+  // code that might start emulation again, it suspends the current thread's
+  // engine first. Until `resume`, all accessors use another engine of this
+  // thread, which gets SP of the suspended one when it's first used. `resume`
+  // returns `true` if that happened (i.e., the native code used the emulator).
+  void suspend();
+  bool resume();
+  // Hooks are installed into engines of all threads. They fire only for
+  // addresses in [`Begin`, `End`] (for all addresses if `Begin > End`), so that
+  // they don't slow down execution elsewhere.
   template <typename F>
-  void hook(uc_hook_type Type, F *Handler, void *Instance) {
-    hook(Type, reinterpret_cast<void *>(Handler), Instance);
+  [[nodiscard]] HookHandle hook(uc_hook_type Type, F *Handler, void *Instance,
+                                uint64_t Begin = 1, uint64_t End = 0) {
+    return hook(Type, reinterpret_cast<void *>(Handler), Instance, nullptr,
+                Begin, End);
   }
-  void hook(uc_hook_type Type, void *Handler, void *Instance);
   template <typename T, typename F>
-  void hook(uc_hook_type Type, F T::*Handler, T *Instance) {
+  [[nodiscard]] HookHandle hook(uc_hook_type Type, F T::*Handler, T *Instance,
+                                uint64_t Begin = 1, uint64_t End = 0) {
     using Helper = hooks::FunctionHelper<T, F>;
-    hook(Type, Helper::hook, new typename Helper::DataTy{Instance, Handler});
+    auto Data = std::make_shared<typename Helper::DataTy>(
+        typename Helper::DataTy{Instance, Handler});
+    void *DataPtr = Data.get();
+    return hook(Type, reinterpret_cast<void *>(Helper::hook), DataPtr,
+                std::move(Data), Begin, End);
   }
-  // Won't report the next error.
+  // Won't report the next error (in the current thread).
   void ignoreNextError();
 
 private:
-  uc_engine *UC;
-  DynamicLoader &Dyld;
-  bool IgnoreError;
+  struct Region {
+    uint64_t End;
+    uc_prot Perms;
+  };
+  // Change of the memory map, see `syncMemory`.
+  struct MemoryOp {
+    enum KindTy { Map, Unmap, Protect };
 
-  static uc_engine *initUC();
+    uint64_t Start, End;
+    uc_prot Perms; // Ignored by `Unmap`
+    KindTy Kind;
+  };
+  struct Hook {
+    uc_hook_type Type;
+    void *Handler, *Instance;
+    uint64_t Begin, End;
+    bool Active;                // `false` once its `HookHandle` is reset
+    size_t Installed;           // Number of engines it's installed in
+    std::shared_ptr<void> Data; // Freed when it's removed from all engines
+  };
+  struct Engine {
+    uc_engine *UC;
+    bool IgnoreError;
+    size_t Ops; // Number of `MemoryOp`s applied (see `OpsBase`)
+    // Handles of installed `Hooks` (0 if not installed) indexed as `Hooks`
+    std::vector<uc_hook> Hooks;
+    size_t Generation; // Value of `Emulator::Generation` it's in sync with
+    // Protects `Running` and `Interrupted`, so that `interrupt` cannot stop
+    // the engine between two runs (see `start`).
+    std::mutex StopMutex;
+    bool Running = false, Interrupted = false;
+    // Used instead of this engine while it's suspended (see `suspend`).
+    std::unique_ptr<Engine> Nested;
+    bool Suspended = false, NestedUsed = false;
+  };
+  static constexpr size_t MaxBatch = 16;
+  // Keep at most this many recorded `MemoryOp`s. Engines that haven't applied
+  // the discarded ones rebuild their memory map instead (see `syncEngine`).
+  static constexpr size_t MaxOps = 256;
+
+  DynamicLoader &Dyld;
+  std::mutex Mutex; // Protects everything below
+  // Mapped regions keyed by their start addresses. They never overlap and
+  // adjacent regions with the same protection are merged. Note that this is
+  // only bookkeeping, one of them can span several regions inside an engine
+  // (Unicorn can unmap and protect ranges across its regions).
+  std::map<uint64_t, Region> Regions;
+  std::vector<MemoryOp> Ops; // Not yet applied by all engines
+  size_t OpsBase;            // Number of discarded `MemoryOp`s
+  std::vector<Hook> Hooks;
+  // Incremented on every change of `Ops` or `Hooks`, so that engines can check
+  // whether they are in sync without locking.
+  std::atomic<size_t> Generation;
+  std::vector<std::unique_ptr<Engine>> FreeEngines; // Of exited threads
+  PerThread<Engine> Engines;
+
+  friend class HookHandle;
+
+  HookHandle hook(uc_hook_type Type, void *Handler, void *Instance,
+                  std::shared_ptr<void> Data, uint64_t Begin, uint64_t End);
+  void unhook(size_t Id);
+  Engine &getEngine();
+  Engine &getNested(Engine &E);
+  // Returns the innermost engine of the current thread without creating any.
+  Engine *findEngine();
+  static void closeEngine(Engine &E);
+  std::unique_ptr<Engine> createEngine();
+  void releaseEngine(std::unique_ptr<Engine> E);
+  // Brings `E` in sync with the memory map and hooks. `Mutex` must be locked.
+  void syncEngine(Engine &E);
+  // Replaces all mappings of `E` with `Regions`. `Mutex` must be locked.
+  void rebuildMemory(Engine &E);
+  void trimOps();
   static void callUCStatic(uc_err Err);
-  void callUC(uc_err Err);
+  void callUC(Engine &E, uc_err Err);
+  // Sets protection of [`Start`, `End`) in `Regions` (which doesn't have to be
+  // mapped yet), merging it with neighbours.
+  void setRegion(uint64_t Start, uint64_t End, uc_prot Perms);
+  void unmapRegion(uint64_t Start, uint64_t End);
+  void record(const MemoryOp &Op);
+  void apply(Engine &E, const MemoryOp &Op);
 };
 
 } // namespace ipasim
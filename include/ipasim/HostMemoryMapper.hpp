@@ -0,0 +1,52 @@
+// HostMemoryMapper.hpp: Definition of class `HostMemoryMapper`.
+
+#ifndef IPASIM_HOST_MEMORY_MAPPER_HPP
+#define IPASIM_HOST_MEMORY_MAPPER_HPP
+
+#include "ipasim/Emulator.hpp"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+namespace ipasim {
+
+// Maps host memory (e.g., heap) into the emulator when emulated code accesses
+// it for the first time. Instead of a single page, it maps a whole granule
+// around the faulting address (clipped to committed pages of the host
+// allocation and to existing mappings), so that walking a large buffer doesn't
+// fault on every page.
+class HostMemoryMapper {
+public:
+  // If `Granule` is 0, whole committed part of the host allocation region is
+  // mapped on the first fault.
+  HostMemoryMapper(Emulator &Emu, uint64_t Granule);
+
+  // Maps memory around `Addr`. Returns `false` if it cannot be mapped.
+  bool handleFault(uint64_t Addr);
+  size_t getFaultCount() { return Faults; }
+  // Logs numbers of faults and mapped bytes per host allocation region.
+  void reportFaults();
+
+private:
+  struct RegionStats {
+    size_t Faults;
+    uint64_t Mapped; // In bytes
+  };
+
+  // Finds committed pages around `Addr` inside the granule (or the allocation
+  // region). Returns `false` if `Addr` itself isn't committed.
+  bool findCommitted(uint64_t Addr, uint64_t &Start, uint64_t &End,
+                     uint64_t &AllocBase);
+
+  Emulator &Emu;
+  uint64_t Granule;
+  std::mutex Mutex;
+  std::map<uint64_t, RegionStats> Regions; // Keyed by allocation base
+  size_t Faults;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_HOST_MEMORY_MAPPER_HPP)
+#endif
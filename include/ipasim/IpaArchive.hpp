@@ -0,0 +1,80 @@
+// IpaArchive.hpp: Definition of class `IpaArchive`.
+
+#ifndef IPASIM_IPA_ARCHIVE_HPP
+#define IPASIM_IPA_ARCHIVE_HPP
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ipasim {
+
+// Provides files inside an `.ipa` (i.e., ZIP) archive without extracting it.
+// The archive is mapped into memory once and its central directory is indexed.
+// Stored entries are read right from the mapping, deflated ones are inflated
+// on demand.
+class IpaArchive {
+public:
+  struct Entry {
+    uint64_t LocalOffset;    // Offset of the local file header
+    uint64_t CompressedSize;
+    uint64_t Size;
+    uint32_t CRC;
+    uint16_t Method; // 0 = stored, 8 = deflated
+  };
+
+  IpaArchive(const std::string &Path);
+  IpaArchive(const IpaArchive &) = delete;
+  ~IpaArchive();
+
+  bool isValid() { return View != nullptr; }
+  // Path of the app bundle inside the archive (e.g., `Payload/App.app/`).
+  const std::string &getBundle() { return Bundle; }
+  // Path of the app's main binary inside the archive.
+  std::string getMainBinary();
+  const Entry *find(const std::string &Name);
+  // Reads the first `Size` bytes of entry `E`.
+  bool readPrefix(const Entry &E, void *Buffer, size_t Size);
+  // Reads the whole entry `E` (inflating it if needed).
+  bool read(const Entry &E, std::vector<uint8_t> &Data);
+  // Like `DynamicLoader::mapFilePrefix`, but maps (at most `FileBytes` of)
+  // stored entry `E`. Returns `nullptr` if it isn't stored at a page-aligned
+  // offset.
+  void *mapCopy(const Entry &E, uint64_t FileBytes, uint64_t Size,
+                uint64_t &Mapped);
+  // Returns contents of file `Name` from the app bundle (or `nullptr` if it
+  // doesn't exist). `Name` is either relative to the bundle or starts with
+  // `getBundle()`. Inflated contents are cached, so they live as long as the
+  // archive.
+  const uint8_t *getResource(const std::string &Name, size_t &Size);
+  // Returns names of files and folders inside folder `Dir` of the app bundle
+  // (or `nullptr` if there is no such folder). `Dir` is interpreted the same
+  // way as in `getResource`, empty `Dir` is the bundle itself.
+  const std::vector<std::string> *listResources(const std::string &Dir);
+
+private:
+  bool index();
+  // Returns pointer to data of entry `E` or `nullptr` if it's out of bounds.
+  const uint8_t *getData(const Entry &E);
+  uint64_t getDataOffset(const Entry &E);
+  // Converts `Name` to a path relative to the app bundle.
+  std::string getBundlePath(const std::string &Name);
+
+  std::string Path;
+  void *Mapping;
+  const uint8_t *View;
+  uint64_t FileSize;
+  std::unordered_map<std::string, Entry> Entries;
+  std::string Bundle;
+  // Contents of folders inside the app bundle (see `listResources`)
+  std::unordered_map<std::string, std::vector<std::string>> Folders;
+  std::mutex Mutex; // Protects `Inflated`
+  std::unordered_map<const Entry *, std::vector<uint8_t>> Inflated;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_IPA_ARCHIVE_HPP)
+#endif
@@ -7,10 +7,15 @@
 #include "ipasim/Common.hpp"
 #include "ipasim/DynamicLoader.hpp"
 #include "ipasim/Emulator.hpp"
+#include "ipasim/IpaArchive.hpp"
 #include "ipasim/Logger.hpp"
+#include "ipasim/Profiler.hpp"
+#include "ipasim/SamplingProfiler.hpp"
 #include "ipasim/SysTranslator.hpp"
 #include "ipasim/TextBlockStream.hpp"
+#include "ipasim/Tracer.hpp"
 
+#include <memory>
 #include <string>
 #include <unicorn/unicorn.h>
 #include <winrt/Windows.ApplicationModel.Activation.h>
@@ -21,14 +26,19 @@ class IpaSimulator {
 public:
   IpaSimulator();
 
+  Profiler Prof; // This has to be first, so that it can time everything.
   Emulator Emu;
   DynamicLoader Dyld;
   std::string MainBinary;
+  std::unique_ptr<IpaArchive> Archive; // Set if the app is run from `.ipa`
   SysTranslator Sys;
+  Tracer Trace;
+  SamplingProfiler Sampler;
   TextBlockProvider LogText;
 };
 
-// Starts the emulation.
+// Starts the emulation. `Path` is either the app's main binary or its `.ipa`
+// archive.
 IPASIM_EXPORT void start(
     const winrt::hstring &Path,
     const winrt::Windows::ApplicationModel::Activation::LaunchActivatedEventArgs
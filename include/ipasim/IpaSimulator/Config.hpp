@@ -27,6 +27,71 @@ constexpr bool PrintMemoryWrites = IPASIM_PRINT_MEMORY_WRITES;
 #endif
 constexpr bool PrintEmuInfo = IPASIM_PRINT_EMU_INFO;
 
+// If enabled, calls into wrapper DLLs through lazy pointers go through native
+// call gates, so that they don't have to stop Unicorn (see
+// `SysTranslator::handleInterrupt`).
+#if !defined(IPASIM_DIRECT_CALLS)
+#define IPASIM_DIRECT_CALLS 1
+#endif
+constexpr bool DirectCalls = IPASIM_DIRECT_CALLS;
+
+// Size of each emulated stack (in bytes).
+#if !defined(IPASIM_STACK_SIZE)
+#define IPASIM_STACK_SIZE 0x800000 // 8 MiB
+#endif
+constexpr uint64_t StackSize = IPASIM_STACK_SIZE;
+
+// How much host memory is mapped into the emulator when emulated code touches
+// unmapped memory (see `HostMemoryMapper`). Zero means the whole host
+// allocation region.
+#if !defined(IPASIM_FAULT_GRANULE)
+#define IPASIM_FAULT_GRANULE 0x10000 // 64 KiB
+#endif
+constexpr uint64_t FaultGranule = IPASIM_FAULT_GRANULE;
+
+// If enabled, rebased and bound Mach-O images are stored on disk and reused by
+// later runs (see `PrelinkCache`). An entry is used only if the image and every
+// library it was bound to (including re-exported ones) are unchanged.
+#if !defined(IPASIM_PRELINK_CACHE)
+#define IPASIM_PRELINK_CACHE 1
+#endif
+constexpr bool UsePrelinkCache = IPASIM_PRELINK_CACHE;
+
+// If enabled, Mach-O images are mapped copy-on-write from their files where
+// possible (see `DynamicLoader::mapMachO`). Otherwise, they are always copied
+// into private memory, which is useful for comparing memory usage.
+#if !defined(IPASIM_MAP_IMAGES)
+#define IPASIM_MAP_IMAGES 1
+#endif
+constexpr bool MapImages = IPASIM_MAP_IMAGES;
+
+// Number of threads that parse, map and rebase Mach-O images in parallel (see
+// `DynamicLoader::loadMachO`). Zero means one per hardware thread.
+#if !defined(IPASIM_LOADER_THREADS)
+#define IPASIM_LOADER_THREADS 0
+#endif
+constexpr unsigned LoaderThreads = IPASIM_LOADER_THREADS;
+
+// How many times per second `SamplingProfiler` samples emulated code by
+// default.
+#if !defined(IPASIM_SAMPLING_FREQUENCY)
+#define IPASIM_SAMPLING_FREQUENCY 1000 // 1 kHz
+#endif
+constexpr unsigned SamplingFrequency = IPASIM_SAMPLING_FREQUENCY;
+
+// If enabled, microbenchmarks of the emulator's internals are run after the app
+// starts (see `Benchmarks`).
+#if !defined(IPASIM_RUN_BENCHMARKS)
+#define IPASIM_RUN_BENCHMARKS 0
+#endif
+constexpr bool RunBenchmarks = IPASIM_RUN_BENCHMARKS;
+
+// If enabled, startup phases are timed (see `Profiler`).
+#if !defined(IPASIM_PROFILE_STARTUP)
+#define IPASIM_PROFILE_STARTUP 0
+#endif
+constexpr bool ProfileStartup = IPASIM_PROFILE_STARTUP;
+
 } // namespace ipasim
 
 // !defined(IPASIM_IPA_SIMULATOR_CONFIG_HPP)
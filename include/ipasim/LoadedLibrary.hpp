@@ -10,27 +10,46 @@
 #include <LIEF/LIEF.hpp>
 #include <Windows.h>
 #include <cassert>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace ipasim {
 
 class DynamicLoader;
 
-// Iterator over symbols of LIEF's Mach-O binary filtered by a RVA.
-class DylibSymbolIterator {
+// Open-addressing hash table mapping symbol names to addresses. It doesn't own
+// the names.
+class SymbolTable {
 public:
-  DylibSymbolIterator(uint64_t RVA, LIEF::MachO::it_exported_symbols Symbols)
-      : RVA(RVA), Symbols(std::move(Symbols)) {}
-
-  DylibSymbolIterator begin();
-  DylibSymbolIterator end() { return DylibSymbolIterator(RVA, Symbols.end()); }
-  DylibSymbolIterator &next();
-  DylibSymbolIterator IPASIM_PREFIX(++);
-  bool operator!=(const DylibSymbolIterator &Other);
-  LIEF::MachO::Symbol &operator*();
+  SymbolTable() : Count(0) {}
+
+  // Returns `nullptr` if there is no symbol `Name` in the table.
+  const uint64_t *find(const char *Name);
+  // Does nothing if there already is symbol `Name` in the table. `Name` must
+  // outlive the table.
+  void insert(const char *Name, uint64_t Addr);
+  void reserve(size_t Count);
+  template <typename F> void forEach(F Func) {
+    for (Entry &E : Entries)
+      if (E.Name)
+        Func(E.Name, E.Addr);
+  }
 
 private:
-  uint64_t RVA;
-  LIEF::MachO::it_exported_symbols Symbols;
+  struct Entry {
+    const char *Name; // `nullptr` for empty entries
+    uint64_t Addr;
+    uint32_t Hash;
+  };
+
+  static uint32_t hash(const char *Name);
+  Entry &findEntry(const char *Name, uint32_t Hash);
+  void rehash(size_t Capacity);
+
+  std::vector<Entry> Entries; // Its size is always a power of two.
+  size_t Count;
 };
 
 // Represents a dynamic library (or executable) loaded by `DynamicLoader`.
@@ -45,37 +64,81 @@ public:
   virtual bool isDylib() = 0;
   bool isDLL() { return !isDylib(); }
   // TODO: Check that the found symbol is inside range [StartAddress, +Size].
-  virtual uint64_t findSymbol(DynamicLoader &DL, const std::string &Name) = 0;
+  virtual uint64_t findSymbol(DynamicLoader &DL, const char *Name) = 0;
+  uint64_t findSymbol(DynamicLoader &DL, const std::string &Name) {
+    return findSymbol(DL, Name.c_str());
+  }
   virtual bool hasUnderscorePrefix() = 0;
   bool isInRange(uint64_t Addr);
   void checkInRange(uint64_t Addr);
   virtual bool hasMachO() = 0;
   virtual MachO getMachO() = 0;
+  // Finds Objective-C method implemented at `Addr`. The library must have a
+  // Mach-O header (see `hasMachO`).
+  ObjCMethod findMethod(uint64_t Addr);
+  // Finds Objective-C method whose implementation starts closest before (or
+  // at) `Addr`. The library must have a Mach-O header.
+  ObjCMethod findPrecedingMethod(uint64_t Addr, uint64_t &Start);
+
+private:
+  ObjCMethodIndex Methods;
 };
 
-// A `.dylib` loaded via library LIEF.
+// A `.dylib` loaded via library LIEF or from `PrelinkCache`.
 class LoadedDylib : public LoadedLibrary {
 public:
-  LIEF::MachO::Binary &Bin;
+  // LIEF's representation of the binary (`nullptr` if it was loaded from
+  // `PrelinkCache`). It's only used while the image is being loaded, everything
+  // else must work without it.
+  LIEF::MachO::Binary *Bin;
+  uint64_t Entrypoint; // Preferred address of the entry point
+  uint64_t Imagebase;  // Preferred address of the Mach-O header
 
   LoadedDylib(std::unique_ptr<LIEF::MachO::FatBinary> &&Fat)
-      : Fat(move(Fat)), Bin(Fat->at(0)), Header(0) {}
+      : Bin(&Fat->at(0)), Entrypoint(0), Imagebase(0), Fat(move(Fat)),
+        Header(0) {}
+  LoadedDylib() : Bin(nullptr), Entrypoint(0), Imagebase(0), Header(0) {}
 
   bool isDylib() override { return true; }
-  uint64_t findSymbol(DynamicLoader &DL, const std::string &Name) override;
+  using LoadedLibrary::findSymbol;
+  // Symbols are looked up in a hash table of exported symbols built on first
+  // use, then in re-exported libraries. The table is never modified after it's
+  // built and results of the latter are remembered in a separate memo guarded
+  // by a mutex, so this can be called from any thread.
+  uint64_t findSymbol(DynamicLoader &DL, const char *Name) override;
+  // Returns the hash table used by `findSymbol`.
+  SymbolTable &getSymbols();
+  // Provides the hash table used by `findSymbol` (e.g., one stored in
+  // `PrelinkCache`). Must be called before the table is first used.
+  void setSymbols(SymbolTable &&Table);
+  // Returns names of exported symbols at `Addr` (ignoring the Thumb bit).
   // TODO: Use this function to implement `src/objc/dladdr.mm`.
-  DylibSymbolIterator lookup(uint64_t Addr);
+  std::vector<const char *> lookup(uint64_t Addr);
+  // Returns names of libraries re-exported by this one.
+  const std::vector<const char *> &getReexports() {
+    getSymbols();
+    return Reexports;
+  }
   bool hasUnderscorePrefix() override { return true; }
   bool hasMachO() override { return true; }
   MachO getMachO() override {
     if (!Header)
-      Header = StartAddress + Bin.imagebase();
+      Header = StartAddress + Imagebase;
     return MachO(reinterpret_cast<const void *>(Header));
   }
 
 private:
+  void indexReexports();
+  void indexSymbols();
+
   std::unique_ptr<LIEF::MachO::FatBinary> Fat;
   uint64_t Header;
+  SymbolTable Symbols;
+  std::once_flag SymbolsIndexed;
+  std::vector<const char *> Reexports; // Names of re-exported libraries
+  // Symbols looked up in `Reexports` (0 if they weren't found there)
+  std::unordered_map<std::string, uint64_t> ReexportMemo;
+  std::mutex ReexportMutex;
 };
 
 // A `.dll` loaded via Windows API.
@@ -85,7 +148,8 @@ public:
   bool MachOPoser;
 
   bool isDylib() override { return false; }
-  uint64_t findSymbol(DynamicLoader &DL, const std::string &Name) override;
+  using LoadedLibrary::findSymbol;
+  uint64_t findSymbol(DynamicLoader &DL, const char *Name) override;
   bool hasUnderscorePrefix() override { return false; }
   bool hasMachO() override { return MachOPoser; }
   MachO getMachO() override {
@@ -5,10 +5,14 @@
 
 #include <functional>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <ostream>
 #include <string>
 #include <tuple>
 #include <type_traits>
+#include <variant>
+#include <vector>
 
 #if !defined(IPASIM_NO_WINDOWS_ERRORS)
 // From <winnt.h>
@@ -248,6 +252,44 @@ private:
   }
 };
 
+// A `Stream` that can be written to from multiple threads. Text is buffered per
+// thread and passed to the underlying stream one line at a time, so that
+// messages from different threads don't interleave.
+template <typename StreamTy>
+class SyncStream : public Stream<SyncStream<StreamTy>> {
+public:
+  template <typename... ArgTys>
+  SyncStream(ArgTys &&... Args) : S(std::forward<ArgTys>(Args)...) {}
+  SyncStream(SyncStream &&Other) : S(std::move(Other.S)) {}
+
+  void write(const char *Str) { append(Str); }
+  void write(const wchar_t *Str) { append(Str); }
+
+private:
+  using Piece = std::variant<std::string, std::wstring>;
+
+  StreamTy S;
+  std::mutex Mutex;
+
+  template <typename C> void append(const C *Str) {
+    std::vector<Piece> &Line = getLine();
+    std::basic_string<C> Text(Str);
+    bool Ends = !Text.empty() && Text.back() == '\n';
+    Line.emplace_back(std::move(Text));
+    if (!Ends)
+      return;
+
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (const Piece &P : Line)
+      std::visit([this](const auto &Text) { S.write(Text.c_str()); }, P);
+    Line.clear();
+  }
+  std::vector<Piece> &getLine() {
+    thread_local std::map<const SyncStream *, std::vector<Piece>> Lines;
+    return Lines[this];
+  }
+};
+
 // Logging class with one stream for standard output and another one for errors.
 // Sample usage: `Log.error() << "failed with: " << 42 << Log.end()`.
 template <typename StreamTy> class Logger {
@@ -6,7 +6,9 @@
 #include "ipasim/Logger.hpp"
 
 #include <cstdint>
+#include <mutex>
 #include <type_traits>
+#include <vector>
 
 namespace ipasim {
 
@@ -38,6 +40,8 @@ public:
   ObjCClass getClass() { return ObjCClass(Category, ClassData); }
   const char *getName();
   const char *getType();
+  // Returns `true` for class (`+`) methods and `false` for instance (`-`) ones.
+  bool isClassMethod();
 
   operator bool() { return MethodData; }
 
@@ -72,6 +76,7 @@ public:
 
   static constexpr const char *DataSegment = "__DATA";
 
+  const void *getHeader() { return Hdr; }
   template <typename T>
   const T *getSectionData(const char *SegName, const char *SectName,
                           size_t *Count = nullptr) {
@@ -94,6 +99,40 @@ private:
   ObjCMethod findMethod(const char *Section, uint64_t Addr);
 };
 
+// Objective-C methods of one Mach-O image sorted by their implementation
+// address, so that `MachO::findMethod` doesn't have to scan the whole image.
+// The index is built by the first lookup only from the image's static metadata
+// (base method lists of its classes and metaclasses and method lists of its
+// categories). Those contain every method implemented in the image. Method
+// lists the runtime attaches to classes when realizing them are either those
+// lists or lists of categories, so the index never gets stale and it doesn't
+// have to read `class_rw_t`s the runtime might be modifying. Only methods added
+// at runtime (e.g., by `class_addMethod`) are missing. The index can be used
+// from multiple threads (e.g., by the sampling profiler and the tracer).
+class ObjCMethodIndex {
+public:
+  // On a miss, falls back to `MachO::findMethod`, which searches also method
+  // lists of realized classes, so that methods added at runtime are found, too.
+  ObjCMethod find(MachO Image, uint64_t Addr);
+  // Finds method whose implementation starts closest before (or at) `Addr`
+  // and stores that start in `Start`. Only uses the index.
+  ObjCMethod findPreceding(MachO Image, uint64_t Addr, uint64_t &Start);
+
+private:
+  struct Entry {
+    uint64_t Addr; // Method's implementation
+    bool Category;
+    void *ClassData;
+    void *Methods; // `method_list_t` containing the method
+  };
+
+  std::once_flag Built;
+  std::vector<Entry> Entries; // Sorted by `Addr`, immutable once built
+
+  void build(MachO Image);
+  ObjCMethod findBuilt(uint64_t Addr);
+};
+
 } // namespace ipasim
 
 // !defined(IPASIM_MACHO_HPP)
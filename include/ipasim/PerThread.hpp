@@ -0,0 +1,152 @@
+// PerThread.hpp: Definition of class template `PerThread`.
+
+#ifndef IPASIM_PER_THREAD_HPP
+#define IPASIM_PER_THREAD_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace ipasim {
+
+// Holds one instance of `T` for every host thread that asks for it. Instances
+// are created on first use. If `Release` is specified, instance of a thread is
+// handed to it when the thread exits (so that it can be reused, for example).
+// Otherwise, instances live as long as the `PerThread` object and when the
+// system reuses ID of an exited thread, the new thread inherits the old
+// instance. The last instance returned to each thread is cached, so `get` is
+// usually just a thread-local read.
+template <typename T> class PerThread {
+public:
+  using Factory = std::function<std::unique_ptr<T>()>;
+  using Recycler = std::function<void(std::unique_ptr<T>)>;
+
+  // Instances are value-initialized unless `Create` is specified.
+  PerThread(Factory Create = []() { return std::make_unique<T>(); },
+            Recycler Release = nullptr)
+      : Id(NextId++), Create(std::move(Create)), Release(std::move(Release)) {
+    if (this->Release) {
+      Registry &R = getRegistry();
+      std::lock_guard<std::mutex> Lock(R.Mutex);
+      R.Live.emplace(Id, this);
+    }
+  }
+  PerThread(const PerThread &) = delete;
+  ~PerThread() {
+    if (Release) {
+      Registry &R = getRegistry();
+      std::lock_guard<std::mutex> Lock(R.Mutex);
+      R.Live.erase(Id);
+    }
+  }
+
+  // Returns instance of the current thread, creating it if needed.
+  T &get() {
+    if (T *Value = find())
+      return *Value;
+
+    // Note that the factory runs unlocked, so it can use other locks.
+    std::unique_ptr<T> Value(Create());
+    T *Ptr = Value.get();
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Values.emplace(std::this_thread::get_id(), std::move(Value));
+    }
+    if (Release)
+      Guard.Ids.push_back(Id);
+    Cache = {Id, Ptr};
+    return *Ptr;
+  }
+  // Returns instance of the current thread or `nullptr` if it has none.
+  T *find() {
+    if (Cache.Owner == Id)
+      return Cache.Value;
+
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto I = Values.find(std::this_thread::get_id());
+    if (I == Values.end())
+      return nullptr;
+    Cache = {Id, I->second.get()};
+    return Cache.Value;
+  }
+  // Calls `Func` for instances of all threads. They mustn't be created or
+  // destroyed meanwhile, but they can be in use.
+  template <typename F> void forEach(F &&Func) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto &[ThreadId, Value] : Values)
+      Func(*Value);
+  }
+  size_t size() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    return Values.size();
+  }
+
+private:
+  struct CacheEntry {
+    uint64_t Owner; // `Id` of the `PerThread` which `Value` belongs to
+    T *Value;
+  };
+  // Existing `PerThread`s with `Release` indexed by their `Id`s
+  struct Registry {
+    std::mutex Mutex;
+    std::unordered_map<uint64_t, PerThread *> Live;
+  };
+  // Releases instances of a thread when it exits.
+  struct ExitGuard {
+    std::vector<uint64_t> Ids; // Of `PerThread`s it has instances in
+
+    ~ExitGuard() {
+      if (Ids.empty())
+        return;
+      Registry &R = getRegistry();
+      std::lock_guard<std::mutex> Lock(R.Mutex);
+      for (uint64_t Id : Ids) {
+        auto I = R.Live.find(Id);
+        if (I != R.Live.end())
+          I->second->release();
+      }
+    }
+  };
+
+  // The registry is created on first use, so that it can be used by global
+  // `PerThread`s, too.
+  static Registry &getRegistry() {
+    static Registry R;
+    return R;
+  }
+  void release() {
+    std::unique_ptr<T> Value;
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      auto I = Values.find(std::this_thread::get_id());
+      if (I == Values.end())
+        return;
+      Value = std::move(I->second);
+      Values.erase(I);
+    }
+    if (Cache.Owner == Id)
+      Cache = {0, nullptr};
+    Release(std::move(Value));
+  }
+
+  // Objects are identified by IDs instead of addresses, so that cached
+  // pointers of a destroyed object cannot be mistaken for a new one's.
+  inline static std::atomic<uint64_t> NextId{1};
+  inline static thread_local CacheEntry Cache{0, nullptr};
+  inline static thread_local ExitGuard Guard;
+  const uint64_t Id;
+  Factory Create;
+  Recycler Release;
+  std::mutex Mutex;
+  std::unordered_map<std::thread::id, std::unique_ptr<T>> Values;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_PER_THREAD_HPP)
+#endif
@@ -0,0 +1,85 @@
+// PrelinkCache.hpp: Definition of class `PrelinkCache`.
+
+#ifndef IPASIM_PRELINK_CACHE_HPP
+#define IPASIM_PRELINK_CACHE_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace ipasim {
+
+// Describes a Mach-O image that has already been rebased and bound. Offsets are
+// relative to `Addr`.
+struct PrelinkedImage {
+  struct Segment {
+    uint64_t Offset, Size;
+    uint32_t Perms; // `uc_prot`
+  };
+  struct Symbol {
+    uint64_t NameOffset; // Names are stored inside the image
+    uint64_t Addr;
+  };
+  struct LazyBinding {
+    uint64_t PtrOffset, LibOffset, SymOffset;
+  };
+  // Library providing some symbol the image was bound to.
+  struct Dependency {
+    std::string Path;
+    uint64_t StartAddress;
+    uint64_t Hash; // See `DynamicLoader::hashBinary`
+  };
+
+  uint64_t Addr, Size; // Memory block containing the image
+  uint64_t StartAddress, Entrypoint, Imagebase; // See `LoadedDylib`
+  std::vector<Segment> Segments;
+  std::vector<Symbol> Symbols;
+  std::vector<LazyBinding> LazyBindings;
+  std::vector<Dependency> Dependencies;
+  // Names of all libraries from its load commands. They are loaded even if
+  // they didn't provide any bound symbol.
+  std::vector<std::string> Libraries;
+};
+
+// Persistent cache of prelinked images, similar to dyld's shared cache. Entries
+// are identified by path and hash of the original binary. An entry can only be
+// used if its image can be put at the same address as before and all its
+// dependencies are unchanged and loaded at the same addresses as before, too.
+// Contents of the image are stored at an offset aligned to allocation
+// granularity, so that they can be mapped copy-on-write (see `map`).
+class PrelinkCache {
+public:
+  PrelinkCache(std::filesystem::path Folder);
+
+  // Returns hash of size and last write time of file at `Path` (or 0 on
+  // failure). Contents are not read, because this is done on every load.
+  static uint64_t hashFile(const std::string &Path);
+  // Reads description of image of binary `Path` with hash `Hash`. On success,
+  // `In` is left positioned at contents of the image (which are `Img.Size`
+  // bytes long).
+  bool open(const std::string &Path, uint64_t Hash, PrelinkedImage &Img,
+            std::ifstream &In);
+  // Maps contents of the image opened by `open` copy-on-write at `Img.Addr`.
+  // Returns `nullptr` if that's not possible.
+  void *map(const std::string &Path, uint64_t Offset,
+            const PrelinkedImage &Img);
+  // Stores image `Img` (including its contents which are read from memory at
+  // `Img.Addr`).
+  void store(const std::string &Path, uint64_t Hash,
+             const PrelinkedImage &Img);
+  // Removes all entries. Entries of images that are currently mapped cannot be
+  // removed on Windows, so this should be done before any image is loaded.
+  void clear();
+
+private:
+  std::filesystem::path getEntryPath(const std::string &Path);
+
+  std::filesystem::path Folder;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_PRELINK_CACHE_HPP)
+#endif
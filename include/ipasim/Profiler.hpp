@@ -0,0 +1,111 @@
+// Profiler.hpp: Definition of classes `Profiler` and `ProfileScope`.
+
+#ifndef IPASIM_PROFILER_HPP
+#define IPASIM_PROFILER_HPP
+
+#include "ipasim/IpaSimulator/Config.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace ipasim {
+
+// Collects timed spans of startup phases (loading libraries, initializing the
+// Objective-C runtime, etc.). They can be written as Chrome trace JSON (which
+// can be opened in `chrome://tracing`) or summarized in a table. Spans are
+// recorded only if `ProfileStartup` is enabled and until `report` is called.
+class Profiler {
+public:
+  struct Span {
+    const char *Name;
+    std::string Detail;       // E.g., path of the loaded library
+    uint64_t Start, Duration; // In microseconds since the profiler's creation
+    uint32_t Thread, Depth;
+  };
+
+  Profiler();
+
+  bool isRecording() { return ProfileStartup && Recording; }
+  uint64_t now();
+  // Returns number of spans open in the current thread and increments it.
+  uint32_t enter();
+  void exit(Span &&S);
+  // Writes all spans as Chrome trace JSON.
+  void writeChromeTrace(std::ostream &OS);
+  // Writes total and self times of spans grouped by their names.
+  void writeSummary(std::ostream &OS);
+  // Stops recording, writes trace into the app's local folder and logs the
+  // summary.
+  void report();
+
+private:
+  static uint32_t getThreadIndex();
+
+  std::chrono::steady_clock::time_point Origin;
+  std::mutex Mutex;
+  std::vector<Span> Spans;
+  std::atomic<bool> Recording;
+};
+
+// Records a span from its construction until its destruction (or `end`). Does
+// nothing if `ProfileStartup` is disabled.
+class ProfileScope {
+public:
+  ProfileScope(Profiler &P, const char *Name) : P(P) {
+    if constexpr (ProfileStartup)
+      begin(Name, nullptr);
+  }
+  ProfileScope(Profiler &P, const char *Name, const std::string &Detail)
+      : P(P) {
+    if constexpr (ProfileStartup)
+      begin(Name, Detail.c_str());
+  }
+  ProfileScope(const ProfileScope &) = delete;
+  ~ProfileScope() {
+    if constexpr (ProfileStartup)
+      end();
+  }
+
+  void end() {
+    if constexpr (ProfileStartup)
+      if (Name) {
+        S.Name = Name;
+        S.Duration = P.now() - S.Start;
+        P.exit(std::move(S));
+        Name = nullptr;
+      }
+  }
+  // Ends the current span and begins a sibling one.
+  void next(const char *Name) {
+    if constexpr (ProfileStartup) {
+      std::string Detail(S.Detail);
+      end();
+      begin(Name, Detail.c_str());
+    }
+  }
+
+private:
+  void begin(const char *Name, const char *Detail) {
+    if (!P.isRecording())
+      return;
+    this->Name = Name;
+    if (Detail)
+      S.Detail = Detail;
+    S.Depth = P.enter();
+    S.Start = P.now();
+  }
+
+  Profiler &P;
+  const char *Name = nullptr; // `nullptr` if not recording
+  Profiler::Span S;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_PROFILER_HPP)
+#endif
@@ -0,0 +1,98 @@
+// SamplingProfiler.hpp: Definition of class `SamplingProfiler`.
+
+#ifndef IPASIM_SAMPLING_PROFILER_HPP
+#define IPASIM_SAMPLING_PROFILER_HPP
+
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/Emulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+#include "ipasim/LoadedLibrary.hpp"
+#include "ipasim/PerThread.hpp"
+
+#include <Windows.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace ipasim {
+
+// Statistical profiler of emulated code. A timer thread periodically interrupts
+// emulation in all threads (see `Emulator::interrupt`). Before resuming it,
+// `SysTranslator::execute` records PC, LR and the call stack, which is unwound
+// through the chain of frames R7 points to (as iOS ABI requires). Samples are
+// attributed to functions (Objective-C methods or exported symbols). They are
+// then summarized in a flat and a caller/callee profile and written in
+// collapsed-stack format, which `flamegraph.pl` can turn into a flame graph.
+// Note that LR holds the real caller only until the callee saves it and code
+// without frame pointers hides its callers, so stacks are approximate.
+class SamplingProfiler {
+public:
+  SamplingProfiler(Emulator &Emu, DynamicLoader &Dyld);
+  SamplingProfiler(const SamplingProfiler &) = delete;
+  ~SamplingProfiler();
+
+  // Starts taking `Frequency` (at most 1000) samples per second. Samples taken
+  // previously are discarded.
+  bool start(unsigned Frequency = SamplingFrequency);
+  void stop();
+  bool isRunning() { return Running; }
+  // `FP` is the frame pointer (R7).
+  void record(uint32_t PC, uint32_t LR, uint32_t FP);
+  // Adds time emulation was paused to take a sample. Note that this doesn't
+  // include the cost of stopping and restarting inside Unicorn.
+  template <typename DurationTy> void addPause(DurationTy Duration) {
+    PauseTime += std::chrono::duration_cast<std::chrono::nanoseconds>(Duration)
+                     .count();
+  }
+  // Stops sampling, logs the profiles and writes collapsed stacks into
+  // `guest-profile.folded` in the app's local folder.
+  void report();
+
+private:
+  struct Sample {
+    uint32_t PC, LR;
+    // Return addresses found by unwinding, innermost first
+    uint32_t FirstFrame, FrameCount; // In `ThreadSamples::Frames`
+  };
+  struct ThreadSamples {
+    std::mutex Mutex;
+    std::vector<Sample> Samples;
+    std::vector<uint32_t> Frames;
+  };
+  // Exported symbols sorted by address
+  using SymbolList = std::vector<std::pair<uint64_t, const char *>>;
+
+  static constexpr size_t ReportedRows = 25;
+  static constexpr size_t MaxFrames = 64;
+
+  void run();
+  // Returns name of function containing `Addr` in form `Library!Function` (or
+  // an empty string if it's not inside any library).
+  const std::string &getFunction(uint64_t Addr);
+  std::string findFunction(uint64_t Addr);
+  SymbolList &getSymbols(LoadedDylib &Dylib);
+
+  Emulator &Emu;
+  DynamicLoader &Dyld;
+  std::atomic<bool> Running;
+  std::thread Timer;
+  HANDLE TimerHandle, StopEvent;
+  std::atomic<size_t> Ticks;
+  std::atomic<uint64_t> PauseTime; // In nanoseconds, see `addPause`
+  std::chrono::steady_clock::time_point StartTime;
+  PerThread<ThreadSamples> Threads;
+  // These are only used by `report`.
+  std::unordered_map<uint64_t, std::string> Functions;
+  std::unordered_map<LoadedDylib *, SymbolList> Symbols;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_SAMPLING_PROFILER_HPP)
+#endif
@@ -0,0 +1,68 @@
+// StackPool.hpp: Definition of class `StackPool`.
+
+#ifndef IPASIM_STACK_POOL_HPP
+#define IPASIM_STACK_POOL_HPP
+
+#include "ipasim/Emulator.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace ipasim {
+
+// Represents one emulated stack. It grows down towards a guard page which is
+// mapped as inaccessible, so that stack overflows are caught by Unicorn.
+struct GuestStack {
+  uint64_t Addr;   // Start of the guard page
+  uint64_t Size;   // Usable size (not including the guard page)
+  size_t RefCount; // Number of active `SysTranslator::execute`s using it
+
+  uint64_t getBottom() const;
+  uint64_t getTop() const { return getBottom() + Size; }
+  bool contains(uint64_t SP) const {
+    return getBottom() <= SP && SP <= getTop();
+  }
+  bool isGuard(uint64_t Addr) const;
+};
+
+// Manages emulated stacks. Every host thread which runs emulated code gets its
+// own stack. Stacks are returned to the pool when the thread stops using them,
+// so that they can be reused later.
+class StackPool {
+public:
+  StackPool(Emulator &Emu, uint64_t StackSize);
+  StackPool(const StackPool &) = delete;
+  ~StackPool();
+
+  // Returns stack assigned to the current thread (or `nullptr` if a new one
+  // couldn't be allocated). Each successful call must be paired with a call to
+  // `release`.
+  GuestStack *acquire();
+  void release(GuestStack &Stack);
+  // Returns the stack containing `Addr` in its guard page.
+  GuestStack *findGuard(uint64_t Addr);
+  // Returns the maximum number of bytes the stack has ever used. It scans the
+  // stack, so it's only meant for reports.
+  static uint64_t getHighWaterMark(const GuestStack &Stack);
+  // Logs high-water marks of all stacks.
+  void reportUsage();
+
+private:
+  GuestStack *create();
+
+  Emulator &Emu;
+  uint64_t StackSize;
+  std::mutex Mutex;
+  std::vector<std::unique_ptr<GuestStack>> Stacks;
+  std::vector<GuestStack *> Free;
+  std::unordered_map<std::thread::id, GuestStack *> Assigned;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_STACK_POOL_HPP)
+#endif
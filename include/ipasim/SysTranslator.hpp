@@ -1,26 +1,180 @@
-// SysTranslator.hpp: Definition of classes `SysTranslator`, `DynamicCaller`,
-// `DynamicBackCaller` and `TypeDecoder`.
+// SysTranslator.hpp: Definition of classes `SysTranslator`, `TrampolinePool`,
+// `DynamicCaller`, `DeferredCall`, `DynamicBackCaller` and `TypeDecoder`.
 
 #ifndef IPASIM_SYS_TRANSLATOR_HPP
 #define IPASIM_SYS_TRANSLATOR_HPP
 
 #include "ipasim/DynamicLoader.hpp"
 #include "ipasim/Emulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
 #include "ipasim/LoadedLibrary.hpp"
+#include "ipasim/HostMemoryMapper.hpp"
+#include "ipasim/PerThread.hpp"
+#include "ipasim/StackPool.hpp"
 
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <deque>
 #include <ffi.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <stack>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace ipasim {
 
+// Native function that calls an emulated function (see
+// `SysTranslator::createTrampoline`).
+struct Trampoline {
+  ffi_cif CIF;
+  bool Returns;
+  size_t ArgC;
+  uint64_t Addr;
+  ffi_closure *Closure;
+  void *Ptr; // Executable address of `Closure`
+  size_t RefCount;
+};
+
+// Slab allocator of `Trampoline`s. Their closures are kept when they are freed,
+// so that reused trampolines don't need to allocate executable memory again.
+// Freed trampolines are quarantined first, so that a stale pointer to one of
+// them keeps hitting its poisoned closure (see `SysTranslator::release`) rather
+// than calling some unrelated function.
+class TrampolinePool {
+public:
+  TrampolinePool() = default;
+  TrampolinePool(const TrampolinePool &) = delete;
+  ~TrampolinePool();
+
+  Trampoline *allocate();
+  void free(Trampoline *Tr);
+
+private:
+  static constexpr size_t SlabSize = 64;
+  // Number of most recently freed trampolines that are not reused
+  static constexpr size_t QuarantineSize = 256;
+  std::vector<std::unique_ptr<Trampoline[]>> Slabs;
+  std::vector<Trampoline *> Free;
+  std::deque<Trampoline *> Quarantine;
+};
+
+// How a function passes its return value to the guest.
+enum class ReturnKind {
+  Void,
+  Word,       // In R0
+  DoubleWord, // In R0 and R1
+  Memory      // Into memory pointed to by hidden first argument
+};
+
+// Decoded Objective-C method signature. It's created from the method's type
+// encoding by `SysTranslator::getSignature`.
+struct MethodSignature {
+  // Argument as passed by the guest (i.e., according to iOS ABI).
+  struct Arg {
+    uint32_t Size, Alignment;
+    // Index of the argument's first word. Words 0-3 are registers R0-R3, the
+    // other ones are on the stack.
+    uint32_t Word;
+  };
+
+  ReturnKind Returns;
+  std::vector<Arg> Args;
+  uint32_t Words; // Total number of argument words (see `Arg::Word`)
+  // Prepared libffi call interface
+  ffi_cif CIF;
+  std::vector<ffi_type *> ArgTypes;
+  // Storage for struct types referenced from `CIF`
+  std::vector<std::unique_ptr<ffi_type>> StructTypes;
+  std::vector<std::unique_ptr<ffi_type *[]>> StructElements;
+};
+
+// Represents a dynamic call from the guest (emulated) into the host (native).
+// Arguments are stored in a fixed-size buffer, so that one instance can be
+// reused for all calls without allocating.
+class DynamicCaller {
+public:
+  // Maximum number of argument words (see `MethodSignature::Arg::Word`)
+  static constexpr size_t MaxWords = 64;
+
+  DynamicCaller(Emulator &Emu) : Emu(Emu) {}
+  // Reads arguments of function with signature `Sig` from emulated registers
+  // and stack.
+  void loadArgs(const MethodSignature &Sig);
+  void call(MethodSignature &Sig, uint32_t Addr);
+
+private:
+  Emulator &Emu;
+  uint32_t Words[MaxWords];
+  void *ArgPtrs[MaxWords]; // Every argument occupies at least one word.
+};
+
+// Type-erased `void()` function object with fixed-capacity inline storage.
+// Unlike `std::function`, it never allocates. Only trivially copyable function
+// objects (e.g., lambdas capturing pointers and integers) are supported.
+class DeferredCall {
+public:
+  static constexpr size_t Capacity = 48;
+
+  DeferredCall() : Invoke(nullptr) {}
+  DeferredCall(const DeferredCall &) = delete;
+
+  template <typename F> void set(F &&Func) {
+    using FuncTy = std::decay_t<F>;
+    static_assert(sizeof(FuncTy) <= Capacity, "Function object is too big.");
+    static_assert(alignof(FuncTy) <= alignof(std::max_align_t),
+                  "Function object is over-aligned.");
+    static_assert(std::is_trivially_copyable_v<FuncTy>,
+                  "Function object must be trivially copyable.");
+
+    new (Storage) FuncTy(std::forward<F>(Func));
+    Invoke = [](void *Storage) { (*reinterpret_cast<FuncTy *>(Storage))(); };
+  }
+  explicit operator bool() const { return Invoke; }
+  // Calls and clears the stored function object. It's called from a copy, so
+  // that it can set a new one while it's running (e.g., when it starts nested
+  // emulation).
+  void operator()() {
+    alignas(std::max_align_t) unsigned char Copy[Capacity];
+    std::memcpy(Copy, Storage, Capacity);
+    auto *InvokeCopy = Invoke;
+    Invoke = nullptr;
+    InvokeCopy(Copy);
+  }
+
+private:
+  alignas(std::max_align_t) unsigned char Storage[Capacity];
+  void (*Invoke)(void *);
+};
+
 // Represents the layer in our emulator that translates function calls between
 // the host (native libraries) and the guest (emulated libraries). It also
-// controls the whole execution in order to be able to do its job.
+// controls the whole execution in order to be able to do its job. Emulated code
+// can run in multiple host threads at once, each of them has its own execution
+// state (see `ThreadState`).
 class SysTranslator {
 public:
+  // Effectiveness of the cache of wrappers (see `handleFetchProtMem`).
+  struct WrapperCacheStats {
+    size_t Hits, Misses;
+  };
+  // Numbers of calls through native call gates (see `handleInterrupt`).
+  struct GateStats {
+    std::atomic<size_t> Direct, Deferred;
+  };
+
   SysTranslator(DynamicLoader &Dyld, Emulator &Emu)
-      : Dyld(Dyld), Emu(Emu), Restart(false), Continue(false),
-        RestartFromLRs(false) {}
+      : Dyld(Dyld), Emu(Emu),
+        Threads([&Emu]() { return std::make_unique<ThreadState>(Emu); }),
+        Stacks(Emu, StackSize), HostMemory(Emu, FaultGranule),
+        WrapperStats{0, 0}, GatesAddr(0), GateCount(0), Calls{{0}, {0}} {}
   // Starts executing the given library loaded by our `DynamicLoader`. The
   // library is initialized before `SysTranslator` starts executing its
   // entrypoint.
@@ -36,6 +190,14 @@ public:
   // their number is specified by `ArgC`. Similarly, the function can only
   // return a 32-bit-wide value or `void` (specified by `Returns`).
   void *translate(void *FP, size_t ArgC, bool Returns = false);
+  // Releases a function pointer returned by `translate`. Trampolines are shared
+  // by all translations of the same function, each of which holds a reference,
+  // and freed after the last one is released. Freed trampolines report an
+  // error if they are called. Returns the emulated function `FP` was
+  // translated from (or `FP` itself if it didn't need translation).
+  void *release(void *FP);
+  // Logs trampolines that haven't been released.
+  void reportTrampolines();
   // Dynamically calls a function from a library.
   template <typename... Args>
   void call(const std::string &Lib, const std::string &Func,
@@ -59,8 +221,16 @@ public:
   template <typename... ArgTys> void callBack(void *FP, ArgTys... Args);
   // Like `callBack` but also returns a 32-bit-wide value.
   template <typename... ArgTys> void *callBackR(void *FP, ArgTys... Args);
+  const WrapperCacheStats &getWrapperCacheStats() { return WrapperStats; }
+  const GateStats &getGateStats() { return Calls; }
+  // Logs how much of their emulated stacks have threads used.
+  void reportStackUsage() { Stacks.reportUsage(); }
+  // Logs how many times emulated code touched unmapped host memory.
+  void reportMemoryFaults() { HostMemory.reportFaults(); }
 
 private:
+  friend class Benchmarks;
+
   // Emulator hooks
   bool handleFetchProtMem(uc_mem_type Type, uint64_t Addr, int Size,
                           int64_t Value);
@@ -68,63 +238,93 @@ private:
   bool handleMemWrite(uc_mem_type Type, uint64_t Addr, int Size, int64_t Value);
   bool handleMemUnmapped(uc_mem_type Type, uint64_t Addr, int Size,
                          int64_t Value);
+  bool handleFetchUnmapped(uc_mem_type Type, uint64_t Addr, int Size,
+                           int64_t Value);
+  bool handleMemProt(uc_mem_type Type, uint64_t Addr, int Size, int64_t Value);
+  void handleInterrupt(uint32_t IntNo);
+  // Native call gates
+  void initGates();
+  uint64_t getGate(uint64_t Target);
+  bool findWrapper(uint64_t Addr, const LibraryInfo &LI, uint64_t &WrapperAddr);
+  MethodSignature *getSignature(const char *Types);
+  static std::unique_ptr<MethodSignature> createSignature(const char *Types);
   // Trampoline helpers
   void *createTrampoline(void *Addr, size_t ArgC, bool Returns);
   void handleTrampoline(void *Ret, void **Args, void *Data);
+  static void handleReleasedTrampolineStatic(ffi_cif *, void *Ret, void **Args,
+                                            void *Data);
   static void handleTrampolineStatic(ffi_cif *, void *Ret, void **Args,
                                      void *Data);
   // Execution control
   void returnToKernel();
   void returnToEmulation();
-  void continueOutsideEmulation(std::function<void()> &&Cont);
+  // Calling `uc_emu_start` inside `uc_emu_start` (e.g., inside a hook) is not
+  // very good idea. Instead, we need to call it when emulation completely stops
+  // (i.e., Unicorn returns from `uc_emu_start`). That's what this function is
+  // used for. All code that calls or could call `uc_emu_start` should be
+  // deferred using this function. See also
+  // <https://github.com/unicorn-engine/unicorn/issues/591>.
+  template <typename F> void continueOutsideEmulation(F &&Cont) {
+    ThreadState &T = Threads.get();
+    assert(!T.Continue && "Only one continuation is supported.");
+    T.Continue = true;
+    T.Continuation.set(std::forward<F>(Cont));
+
+    Emu.stop();
+  }
+  // Execution state of one host thread.
+  struct ThreadState {
+    ThreadState(Emulator &Emu)
+        : Restart(false), Continue(false), RestartFromLRs(false), Caller(Emu) {}
+
+    std::stack<uint32_t> LRs;               // Stack of return addresses
+    bool Restart, Continue, RestartFromLRs; // See `execute(uint64_t)`.
+    DeferredCall Continuation;              // See `continueOutsideEmulation`.
+    DynamicCaller Caller; // Used by `handleFetchProtMem`
+  };
 
   static constexpr ConstexprString WrapsPrefix = "$__ipaSim_wraps_";
   // TODO: Don't hardcode this.
   static constexpr uint64_t DLLBase = 0x1000; // Standard DLL base address
   DynamicLoader &Dyld;
   Emulator &Emu;
-  std::stack<uint32_t> LRs;               // Stack of return addresses
-  bool Restart, Continue, RestartFromLRs; // See `execute(uint64_t)`.
-  std::function<void()> Continuation;     // See `continueOutsideEmulation`.
-};
-
-// Represents a dynamic call from the guest (emulated) into the host (native).
-class DynamicCaller {
-public:
-  DynamicCaller(Emulator &Emu)
-      : Emu(Emu), RegId(UC_ARM_REG_R0), SP(Emu.readReg(UC_ARM_REG_SP)) {}
-  void loadArg(size_t Size);
-  bool call(bool Returns, uint32_t Addr);
-
-private:
-  template <size_t N> void call(bool Returns, uint32_t Addr) {
-    if (Returns)
-      call<N, N, true>(Addr);
-    else
-      call<N, N, false>(Addr);
-  }
-  template <size_t N, size_t C, bool Returns, typename... ArgTys>
-  void call(uint32_t Addr, ArgTys... Params) {
-    if constexpr (N > 0)
-      call<N - 1, C, Returns, ArgTys..., uint32_t>(Addr, Params...,
-                                                   Args[C - N]);
-    else
-      call<Returns, ArgTys...>(Addr, Params...);
-  }
-  template <bool Returns, typename... ArgTys>
-  void call(uint32_t Addr, ArgTys... Params) {
-    if constexpr (Returns) {
-      uint32_t RetVal =
-          reinterpret_cast<uint32_t (*)(ArgTys...)>(Addr)(Params...);
-      Emu.writeReg(UC_ARM_REG_R0, RetVal);
-    } else
-      reinterpret_cast<void (*)(ArgTys...)>(Addr)(Params...);
-  }
-
-  Emulator &Emu;
-  uc_arm_reg RegId;
-  uint32_t SP;
-  std::vector<uint32_t> Args;
+  PerThread<ThreadState> Threads;
+  std::vector<HookHandle> Hooks; // Installed by `execute(LoadedLibrary *)`
+  StackPool Stacks;
+  HostMemoryMapper HostMemory; // Used by `handleMemUnmapped`
+  // Protects the rest of the members and calls into `Dyld` from hooks. It's
+  // recursive, because loading a library can run native code that calls back
+  // into us (e.g., to translate a callback).
+  std::recursive_mutex Mutex;
+  // Maps functions inside non-wrapper DLLs to their wrappers (or to 0 if they
+  // don't have any). See `handleFetchProtMem`.
+  std::unordered_map<uint64_t, uint64_t> WrapperCache;
+  WrapperCacheStats WrapperStats;
+  // Existing trampolines. They are identified by target address, number of
+  // arguments and whether they return a value.
+  using TrampolineKey = std::tuple<uint64_t, size_t, bool>;
+  std::map<TrampolineKey, Trampoline *> Trampolines;
+  std::unordered_map<void *, Trampoline *> TrampolinesByPtr;
+  TrampolinePool TrampolineAlloc;
+  // Decoded method signatures indexed by type encodings and by their addresses
+  // (see `getSignature`).
+  std::unordered_map<std::string, std::unique_ptr<MethodSignature>> Signatures;
+  std::unordered_map<const char *, MethodSignature *> SignaturesByPtr;
+  // Native call gates. Lazy pointers to functions of wrapper DLLs are bound to
+  // these instead of the functions themselves (see `getGate`). Each gate is an
+  // `svc` handled by `handleInterrupt` followed by `bx lr`.
+  struct CallGate {
+    std::atomic<uint64_t> Target;
+    // Whether the target was seen calling back into emulated code
+    std::atomic<bool> Reentrant;
+  };
+  static constexpr size_t GateSize = 8;
+  static constexpr size_t MaxGates = 0x1000;
+  uint64_t GatesAddr;
+  std::unique_ptr<CallGate[]> Gates;
+  std::atomic<size_t> GateCount;
+  std::unordered_map<uint64_t, uint64_t> GatesByTarget;
+  GateStats Calls;
 };
 
 // Represents a dynamic call from the host (native) into the guest (emulated).
@@ -143,7 +343,10 @@ public:
       return reinterpret_cast<RetTy (*)(ArgTys...)>(FP)(Args...);
     } else {
       // Target load method is inside some emulated library.
-      pushArgs<UC_ARM_REG_R0>(Args...);
+      static_assert(sizeof...(ArgTys) <= ArgumentFrame::RegArgs,
+                    "Callback has too many arguments.");
+      uint32_t Words[] = {reinterpret_cast<uint32_t>(Args)..., 0};
+      Emu.writeArgs(Words, sizeof...(ArgTys));
       Sys.execute(Addr);
 
       // Fetch return value.
@@ -153,36 +356,36 @@ public:
   }
 
 private:
-  template <uc_arm_reg RegId> void pushArgs() {}
-  template <uc_arm_reg RegId, typename... ArgTys>
-  void pushArgs(void *Arg, ArgTys... Args) {
-    using namespace ipasim;
-
-    static_assert(UC_ARM_REG_R0 <= RegId && RegId <= UC_ARM_REG_R3,
-                  "Callback has too many arguments.");
-    Emu.writeReg(RegId, reinterpret_cast<uint32_t>(Arg));
-    pushArgs<RegId + 1>(Args...);
-  }
-
   DynamicLoader &Dyld;
   Emulator &Emu;
   SysTranslator &Sys;
-  std::vector<uint32_t> Args;
 };
 
 // Helper class for decoding Objective-C's type encodings.
 class TypeDecoder {
 public:
+  // Decoded type. Its size and alignment are those of iOS ABI.
+  struct Type {
+    ffi_type *FFI; // `nullptr` if the type is not supported
+    uint32_t Size, Alignment;
+    bool Composite; // `true` for structs, unions and arrays
+  };
+
   TypeDecoder(const char *T) : T(T) {}
-  size_t getNextTypeSize();
+  // Decodes the next type. Struct types are allocated inside `Sig`.
+  Type getNextType(MethodSignature &Sig);
   bool hasNext() { return *T; }
 
-  static const size_t InvalidSize = static_cast<size_t>(-1);
-
 private:
   const char *T;
 
-  size_t getNextTypeSizeImpl();
+  Type getNextTypeImpl(MethodSignature &Sig);
+  Type getCompositeType(MethodSignature &Sig, char End, bool Union);
+  static ffi_type *createStruct(MethodSignature &Sig,
+                                const std::vector<ffi_type *> &Fields);
+  void skipQualifiers();
+  void skipType();
+  void skipDigits();
 };
 
 // Implemented here because both definitions of `SysTranslator` and
@@ -39,7 +39,9 @@ private:
   void write(const winrt::hstring &S);
 };
 
-using LogStream = AggregateStream<DebugStream, TextBlockStream>;
+// Note that Mach-O images are loaded by multiple threads (see
+// `DynamicLoader::loadMachO`), so the log must be synchronized.
+using LogStream = SyncStream<AggregateStream<DebugStream, TextBlockStream>>;
 
 } // namespace ipasim
 
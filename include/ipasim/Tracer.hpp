@@ -0,0 +1,122 @@
+// Tracer.hpp: Definition of class `Tracer`.
+
+#ifndef IPASIM_TRACER_HPP
+#define IPASIM_TRACER_HPP
+
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/Emulator.hpp"
+#include "ipasim/PerThread.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ipasim {
+
+// Records execution of emulated code into a compact binary trace. Unlike
+// `PrintInstructions` and `PrintMemoryWrites`, it can be switched on and off at
+// runtime and its hooks cover only chosen address ranges (e.g., a library or a
+// function). Optionally, only every `Period`-th basic block is recorded. Traces
+// are symbolized later by `decode`, outside of the hot path. Table of loaded
+// libraries is stored in the trace, so that it can be decoded in another
+// session.
+class Tracer {
+public:
+  enum class RecordKind : uint8_t {
+    Block,       // Start of a sampled basic block
+    Instruction, // Followed by `InstructionRegs`
+    MemWrite,    // Followed by the written value (`uint64_t`)
+  };
+  // Every record starts with this header.
+  struct Record {
+    RecordKind Kind;
+    uint8_t Thread; // Index of the host thread (modulo 256)
+    uint16_t Reserved;
+    uint32_t Size; // Of the block, instruction or written value
+    uint32_t Addr;
+  };
+  // R0, R1, R7, R12, SP and LR
+  static constexpr size_t InstructionRegs = 6;
+
+  struct Options {
+    uint32_t Period = 1;       // Record every `Period`-th block
+    bool Instructions = false; // Record instructions of sampled blocks, too
+    // Record writes done by sampled blocks. This is expensive: Unicorn filters
+    // memory hooks by the accessed address rather than by the code doing the
+    // access, so every write of every thread (traced or not) goes through
+    // `handleMemWrite` and its generated code is slowed down while tracing is
+    // active. Hence it's off unless explicitly requested.
+    bool MemWrites = false;
+  };
+
+  Tracer(Emulator &Emu, DynamicLoader &Dyld);
+  Tracer(const Tracer &) = delete;
+
+  // Starts writing a trace into file at `Path` (stopping the previous one).
+  // Nothing is recorded until some range is added.
+  bool start(const std::string &Path, const Options &Opts);
+  // Records code in [`Begin`, `End`] (and writes into it if enabled).
+  void addRange(uint64_t Begin, uint64_t End);
+  // Records library at `Path`. It must already be loaded, because tracing can
+  // be requested from any thread, but libraries can only be loaded by the
+  // emulator.
+  bool addLibrary(const std::string &Path);
+  // Records exported symbol `Name` of Mach-O library `Lib`. It's assumed to
+  // span until the next exported symbol.
+  bool addSymbol(const std::string &Lib, const std::string &Name);
+  // Removes all hooks, flushes the trace and appends the library table to it.
+  void stop();
+  bool isActive() { return Active; }
+  // Converts trace at `Path` into text at `OutPath`. Addresses are symbolized
+  // using the trace's library table. Objective-C methods are named only if
+  // their library is loaded at the same address now (e.g., in the same
+  // session).
+  bool decode(const std::string &Path, const std::string &OutPath);
+
+private:
+  // Entry of the library table stored in traces
+  struct Library {
+    uint64_t StartAddress, Size;
+    std::string Path;
+  };
+  struct ThreadState {
+    std::mutex Mutex; // Protects everything below
+    std::vector<uint8_t> Buffer;
+    uint64_t Blocks = 0;
+    bool Sampled = false; // Whether the current block is recorded
+    // Address range of the last sampled block
+    uint64_t BlockBegin = 0, BlockEnd = 0;
+    uint8_t Index;
+  };
+
+  static constexpr size_t BufferSize = 0x10000; // 64 KiB
+
+  void handleBlock(uint64_t Addr, uint32_t Size);
+  void handleCode(uint64_t Addr, uint32_t Size);
+  bool handleMemWrite(uc_mem_type Type, uint64_t Addr, int Size,
+                      int64_t Value);
+  void append(ThreadState &T, RecordKind Kind, uint64_t Addr, uint32_t Size,
+              const void *Payload, size_t PayloadSize);
+  void flush(ThreadState &T);
+  void writeLibraries();
+  std::string symbolize(uint64_t Addr, const std::vector<Library> &Libs);
+
+  Emulator &Emu;
+  DynamicLoader &Dyld;
+  Options Opts;
+  std::atomic<bool> Active;
+  std::atomic<uint8_t> NextThread;
+  PerThread<ThreadState> Threads;
+  std::mutex Mutex; // Protects `Out`, `Hooks` and `Writes`
+  std::ofstream Out;
+  std::vector<HookHandle> Hooks;
+  HookHandle Writes; // Covers all addresses, see `handleMemWrite`
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_TRACER_HPP)
+#endif
@@ -0,0 +1,86 @@
+// WorkerPool.hpp: Definition of class `WorkerPool`.
+
+#ifndef IPASIM_WORKER_POOL_HPP
+#define IPASIM_WORKER_POOL_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace ipasim {
+
+// Runs `Work` on submitted items using a fixed number of worker threads. Items
+// are processed in order of their submission, but each submitter waits only for
+// its own items, so the pool can be shared.
+template <typename T> class WorkerPool {
+public:
+  WorkerPool(std::function<void(T &)> Work, unsigned Threads)
+      : Work(std::move(Work)), Stopping(false) {
+    if (!Threads)
+      Threads = std::max(std::thread::hardware_concurrency(), 1u);
+    Workers.reserve(Threads);
+    for (unsigned I = 0; I != Threads; ++I)
+      Workers.emplace_back([this]() { run(); });
+  }
+  WorkerPool(const WorkerPool &) = delete;
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Stopping = true;
+    }
+    Submitted.notify_all();
+    for (std::thread &Worker : Workers)
+      Worker.join();
+  }
+
+  void submit(T &Item) {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Todo.push_back(&Item);
+    }
+    Submitted.notify_one();
+  }
+  // Blocks until submitted `Item` is finished.
+  void wait(T &Item) {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    Finished.wait(Lock, [this, &Item]() { return Done.count(&Item) != 0; });
+    Done.erase(&Item);
+  }
+
+private:
+  void run() {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    for (;;) {
+      Submitted.wait(Lock, [this]() { return Stopping || !Todo.empty(); });
+      if (Todo.empty())
+        return;
+      T *Item = Todo.front();
+      Todo.pop_front();
+
+      Lock.unlock();
+      Work(*Item);
+      Lock.lock();
+
+      Done.insert(Item);
+      Finished.notify_all();
+    }
+  }
+
+  std::function<void(T &)> Work;
+  std::vector<std::thread> Workers;
+  std::mutex Mutex;
+  std::condition_variable Submitted, Finished;
+  std::deque<T *> Todo;
+  std::set<T *> Done;
+  bool Stopping;
+};
+
+} // namespace ipasim
+
+// !defined(IPASIM_WORKER_POOL_HPP)
+#endif
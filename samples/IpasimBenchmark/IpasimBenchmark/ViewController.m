@@ -9,6 +9,7 @@
 #import "ViewController.h"
 
 #import <objc/runtime.h>
+#import <pthread.h>
 
 @interface ViewController ()
 
@@ -23,8 +24,46 @@
 extern uint64_t dispatch_benchmark(size_t count, void (^block)(void));
 extern uint64_t dispatch_benchmark_f(size_t count, void *ctxt, void (*func)(void *));
 
+static const size_t scanSize = 64 << 20; // 64 MiB
+
 static void funcNoop(void *self) { [(__bridge ViewController *)self noop]; }
 static void staticNoop(void *ctx) {}
+static int compareInts(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+static void sortInts(void *ctx) {
+    // Native `qsort` calls emulated `compareInts` back for every comparison.
+    int values[] = { 3, 1, 2, 5, 4, 8, 7, 6 };
+    qsort(values, sizeof(values) / sizeof(*values), sizeof(*values), compareInts);
+}
+static void *guestBlocks(void *ctx) {
+    // Pure emulated code, so threads only contend inside the emulator itself.
+    volatile size_t result = 0;
+    for (size_t block = 0; block != 2000; ++block) {
+        size_t product = 1;
+        for (size_t i = 120; i != 0; --i)
+            product *= i;
+        result += product;
+    }
+    return NULL;
+}
+static void runThreads(void *ctx) {
+    // Every thread gets its own emulator engine when it enters emulated code.
+    size_t count = (size_t)ctx;
+    pthread_t threads[16];
+    for (size_t i = 0; i != count; ++i)
+        pthread_create(&threads[i], NULL, guestBlocks, NULL);
+    for (size_t i = 0; i != count; ++i)
+        pthread_join(threads[i], NULL);
+}
+static void scanBuffer(void *ctx) {
+    // Host-allocated memory is mapped into the emulator only when emulated code
+    // touches it, so the first scan of a fresh buffer measures the faults.
+    const uint8_t *buffer = ctx;
+    volatile uint32_t sum = 0;
+    for (size_t i = 0; i != scanSize; i += 64)
+        sum += buffer[i];
+}
 
 @implementation ViewController
 
@@ -74,6 +113,26 @@ static void staticNoop(void *ctx) {}
     [self benchmark:@"-[ViewController noop] (func)" count:count ctx:(__bridge void *)(self) func:funcNoop];
 
     [self benchmark:@"staticNoop" count:count ctx:NULL func:staticNoop];
+
+    [self benchmark:@"qsort (callback round trips)" count:count ctx:NULL func:sortInts];
+
+    uint8_t *buffer = malloc(scanSize);
+    memset(buffer, 1, scanSize);
+    [self benchmark:@"64 MiB scan (first touch)" count:1 ctx:buffer func:scanBuffer];
+    [self benchmark:@"64 MiB scan (mapped)" count:10 ctx:buffer func:scanBuffer];
+    free(buffer);
+
+    // Each thread does the same amount of work, so ideally, times don't grow
+    // and the speedup over one thread equals the number of threads (up to the
+    // number of cores).
+    uint64_t singleTime = 0;
+    for (size_t threads = 1; threads <= 16; threads *= 2) {
+        uint64_t time = dispatch_benchmark_f(5, (void *)threads, runThreads);
+        if (threads == 1)
+            singleTime = time;
+        double speedup = time ? (double)(threads * singleTime) / time : 0;
+        [self log:[NSString stringWithFormat:@"guest blocks on %zu threads: %llu (speedup %.2f, efficiency %.0f %%)", threads, time, speedup, speedup * 100 / threads]];
+    }
     
     [self benchmark:@"objc_getClass (block)" count:count block:^{
         objc_getClass("ViewController");
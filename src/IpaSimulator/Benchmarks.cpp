@@ -0,0 +1,191 @@
+// Benchmarks.cpp: Implementation of class `Benchmarks`.
+
+#include "ipasim/Benchmarks.hpp"
+
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/LoadedLibrary.hpp"
+
+#include <iomanip>
+#include <map>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace ipasim;
+using namespace std;
+
+void Benchmarks::run() {
+  Log.info() << "running benchmarks" << Log.end();
+  lookup();
+  signatures();
+  continuations();
+}
+
+void Benchmarks::report(const char *Name, size_t N, double Before,
+                        double After) {
+  ostringstream Str;
+  Str << fixed << setprecision(1) << Before << " ns before, " << After
+      << " ns after (" << (After ? Before / After : 0.0) << "x)";
+  Log.info() << "benchmark " << Name << " (" << N << "): " << Str.str()
+             << Log.end();
+}
+
+// Libraries are laid out as the loader lays them out, i.e., they don't overlap
+// and there are gaps between them. Addresses are looked up in random order
+// (the worst case for the last-hit cache) and then all inside one library.
+void Benchmarks::lookup() {
+  constexpr size_t Lookups = 1000000;
+  for (size_t Count : {50, 200, 1000}) {
+    vector<unique_ptr<LoadedDll>> Libs;
+    map<string, LoadedLibrary *> ByPath; // How `LLs` was scanned before
+    map<uint64_t, LoadedLibrary *> ByAddr; // Like `DynamicLoader::LLsByAddr`
+    for (size_t I = 0; I != Count; ++I) {
+      auto L = make_unique<LoadedDll>();
+      L->StartAddress = 0x10000000 + I * 0x100000;
+      L->Size = 0x80000;
+      ByPath["lib" + to_string(I) + ".dll"] = L.get();
+      ByAddr[L->StartAddress] = L.get();
+      Libs.push_back(move(L));
+    }
+
+    mt19937 Gen(42);
+    uniform_int_distribution<size_t> Lib(0, Count - 1), Offset(0, 0x7ffff);
+    vector<uint64_t> Random(Lookups), Local(Lookups);
+    for (size_t I = 0; I != Lookups; ++I) {
+      Random[I] = Libs[Lib(Gen)]->StartAddress + Offset(Gen);
+      Local[I] = Libs[Count / 2]->StartAddress + Offset(Gen);
+    }
+
+    volatile uint64_t Sink = 0;
+    auto Linear = [&](const vector<uint64_t> &Addrs) {
+      return measure(Lookups, [&](size_t I) {
+        for (auto &[Path, L] : ByPath)
+          if (L->isInRange(Addrs[I])) {
+            Sink = Sink + L->StartAddress;
+            break;
+          }
+      });
+    };
+    auto Indexed = [&](const vector<uint64_t> &Addrs) {
+      LoadedLibrary *Last = nullptr;
+      return measure(Lookups, [&](size_t I) {
+        uint64_t Addr = Addrs[I];
+        if (!Last || !Last->isInRange(Addr)) {
+          auto It = ByAddr.upper_bound(Addr);
+          if (It == ByAddr.begin())
+            return;
+          --It;
+          if (!It->second->isInRange(Addr))
+            return;
+          Last = It->second;
+        }
+        Sink = Sink + Last->StartAddress;
+      });
+    };
+    report("lookup (random)", Count, Linear(Random), Indexed(Random));
+    report("lookup (same library)", Count, Linear(Local), Indexed(Local));
+  }
+}
+
+// Type strings are taken from section `__objc_methtype` of loaded images, so
+// the mix of signatures is the one the app actually uses.
+void Benchmarks::signatures() {
+  vector<const char *> Types;
+  Dyld.forEachLoaded([&](const LibraryInfo &LI) {
+    if (!LI.Lib->hasMachO())
+      return;
+    size_t Count;
+    auto *Data = LI.Lib->getMachO().getSectionData<char>(
+        "__TEXT", "__objc_methtype", &Count);
+    if (!Data)
+      return;
+    for (const char *S = Data, *End = Data + Count; S < End;
+         S += strlen(S) + 1)
+      if (*S)
+        Types.push_back(S);
+  });
+  if (Types.empty()) {
+    Log.warning() << "benchmark signatures: no type strings found"
+                  << Log.end();
+    return;
+  }
+
+  size_t Count = Types.size() < 100000 ? 100000 : Types.size();
+  lock_guard<recursive_mutex> Lock(Sys.Mutex);
+  for (const char *T : Types)
+    Sys.getSignature(T);
+
+  volatile uintptr_t Sink = 0;
+  double Before = measure(Count, [&](size_t I) {
+    auto Sig = SysTranslator::createSignature(Types[I % Types.size()]);
+    Sink = Sink + (Sig ? 1 : 0);
+  });
+  double After = measure(Count, [&](size_t I) {
+    MethodSignature *Sig = Sys.getSignature(Types[I % Types.size()]);
+    Sink = Sink + reinterpret_cast<uintptr_t>(Sig);
+  });
+  report("signatures", Types.size(), Before, After);
+}
+
+// The continuation captures the same things as the one of dynamic calls in
+// `SysTranslator::handleFetchProtMem`. Whether `std::function` allocates for it
+// depends on the size of its inline buffer, so both are measured as they are.
+// Argument buffers are filled like `DynamicCaller::loadArgs` fills them for a
+// method with 6 argument words.
+void Benchmarks::continuations() {
+  constexpr size_t Calls = 1000000;
+  constexpr uint32_t Words = 6;
+  volatile uintptr_t Sink = 0;
+  auto *Caller = reinterpret_cast<DynamicCaller *>(&Sink);
+  auto *Sig = reinterpret_cast<MethodSignature *>(&Sink);
+
+  function<void()> Function;
+  double Before = measure(Calls, [&](size_t I) {
+    uint32_t Addr = static_cast<uint32_t>(I);
+    Function = [&Sink, Caller, Sig, Addr]() {
+      Sink = Sink + reinterpret_cast<uintptr_t>(Caller) +
+             reinterpret_cast<uintptr_t>(Sig) + Addr;
+    };
+    Function();
+    Function = nullptr;
+  });
+  DeferredCall Deferred;
+  double After = measure(Calls, [&](size_t I) {
+    uint32_t Addr = static_cast<uint32_t>(I);
+    Deferred.set([&Sink, Caller, Sig, Addr]() {
+      Sink = Sink + reinterpret_cast<uintptr_t>(Caller) +
+             reinterpret_cast<uintptr_t>(Sig) + Addr;
+    });
+    Deferred();
+  });
+  report("continuations", Calls, Before, After);
+
+  struct Buffers {
+    vector<uint32_t> Words;
+  };
+  Before = measure(Calls, [&](size_t I) {
+    auto B = make_unique<Buffers>();
+    B->Words.resize(Words);
+    vector<void *> ArgPtrs;
+    for (uint32_t W = 0; W != Words; ++W) {
+      B->Words[W] = static_cast<uint32_t>(I + W);
+      ArgPtrs.push_back(&B->Words[W]);
+    }
+    Sink = Sink + *reinterpret_cast<uint32_t *>(ArgPtrs.back());
+  });
+  uint32_t FixedWords[DynamicCaller::MaxWords];
+  void *FixedPtrs[DynamicCaller::MaxWords];
+  After = measure(Calls, [&](size_t I) {
+    for (uint32_t W = 0; W != Words; ++W) {
+      FixedWords[W] = static_cast<uint32_t>(I + W);
+      FixedPtrs[W] = &FixedWords[W];
+    }
+    Sink = Sink + *reinterpret_cast<uint32_t *>(FixedPtrs[Words - 1]);
+  });
+  report("dynamic call buffers", Calls, Before, After);
+}
@@ -0,0 +1,395 @@
+// DyldInfo.cpp: Implementation of class `DyldInfo`.
+
+#include "ipasim/DyldInfo.hpp"
+
+#include "ipasim/Common.hpp"
+#include "ipasim/IpaSimulator.hpp"
+
+#include <llvm/BinaryFormat/MachO.h>
+
+using namespace ipasim;
+using namespace llvm::MachO;
+using namespace std;
+
+namespace {
+
+// Reads opcode streams. Note that reading past the end doesn't crash, it only
+// sets flag `Error`.
+class OpcodeReader {
+public:
+  OpcodeReader(const uint8_t *Begin, const uint8_t *End)
+      : P(Begin), End(End), Error(false) {}
+
+  bool atEnd() { return P == End; }
+  bool failed() { return Error; }
+  uint8_t readByte() {
+    if (P == End) {
+      Error = true;
+      return BIND_OPCODE_DONE;
+    }
+    return *P++;
+  }
+  uint64_t readULEB() {
+    uint64_t Result = 0;
+    for (unsigned Shift = 0;; Shift += 7) {
+      if (P == End || Shift >= 64) {
+        Error = true;
+        return 0;
+      }
+      uint8_t Byte = *P++;
+      Result |= static_cast<uint64_t>(Byte & 0x7f) << Shift;
+      if (!(Byte & 0x80))
+        return Result;
+    }
+  }
+  int64_t readSLEB() {
+    int64_t Result = 0;
+    for (unsigned Shift = 0;; Shift += 7) {
+      if (P == End || Shift >= 64) {
+        Error = true;
+        return 0;
+      }
+      uint8_t Byte = *P++;
+      Result |= static_cast<int64_t>(Byte & 0x7f) << Shift;
+      if (!(Byte & 0x80)) {
+        // Sign-extend.
+        if ((Byte & 0x40) && Shift + 7 < 64)
+          Result |= -(static_cast<int64_t>(1) << (Shift + 7));
+        return Result;
+      }
+    }
+  }
+  const char *readString() {
+    auto *Str = reinterpret_cast<const char *>(P);
+    while (P != End && *P)
+      ++P;
+    if (P == End) {
+      Error = true;
+      return nullptr;
+    }
+    ++P; // Skip the null terminator.
+    return Str;
+  }
+
+private:
+  const uint8_t *P, *End;
+  bool Error;
+};
+
+} // namespace
+
+DyldInfo::DyldInfo(const void *Hdr, uint64_t Slide)
+    : Slide(Slide), Info(nullptr), Symtab(nullptr) {
+  auto *Header = reinterpret_cast<const mach_header *>(Hdr);
+  auto *Cmd = reinterpret_cast<const load_command *>(Header + 1);
+  for (size_t I = 0, IEnd = Header->ncmds; I != IEnd; ++I) {
+    switch (Cmd->cmd) {
+    case LC_SEGMENT:
+      Segments.push_back(reinterpret_cast<const segment_command *>(Cmd));
+      break;
+    case LC_DYLD_INFO:
+    case LC_DYLD_INFO_ONLY:
+      Info = reinterpret_cast<const dyld_info_command *>(Cmd);
+      break;
+    case LC_SYMTAB:
+      Symtab = reinterpret_cast<const symtab_command *>(Cmd);
+      break;
+    case LC_LOAD_DYLIB:
+    case LC_LOAD_WEAK_DYLIB:
+    case LC_REEXPORT_DYLIB:
+    case LC_LOAD_UPWARD_DYLIB:
+    case LC_LAZY_LOAD_DYLIB: {
+      auto *Lib = reinterpret_cast<const dylib_command *>(Cmd);
+      const char *Name = reinterpret_cast<const char *>(Cmd) + Lib->dylib.name;
+      Libraries.push_back(Name);
+      if (Cmd->cmd == LC_REEXPORT_DYLIB)
+        Reexports.push_back(Name);
+      break;
+    }
+    }
+
+    // Move to the next `load_command`.
+    Cmd = reinterpret_cast<const load_command *>(bytes(Cmd) + Cmd->cmdsize);
+  }
+}
+
+bool DyldInfo::rebase() {
+  if (!Info->rebase_size || !Slide)
+    return true;
+  const uint8_t *Begin = getFileData(Info->rebase_off, Info->rebase_size);
+  if (!Begin)
+    return false;
+
+  OpcodeReader R(Begin, Begin + Info->rebase_size);
+  uint32_t SegIndex = 0;
+  uint64_t Offset = 0;
+  uint32_t *Ptr;
+  auto DoRebase = [&]() {
+    if (!getAddress(SegIndex, Offset, Ptr))
+      return false;
+    // We actively leave NULL pointers untouched. Technically it would be
+    // correct to slide them because the PAGEZERO segment slid, too. But
+    // programs probably wouldn't be happy if their NULLs were non-zero.
+    // TODO: Solve this as the original dyld does. Maybe by always mapping
+    // PAGEZERO to address 0 or something like that.
+    if (*Ptr != 0)
+      *Ptr += static_cast<uint32_t>(Slide);
+    Offset += sizeof(uint32_t);
+    return true;
+  };
+
+  while (!R.atEnd()) {
+    uint8_t Byte = R.readByte();
+    uint8_t Imm = Byte & REBASE_IMMEDIATE_MASK;
+    switch (Byte & REBASE_OPCODE_MASK) {
+    case REBASE_OPCODE_DONE:
+      return true;
+    case REBASE_OPCODE_SET_TYPE_IMM:
+      if (Imm != REBASE_TYPE_POINTER && Imm != REBASE_TYPE_TEXT_ABSOLUTE32) {
+        Log.error() << "unsupported rebase type " << static_cast<unsigned>(Imm)
+                    << Log.end();
+        return false;
+      }
+      break;
+    case REBASE_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+      SegIndex = Imm;
+      Offset = R.readULEB();
+      break;
+    case REBASE_OPCODE_ADD_ADDR_ULEB:
+      Offset += R.readULEB();
+      break;
+    case REBASE_OPCODE_ADD_ADDR_IMM_SCALED:
+      Offset += Imm * sizeof(uint32_t);
+      break;
+    case REBASE_OPCODE_DO_REBASE_IMM_TIMES:
+      for (uint8_t I = 0; I != Imm; ++I)
+        if (!DoRebase())
+          return false;
+      break;
+    case REBASE_OPCODE_DO_REBASE_ULEB_TIMES:
+      for (uint64_t I = 0, Count = R.readULEB(); I != Count; ++I)
+        if (!DoRebase())
+          return false;
+      break;
+    case REBASE_OPCODE_DO_REBASE_ADD_ADDR_ULEB:
+      if (!DoRebase())
+        return false;
+      Offset += R.readULEB();
+      break;
+    case REBASE_OPCODE_DO_REBASE_ULEB_TIMES_SKIPPING_ULEB: {
+      uint64_t Count = R.readULEB();
+      uint64_t Skip = R.readULEB();
+      for (uint64_t I = 0; I != Count; ++I) {
+        if (!DoRebase())
+          return false;
+        Offset += Skip;
+      }
+      break;
+    }
+    default:
+      Log.error() << "unsupported rebase opcode 0x" << to_hex_string(Byte)
+                  << Log.end();
+      return false;
+    }
+    if (R.failed()) {
+      Log.error("malformed rebase opcodes");
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DyldInfo::bind(const Resolver &Resolve) {
+  // TODO: Handle also weak bindings.
+  if (!Info->bind_size)
+    return true;
+  const uint8_t *Begin = getFileData(Info->bind_off, Info->bind_size);
+  return Begin && bind(Begin, Begin + Info->bind_size, &Resolve, nullptr);
+}
+
+bool DyldInfo::bindLazy(const LazyBinder &Bind) {
+  if (!Info->lazy_bind_size)
+    return true;
+  const uint8_t *Begin = getFileData(Info->lazy_bind_off, Info->lazy_bind_size);
+  return Begin && bind(Begin, Begin + Info->lazy_bind_size, nullptr, &Bind);
+}
+
+// Exactly one of `Resolve` and `Bind` must be non-null. The latter is used for
+// lazy bindings.
+bool DyldInfo::bind(const uint8_t *Begin, const uint8_t *End,
+                    const Resolver *Resolve, const LazyBinder *Bind) {
+  bool Lazy = Bind;
+  OpcodeReader R(Begin, End);
+  int64_t LibOrdinal = 0;
+  const char *SymName = nullptr;
+  uint8_t SymFlags = 0;
+  int64_t Addend = 0;
+  uint32_t SegIndex = 0;
+  uint64_t Offset = 0;
+  // Address of the current symbol. It's resolved only when it's first needed.
+  uint64_t SymAddr = 0;
+  bool Resolved = false;
+  uint32_t *Ptr;
+  auto DoBind = [&]() {
+    if (!getAddress(SegIndex, Offset, Ptr))
+      return false;
+    if (!Resolved) {
+      Resolved = true;
+      SymAddr = 0;
+      if (LibOrdinal <= 0 ||
+          static_cast<uint64_t>(LibOrdinal) > Libraries.size())
+        // TODO: Support also special library ordinals.
+        Log.error() << "unsupported library ordinal " << LibOrdinal
+                    << " of symbol " << SymName << Log.end();
+      else if (!SymName)
+        Log.error("bind opcodes without symbol");
+      else if (Lazy) {
+        // Every lazy pointer has its own symbol-setting opcodes.
+        Resolved = false;
+        SymAddr = (*Bind)(Ptr, Libraries[LibOrdinal - 1], SymName);
+      } else {
+        SymAddr = (*Resolve)(Libraries[LibOrdinal - 1], SymName);
+        if (!SymAddr && !(SymFlags & BIND_SYMBOL_FLAGS_WEAK_IMPORT))
+          Log.error() << "external symbol " << SymName << " from library "
+                      << Libraries[LibOrdinal - 1] << " couldn't be resolved"
+                      << Log.end();
+      }
+    }
+    if (SymAddr)
+      *Ptr = static_cast<uint32_t>(SymAddr + (Lazy ? 0 : Addend));
+    Offset += sizeof(uint32_t);
+    return true;
+  };
+
+  while (!R.atEnd()) {
+    uint8_t Byte = R.readByte();
+    uint8_t Imm = Byte & BIND_IMMEDIATE_MASK;
+    switch (Byte & BIND_OPCODE_MASK) {
+    case BIND_OPCODE_DONE:
+      // Lazy binding info consists of many sequences terminated by this
+      // opcode.
+      if (!Lazy)
+        return true;
+      break;
+    case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+      LibOrdinal = Imm;
+      Resolved = false;
+      break;
+    case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+      LibOrdinal = R.readULEB();
+      Resolved = false;
+      break;
+    case BIND_OPCODE_SET_DYLIB_SPECIAL_IMM:
+      // Special ordinals are negative.
+      LibOrdinal = Imm ? static_cast<int8_t>(BIND_OPCODE_MASK | Imm) : 0;
+      Resolved = false;
+      break;
+    case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM:
+      SymName = R.readString();
+      SymFlags = Imm;
+      Resolved = false;
+      break;
+    case BIND_OPCODE_SET_TYPE_IMM:
+      if (Imm != BIND_TYPE_POINTER) {
+        Log.error() << "unsupported bind type " << static_cast<unsigned>(Imm)
+                    << Log.end();
+        return false;
+      }
+      break;
+    case BIND_OPCODE_SET_ADDEND_SLEB:
+      Addend = R.readSLEB();
+      break;
+    case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+      SegIndex = Imm;
+      Offset = R.readULEB();
+      break;
+    case BIND_OPCODE_ADD_ADDR_ULEB:
+      Offset += R.readULEB();
+      break;
+    case BIND_OPCODE_DO_BIND:
+      if (!DoBind())
+        return false;
+      break;
+    case BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB:
+      if (!DoBind())
+        return false;
+      Offset += R.readULEB();
+      break;
+    case BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED:
+      if (!DoBind())
+        return false;
+      Offset += Imm * sizeof(uint32_t);
+      break;
+    case BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB: {
+      uint64_t Count = R.readULEB();
+      uint64_t Skip = R.readULEB();
+      for (uint64_t I = 0; I != Count; ++I) {
+        if (!DoBind())
+          return false;
+        Offset += Skip;
+      }
+      break;
+    }
+    default:
+      Log.error() << "unsupported bind opcode 0x" << to_hex_string(Byte)
+                  << Log.end();
+      return false;
+    }
+    if (R.failed()) {
+      Log.error("malformed bind opcodes");
+      return false;
+    }
+  }
+  return true;
+}
+
+void DyldInfo::forEachSymbol(
+    const function<void(const char *Name, uint64_t Value)> &Func) {
+  if (!Symtab || !Symtab->nsyms)
+    return;
+  auto *Syms = reinterpret_cast<const nlist *>(
+      getFileData(Symtab->symoff, Symtab->nsyms * sizeof(nlist)));
+  auto *Strings = reinterpret_cast<const char *>(
+      getFileData(Symtab->stroff, Symtab->strsize));
+  if (!Syms || !Strings)
+    return;
+
+  for (const nlist *Sym = Syms, *End = Syms + Symtab->nsyms; Sym != End;
+       ++Sym) {
+    // Skip debugging, undefined (i.e., imported) and non-exported symbols.
+    // Local symbols could otherwise shadow exported ones with the same name.
+    if ((Sym->n_type & N_STAB) || (Sym->n_type & N_TYPE) == N_UNDF ||
+        !(Sym->n_type & N_EXT) || (Sym->n_type & N_PEXT) ||
+        Sym->n_strx >= Symtab->strsize)
+      continue;
+    uint64_t Addr = Sym->n_value;
+    if ((Sym->n_type & N_TYPE) != N_ABS)
+      Addr += Slide;
+    Func(Strings + Sym->n_strx, Addr);
+  }
+}
+
+// Finds data at `FileOffset` inside the loaded image.
+const uint8_t *DyldInfo::getFileData(uint32_t FileOffset, uint32_t Size) {
+  for (const segment_command *Seg : Segments)
+    if (Seg->fileoff <= FileOffset &&
+        FileOffset + Size <= Seg->fileoff + Seg->filesize)
+      return reinterpret_cast<const uint8_t *>(Seg->vmaddr + Slide +
+                                               (FileOffset - Seg->fileoff));
+  Log.error("dyld info out of range");
+  return nullptr;
+}
+
+bool DyldInfo::getAddress(uint32_t SegIndex, uint64_t Offset, uint32_t *&Ptr) {
+  if (SegIndex >= Segments.size()) {
+    Log.error() << "segment index " << SegIndex << " out of range" << Log.end();
+    return false;
+  }
+  const segment_command *Seg = Segments[SegIndex];
+  if (Offset + sizeof(uint32_t) > Seg->vmsize) {
+    Log.error("fixup target out of range");
+    return false;
+  }
+  Ptr = reinterpret_cast<uint32_t *>(Seg->vmaddr + Slide + Offset);
+  return true;
+}
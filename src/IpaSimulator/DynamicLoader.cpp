@@ -3,10 +3,19 @@
 #include "ipasim/DynamicLoader.hpp"
 
 #include "ipasim/Common.hpp"
+#include "ipasim/DyldInfo.hpp"
+#include "ipasim/IpaArchive.hpp"
 #include "ipasim/IpaSimulator.hpp"
 #include "ipasim/IpaSimulator/Config.hpp"
+#include "ipasim/WorkerPool.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <deque>
 #include <filesystem>
+#include <fstream>
+#include <llvm/BinaryFormat/MachO.h>
+#include <mutex>
 #include <psapi.h> // For `GetModuleInformation`
 #include <winrt/Windows.ApplicationModel.h>
 #include <winrt/Windows.Storage.h>
@@ -18,6 +27,9 @@ using namespace Windows::ApplicationModel;
 using namespace Windows::Storage;
 
 bool BinaryPath::isFileValid() const {
+  // Archived paths are resolved only to existing entries.
+  if (Archived)
+    return true;
   if (Relative) {
     return Package::Current()
                .InstalledLocation()
@@ -33,7 +45,9 @@ bool BinaryPath::isFileValid() const {
   }
 }
 
-DynamicLoader::DynamicLoader(Emulator &Emu) : Emu(Emu) {
+DynamicLoader::DynamicLoader(Emulator &Emu)
+    : Emu(Emu), Archive(nullptr), LazyBindCount(0), PrelinkHits(0),
+      PrelinkMisses(0) {
   // Map "kernel" page.
   void *KernelPtr =
       _aligned_malloc(DynamicLoader::PageSize, DynamicLoader::PageSize);
@@ -47,6 +61,7 @@ LoadedLibrary *DynamicLoader::load(const string &Path) {
   auto I = LLs.find(BP.Path);
   if (I != LLs.end())
     return I->second.get();
+  ProfileScope Scope(IpaSim.Prof, "load", BP.Path);
 
   // Check that file exists.
   if (!BP.isFileValid()) {
@@ -57,8 +72,8 @@ LoadedLibrary *DynamicLoader::load(const string &Path) {
   Log.info() << "loading library " << BP.Path << "...\n";
 
   LoadedLibrary *L;
-  if (LIEF::MachO::is_macho(BP.Path))
-    L = loadMachO(BP.Path);
+  if (isMachO(BP))
+    L = loadMachO(BP);
   else if (LIEF::PE::is_pe(BP.Path))
     L = loadPE(BP.Path);
   else {
@@ -80,6 +95,7 @@ void DynamicLoader::registerMachO(const void *Hdr) {
   if (!HdrSet.insert(HdrPtr).second)
     return;
   Hdrs.push_back(Hdr);
+  ProfileScope Scope(IpaSim.Prof, "registerMachO");
 
   // Fix some bindings.
   size_t Count;
@@ -109,7 +125,9 @@ void DynamicLoader::handleMachOs(size_t HdrOffset, size_t HandlerOffset) {
   for (auto I = Handlers.begin() + HandlerOffset, End = Handlers.end();
        I != End; ++I) {
     MachOHandler &Handler = *I;
+    ProfileScope Scope(IpaSim.Prof, "objc mapped");
     Handler.Mapped(Headers.size(), Paths.data(), Headers.data());
+    Scope.next("objc init");
     for (ptrdiff_t I = Hdrs.size() - 1, End = HdrOffset - 1; I != End; --I)
       // TODO: Find out path from `LLs`.
       Handler.Init(nullptr, Hdrs[I]);
@@ -133,6 +151,20 @@ bool DynamicLoader::canSegmentsSlide(LIEF::MachO::Binary &Bin) {
 }
 
 BinaryPath DynamicLoader::resolvePath(const string &Path) {
+  if (Archive) {
+    // Paths relative to the app are resolved inside the `.ipa` archive.
+    const string &Bundle = Archive->getBundle();
+    string Entry;
+    if (startsWith(Path, "@executable_path/"))
+      Entry = Bundle + Path.substr(sizeof("@executable_path/") - 1);
+    else if (startsWith(Path, "@rpath/"))
+      Entry = Bundle + "Frameworks/" + Path.substr(sizeof("@rpath/") - 1);
+    else if (startsWith(Path, Bundle))
+      Entry = Path;
+    if (!Entry.empty() && Archive->find(Entry))
+      return BinaryPath{move(Entry), /* Relative */ false, /* Archived */ true};
+  }
+
   if (!Path.empty() && Path[0] == '/') {
     // This path is something like
     // `/System/Library/Frameworks/Foundation.framework/Foundation`.
@@ -140,20 +172,168 @@ BinaryPath DynamicLoader::resolvePath(const string &Path) {
                       /* Relative */ true};
   }
 
-  // TODO: Handle also `.ipa`-relative paths.
   return BinaryPath{Path, filesystem::path(Path).is_relative()};
 }
 
-LoadedLibrary *DynamicLoader::loadMachO(const string &Path) {
+bool DynamicLoader::isMachO(const BinaryPath &BP) {
+  if (!BP.Archived)
+    return LIEF::MachO::is_macho(BP.Path);
+
+  // Check magic the same way `LIEF::MachO::is_macho` does.
+  using namespace llvm::MachO;
+  const IpaArchive::Entry *E = Archive->find(BP.Path);
+  uint32_t Magic;
+  if (!E || !Archive->readPrefix(*E, &Magic, sizeof(Magic)))
+    return false;
+  return Magic == MH_MAGIC || Magic == MH_CIGAM || Magic == MH_MAGIC_64 ||
+         Magic == MH_CIGAM_64 || Magic == FAT_MAGIC || Magic == FAT_CIGAM;
+}
+
+uint64_t DynamicLoader::hashBinary(const BinaryPath &BP) {
+  if (!BP.Archived)
+    return PrelinkCache::hashFile(BP.Path);
+
+  // Archive already has checksums of its entries.
+  const IpaArchive::Entry *E = Archive->find(BP.Path);
+  return E ? (static_cast<uint64_t>(E->CRC) << 32) ^ E->Size : 0;
+}
+
+LoadedLibrary *DynamicLoader::loadMachO(const BinaryPath &Path) {
+  auto StartTime = chrono::steady_clock::now();
+
+  // Try to use an image prelinked by some previous run.
+  uint64_t Hash = 0;
+  if constexpr (UsePrelinkCache) {
+    ProfileScope Scope(IpaSim.Prof, "prelink", Path.Path);
+    Hash = hashBinary(Path);
+    if (Hash)
+      if (LoadedLibrary *L = loadPrelinked(Path.Path, Hash)) {
+        if constexpr (PrintEmuInfo)
+          Log.info() << "loaded " << Path.Path << " from prelink cache in "
+                     << chrono::duration_cast<chrono::microseconds>(
+                            chrono::steady_clock::now() - StartTime)
+                            .count()
+                     << " us" << Log.end();
+        return L;
+      }
+  }
+
+  // Images are kept in order of their discovery.
+  deque<PendingImage> Images;
+  map<string, PendingImage *> ImagesByPath;
+  {
+    ProfileScope Scope(IpaSim.Prof, "discover", Path.Path);
+    WorkerPool<PendingImage> &Workers = getWorkers();
+    auto Enqueue = [&](const BinaryPath &BP) -> PendingImage & {
+      PendingImage &P = Images.emplace_back();
+      P.Path = BP;
+      ImagesByPath[BP.Path] = &P;
+      Workers.submit(P);
+      return P;
+    };
+    Enqueue(Path).Hash = Hash;
+
+    // Discover the dependency graph. Images are prepared in parallel, nothing
+    // else happens until all of them are.
+    function<void(PendingImage &)> Visit = [&](PendingImage &P) {
+      P.Visited = true;
+      Workers.wait(P);
+      if (!P.LL)
+        return;
+
+      // Start preparing all new Mach-O dependencies before visiting the first
+      // one.
+      P.Deps.reserve(P.Libraries.size());
+      for (const string &LibName : P.Libraries) {
+        BinaryPath BP(resolvePath(LibName));
+        auto I = ImagesByPath.find(BP.Path);
+        if (I != ImagesByPath.end())
+          P.Deps.push_back(I->second);
+        else if (!LLs.count(BP.Path) && BP.isFileValid() && isMachO(BP)) {
+          Log.info() << "loading library " << BP.Path << "...\n";
+          P.Deps.push_back(&Enqueue(BP));
+        } else
+          P.Deps.push_back(nullptr);
+      }
+
+      for (PendingImage *Dep : P.Deps)
+        if (Dep && !Dep->Visited)
+          Visit(*Dep);
+    };
+    Visit(Images.front());
+  }
+
+  // Now, do the rest in depth-first order, the same as the sequential loader
+  // did: publish an image, load its dependencies and then bind it. That's
+  // because `DllMain` of loaded DLLs can register Mach-O headers (see
+  // `registerMachO`) or call into emulated code. Images in cycles are bound
+  // before some of their dependencies.
+  function<void(PendingImage &)> Load = [&](PendingImage &P) {
+    P.Loaded = true;
+    if (!P.LL)
+      return;
+    if (LLs.count(P.Path.Path)) {
+      // Some `DllMain` has already loaded it.
+      P.LL = nullptr;
+      return;
+    }
+    publishMachO(P);
+
+    for (size_t I = 0, End = P.Libraries.size(); I != End; ++I)
+      if (PendingImage *Dep = P.Deps[I]) {
+        if (!Dep->Loaded)
+          Load(*Dep);
+        else if (Dep->LL && !Dep->Bound)
+          P.InCycle = true;
+      } else
+        // This loads DLLs and reports invalid files.
+        load(P.Libraries[I]);
+
+    bindMachO(P);
+    P.Bound = true;
+  };
+  Load(Images.front());
+
+  if constexpr (PrintEmuInfo)
+    Log.info() << "loaded " << Images.size() << " Mach-O image(s) in "
+               << chrono::duration_cast<chrono::microseconds>(
+                      chrono::steady_clock::now() - StartTime)
+                      .count()
+               << " us" << Log.end();
+
+  return Images.front().LL;
+}
+
+// Note that if something goes wrong here, the image is still prepared (if
+// possible), so that it behaves the same as when it was loaded sequentially.
+void DynamicLoader::prepareMachO(PendingImage &P) {
   using namespace LIEF::MachO;
 
-  auto LL = make_unique<LoadedDylib>(Parser::parse(Path));
-  LoadedDylib *LLP = LL.get();
+  auto StartTime = chrono::steady_clock::now();
+  const string &Path = P.Path.Path;
+  ProfileScope Scope(IpaSim.Prof, "prepare", Path);
+  if constexpr (UsePrelinkCache)
+    if (!P.Hash)
+      P.Hash = hashBinary(P.Path);
 
-  // TODO: Select the correct binary more intelligently.
-  Binary &Bin = LL->Bin;
+  ProfileScope Phase(IpaSim.Prof, "parse", Path);
+  if (P.Path.Archived) {
+    // Inflate the binary into a buffer, so that nothing has to be extracted.
+    vector<uint8_t> Data;
+    const IpaArchive::Entry *E = Archive->find(Path);
+    if (!E || !Archive->read(*E, Data)) {
+      Log.error() << "couldn't read " << Path << " from archive" << Log.end();
+      return;
+    }
+    P.Owned = make_unique<LoadedDylib>(Parser::parse(Data, Path));
+  } else
+    P.Owned = make_unique<LoadedDylib>(Parser::parse(Path));
+  LoadedDylib *LLP = P.Owned.get();
 
-  LLs[Path] = move(LL);
+  // TODO: Select the correct binary more intelligently.
+  Binary &Bin = *LLP->Bin;
+  LLP->Entrypoint = Bin.entrypoint();
+  LLP->Imagebase = Bin.imagebase();
 
   // Check header.
   Header &Hdr = Bin.header();
@@ -186,16 +366,30 @@ LoadedLibrary *DynamicLoader::loadMachO(const string &Path) {
     }
   }
 
-  // Allocate space for the segments.
+  // Allocate space for the segments. If possible, map them right from the
+  // file, so that only pages written by relocations and bindings get copied.
+  Phase.next("map");
   uint64_t Size = HighAddr - LowAddr;
-  uintptr_t Addr = (uintptr_t)_aligned_malloc(Size, PageSize);
+  uintptr_t Addr = 0;
+  if constexpr (MapImages)
+    Addr = (uintptr_t)mapMachO(P.Path, Bin, LowAddr, Size, P.Mapped);
+  // Note that we don't use `_aligned_malloc`, because `loadPrelinked` needs to
+  // be able to allocate memory at the same address next time.
   if (!Addr)
-    Log.error("couldn't allocate memory for segments");
+    Addr = (uintptr_t)VirtualAllocFromApp(
+        nullptr, Size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  if (!Addr) {
+    Log.error() << "couldn't allocate memory for segments of " << Path
+                << Log.end();
+    return;
+  }
   uint64_t Slide = Addr - LowAddr;
   LLP->StartAddress = Slide;
   LLP->Size = Size;
+  P.Img = PrelinkedImage{Addr, Size, Slide, LLP->Entrypoint, LLP->Imagebase};
 
-  // Load segments. Inspired by `ImageLoaderMachO::mapSegments`.
+  // Load segments. Inspired by `ImageLoaderMachO::mapSegments`. They are mapped
+  // into the emulator later (see `publishMachO`).
   for (SegmentCommand &Seg : Bin.segments()) {
     // Convert protection.
     uint32_t VMProt = Seg.init_protection();
@@ -215,98 +409,499 @@ LoadedLibrary *DynamicLoader::loadMachO(const string &Path) {
     // address.
     uint8_t *Mem = reinterpret_cast<uint8_t *>(VAddr);
     uint64_t VSize = Seg.virtual_size();
+    P.Img.Segments.push_back(
+        {VAddr - Addr, VSize, static_cast<uint32_t>(Perms)});
 
     if (Perms == UC_PROT_NONE) {
-      // No protection means we don't have to copy any data, we just map it.
-      Emu.mapMemory(VAddr, VSize, Perms);
+      // No protection means we don't have to copy any data.
     } else {
-      // TODO: Memory-map the segment instead of copying it.
-      auto &Buff = Seg.content();
+      // Part of the segment inside the view mapped by `mapMachO` already has
+      // its data there, only its zero-fill part must be cleared (in the file,
+      // there is padding or the following segments). The rest of the segment
+      // is in private memory, which is already zeroed, so only data must be
+      // copied there.
       // TODO: Copy to the end of the allocated space if flag `SG_HIGHVM` is
       // present.
-      memcpy(Mem, Buff.data(), Buff.size());
-      Emu.mapMemory(VAddr, VSize, Perms);
-
-      // Clear the remaining memory.
-      if (Buff.size() < VSize)
-        memset(Mem + Buff.size(), 0, VSize - Buff.size());
-    }
-
-    // Relocate addresses. Inspired by `ImageLoaderMachOClassic::rebase`.
-    if (Slide > 0) {
-      for (Relocation &Rel : Seg.relocations()) {
-        if (Rel.is_pc_relative() ||
-            Rel.origin() != RELOCATION_ORIGINS::ORIGIN_DYLDINFO ||
-            Rel.size() != 32 || (Rel.address() & R_SCATTERED) != 0)
-          Log.error("unsupported relocation");
-
-        // Find base address for this relocation. Inspired by
-        // `ImageLoaderMachOClassic::getRelocBase`.
-        uint64_t RelBase = LowAddr + Slide;
-
-        uint64_t RelAddr = RelBase + Rel.address();
-
-        // TODO: Implement what `ImageLoader::containsAddress` does.
-        if (RelAddr > VAddr + VSize || RelAddr < VAddr)
-          Log.error("relocation target out of range");
-
-        uint32_t *Val = (uint32_t *)RelAddr;
-        // We actively leave NULL pointers untouched. Technically it would be
-        // correct to slide them because the PAGEZERO segment slid, too. But
-        // programs probably wouldn't be happy if their NULLs were non-zero.
-        // TODO: Solve this as the original dyld does. Maybe by always mapping
-        // PAGEZERO to address 0 or something like that.
-        if (*Val != 0)
-          *Val = *Val + Slide;
-      }
+      auto &Buff = Seg.content();
+      uint64_t FileSize = min<uint64_t>(Buff.size(), VSize);
+      uint64_t Offset = VAddr - Addr;
+      uint64_t InView = P.Mapped > Offset ? min(P.Mapped - Offset, VSize) : 0;
+      if (FileSize < InView)
+        memset(Mem + FileSize, 0, InView - FileSize);
+      else if (FileSize > InView)
+        memcpy(Mem + InView, Buff.data() + InView, FileSize - InView);
     }
   }
 
-  // Load referenced libraries. See also i22.
+  // Remember referenced libraries. See also i22.
   for (DylibCommand &Lib : Bin.libraries())
-    load(Lib.name());
-
-  // Bind external symbols.
-  for (BindingInfo &BInfo : Bin.dyld_info().bindings()) {
-    // Check binding's kind.
-    if ((BInfo.binding_class() != BINDING_CLASS::BIND_CLASS_STANDARD &&
-         BInfo.binding_class() != BINDING_CLASS::BIND_CLASS_LAZY) ||
-        BInfo.binding_type() != BIND_TYPES::BIND_TYPE_POINTER ||
-        BInfo.addend()) {
-      Log.error("unsupported binding info");
-      continue;
-    }
-    if (!BInfo.has_library()) {
-      Log.error("flat-namespace symbols are not supported yet");
-      continue;
+    P.Libraries.push_back(Lib.name());
+
+  // Rebase the image. Note that Mach-O header lies at the beginning of the
+  // first segment that has some content in the file.
+  Phase.next("rebase");
+  for (SegmentCommand &Seg : Bin.segments())
+    if (Seg.file_size() && Seg.file_offset() == 0) {
+      P.Hdr = reinterpret_cast<const void *>(Seg.virtual_address() + Slide);
+      break;
     }
+  DyldInfo Info(P.Hdr, Slide);
+  if (Info.isValid()) {
+    P.Rebased = Info.rebase();
 
-    // Find symbol's library.
-    string LibName(BInfo.library().name());
-    LoadedLibrary *Lib = load(LibName);
-    if (!Lib) {
-      Log.error("symbol's library couldn't be loaded");
-      continue;
+    // Index symbols while we're still in parallel.
+    Phase.next("index symbols");
+    if (P.Rebased)
+      LLP->getSymbols();
+  }
+  Phase.end();
+
+  P.LL = LLP;
+  P.PrepareTime = chrono::duration_cast<chrono::microseconds>(
+                      chrono::steady_clock::now() - StartTime)
+                      .count();
+}
+
+void DynamicLoader::publishMachO(PendingImage &P) {
+  const string &Path = P.Path.Path;
+  ProfileScope Scope(IpaSim.Prof, "publish", Path);
+  P.LL->IsWrapper = P.Path.Relative && startsWith(Path, "gen\\");
+  LLs[Path] = move(P.Owned);
+  indexLibrary(Path);
+  Unbound.insert(P.LL);
+
+  for (const PrelinkedImage::Segment &Seg : P.Img.Segments)
+    Emu.mapMemory(P.Img.Addr + Seg.Offset, Seg.Size,
+                  static_cast<uc_prot>(Seg.Perms));
+}
+
+void DynamicLoader::bindMachO(PendingImage &P) {
+  auto StartTime = chrono::steady_clock::now();
+  const string &Path = P.Path.Path;
+  ProfileScope Scope(IpaSim.Prof, "bind", Path);
+
+  DyldInfo Info(P.Hdr, P.LL->StartAddress);
+  size_t FirstLazy = LazyBindings.size();
+  set<const LoadedLibrary *> Deps;
+  bool Linked = false;
+  if (!Info.isValid())
+    Log.error("binary without dyld info is not supported");
+  else if (P.Rebased &&
+           Info.bind([&](const char *LibName, const char *SymName) {
+             // Find symbol's library.
+             LoadedLibrary *Lib = load(LibName);
+             if (!Lib) {
+               Log.error("symbol's library couldn't be loaded");
+               return static_cast<uint64_t>(0);
+             }
+
+             // Find symbol's address. Because of re-exports, it can be inside
+             // another library.
+             uint64_t Addr = Lib->findSymbol(*this, SymName);
+             addDependency(Lib, Deps);
+             if (LoadedLibrary *Provider = lookup(Addr).Lib)
+               Deps.insert(Provider);
+             return Addr;
+           })) {
+    initLazyBindings(Info);
+    Linked = true;
+  }
+
+  Unbound.erase(P.LL);
+
+  // Images bound before their dependencies cannot be validated when they are
+  // loaded from the cache (see `storePrelinked`), so they are not stored.
+  if constexpr (UsePrelinkCache)
+    if (P.Hash && Linked && !P.InCycle) {
+      P.Img.Libraries = P.Libraries;
+      storePrelinked(Path, P.Hash, *P.LL, P.Img, FirstLazy, Deps);
     }
 
-    // Find symbol's address.
-    string SymName(BInfo.symbol().name());
-    uint64_t SymAddr = Lib->findSymbol(*this, SymName);
-    if (!SymAddr) {
-      Log.error() << "external symbol " << SymName << " from library "
-                  << LibName << " couldn't be resolved" << Log.end();
+  if constexpr (PrintEmuInfo) {
+    auto Duration = chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now() - StartTime);
+    PROCESS_MEMORY_COUNTERS Counters;
+    Counters.cb = sizeof(Counters);
+    Log.info() << "loaded " << Path << " (mapped " << (P.Mapped / 1024)
+               << " of " << (P.Img.Size / 1024) << " KiB) in " << P.PrepareTime
+               << " us, bound in "
+               << Duration.count() << " us";
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &Counters, sizeof(Counters)))
+      Log.infs() << ", working set: " << (Counters.WorkingSetSize / 1024)
+                 << " KiB";
+    Log.infs() << Log.end();
+  }
+}
+
+// Points all lazy pointers of an image to binder slots, so that they are bound
+// only when they are called for the first time (see `bindLazy`).
+void DynamicLoader::initLazyBindings(DyldInfo &Info) {
+  size_t First = LazyBindings.size();
+  Info.bindLazy([&](uint32_t *Ptr, const char *Lib, const char *Sym) {
+    LazyBindings.push_back({Ptr, Lib, Sym});
+
+    // We don't know address of the slot yet, so we leave the pointer as is.
+    return static_cast<uint64_t>(0);
+  });
+  installLazyBindings(First);
+}
+
+// Allocates binder slots for lazy bindings starting at index `First`.
+void DynamicLoader::installLazyBindings(size_t First) {
+  size_t Count = LazyBindings.size() - First;
+  if (!Count)
+    return;
+
+  // Reserve address space for the slots. It's never accessed, so it doesn't
+  // have to be committed.
+  uint64_t Size = roundToPageSize(Count * LazyBinderSlotSize);
+  void *Ptr = VirtualAllocFromApp(nullptr, Size, MEM_RESERVE, PAGE_NOACCESS);
+  if (!Ptr) {
+    Log.error() << "couldn't reserve lazy binder region"
+                << Log.appendWinError();
+    return;
+  }
+  uint64_t Addr = reinterpret_cast<uint64_t>(Ptr);
+  Emu.mapMemory(Addr, Size, UC_PROT_NONE);
+  LazyBinderRegions[Addr] = {Size, First, Count};
+
+  for (size_t I = 0; I != Count; ++I)
+    *LazyBindings[First + I].Ptr =
+        static_cast<uint32_t>(Addr + I * LazyBinderSlotSize);
+}
+
+bool DynamicLoader::findLazyBinding(uint64_t Addr, size_t &Binding) {
+  // Find the last region starting before (or at) `Addr`.
+  auto I = LazyBinderRegions.upper_bound(Addr);
+  if (I == LazyBinderRegions.begin())
+    return false;
+  --I;
+  uint64_t Offset = Addr - I->first;
+  const LazyBinderRegion &R = I->second;
+  if (Offset >= R.Size)
+    return false;
+
+  uint64_t Slot = Offset / LazyBinderSlotSize;
+  if (Offset % LazyBinderSlotSize != 0 || Slot >= R.Count) {
+    Log.error() << "invalid lazy binder slot at 0x" << to_hex_string(Addr)
+                << Log.end();
+    Binding = NoLazyBinding;
+    return true;
+  }
+  Binding = R.FirstBinding + Slot;
+  return true;
+}
+
+uint64_t DynamicLoader::bindLazy(size_t Binding, uint32_t *&Ptr) {
+  LazyBinding &B = LazyBindings[Binding];
+  Ptr = B.Ptr;
+  size_t Count = ++LazyBindCount;
+
+  // Find symbol's library.
+  LoadedLibrary *Lib = load(B.Lib);
+  if (!Lib) {
+    Log.error() << "library " << B.Lib << " of lazy symbol " << B.Sym
+                << " couldn't be loaded" << Log.end();
+    return 0;
+  }
+
+  // Find symbol's address and bind it.
+  uint64_t Target = Lib->findSymbol(*this, B.Sym);
+  if (!Target) {
+    Log.error() << "lazy symbol " << B.Sym << " from library " << B.Lib
+                << " couldn't be resolved" << Log.end();
+    return 0;
+  }
+  *B.Ptr = static_cast<uint32_t>(Target);
+
+  if constexpr (PrintEmuInfo)
+    Log.info() << "lazily bound " << B.Sym << " from " << B.Lib
+               << " (lazy binds so far: " << Count << ")" << Log.end();
+  return Target;
+}
+
+PrelinkCache &DynamicLoader::getPrelinkCache() {
+  if (!Prelink) {
+    filesystem::path Folder(
+        to_string(ApplicationData::Current().LocalCacheFolder().Path()));
+    Prelink = make_unique<PrelinkCache>(Folder / "prelink");
+  }
+  return *Prelink;
+}
+
+WorkerPool<DynamicLoader::PendingImage> &DynamicLoader::getWorkers() {
+  if (!Workers)
+    Workers = make_unique<WorkerPool<PendingImage>>(
+        [this](PendingImage &P) { prepareMachO(P); }, LoaderThreads);
+  return *Workers;
+}
+
+// Adds `Lib` and all libraries it re-exports (transitively) into `Deps`. A
+// symbol bound to `Lib` could have been resolved through any of them, so they
+// all must be unchanged for a prelinked image to be valid.
+void DynamicLoader::addDependency(LoadedLibrary *Lib,
+                                  set<const LoadedLibrary *> &Deps) {
+  vector<LoadedLibrary *> Worklist{Lib};
+  while (!Worklist.empty()) {
+    LoadedLibrary *L = Worklist.back();
+    Worklist.pop_back();
+    if (!Deps.insert(L).second)
       continue;
+    if (auto *Dylib = dynamic_cast<LoadedDylib *>(L))
+      for (const char *Name : Dylib->getReexports())
+        if (LoadedLibrary *Reexported = load(Name))
+          Worklist.push_back(Reexported);
+  }
+}
+
+LoadedLibrary *DynamicLoader::loadPrelinked(const string &Path,
+                                            uint64_t Hash) {
+  PrelinkedImage Img;
+  ifstream In;
+  PrelinkCache &Cache = getPrelinkCache();
+  if (!Cache.open(Path, Hash, Img, In))
+    return nullptr;
+
+  // The image must be at the same address as before. If it cannot be mapped
+  // from the cache, it's read into private memory.
+  uint64_t Offset = In.tellg();
+  void *Ptr = Cache.map(Path, Offset, Img);
+  bool Mapped = Ptr != nullptr;
+  if (!Mapped)
+    Ptr = VirtualAllocFromApp(reinterpret_cast<void *>(Img.Addr), Img.Size,
+                              MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  auto Release = [&]() {
+    if (Mapped)
+      UnmapViewOfFile(Ptr);
+    else
+      VirtualFree(Ptr, 0, MEM_RELEASE);
+  };
+  if (reinterpret_cast<uint64_t>(Ptr) != Img.Addr) {
+    if (Ptr)
+      Release();
+    ++PrelinkMisses;
+    return nullptr;
+  }
+
+  // Load all libraries from its load commands, the same as `loadMachO` does.
+  // Even those that didn't provide any bound symbol can register Mach-O
+  // headers or have initializers.
+  for (const string &LibName : Img.Libraries)
+    load(LibName);
+
+  // Libraries it was bound to must be unchanged and at the same addresses.
+  bool Stale = false;
+  for (const PrelinkedImage::Dependency &Dep : Img.Dependencies) {
+    LoadedLibrary *Lib = load(Dep.Path);
+    if (!Lib || Lib->StartAddress != Dep.StartAddress ||
+        hashBinary(resolvePath(Dep.Path)) != Dep.Hash) {
+      if constexpr (PrintEmuInfo)
+        Log.info() << "prelinked image of " << Path << " is stale because of "
+                   << Dep.Path << Log.end();
+      Stale = true;
+      break;
     }
+  }
+
+  // Loading dependencies could have loaded us, as well (if there is a cycle).
+  auto I = LLs.find(Path);
+  if (I != LLs.end()) {
+    Release();
+    return I->second.get();
+  }
+  if (Stale) {
+    Release();
+    ++PrelinkMisses;
+    return nullptr;
+  }
 
-    // Bind it.
-    uint64_t TargetAddr = BInfo.address() + Slide;
-    LLP->checkInRange(TargetAddr);
-    *reinterpret_cast<uint32_t *>(TargetAddr) = SymAddr;
+  if (!Mapped && !In.read(reinterpret_cast<char *>(Ptr), Img.Size)) {
+    Log.error() << "corrupted prelink cache entry of " << Path << Log.end();
+    Release();
+    ++PrelinkMisses;
+    return nullptr;
   }
+  ++PrelinkHits;
+
+  auto LL = make_unique<LoadedDylib>();
+  LoadedDylib *LLP = LL.get();
+  LLs[Path] = move(LL);
+  LLP->StartAddress = Img.StartAddress;
+  LLP->Size = Img.Size;
+  LLP->Entrypoint = Img.Entrypoint;
+  LLP->Imagebase = Img.Imagebase;
+  indexLibrary(Path);
+
+  for (const PrelinkedImage::Segment &Seg : Img.Segments)
+    Emu.mapMemory(Img.Addr + Seg.Offset, Seg.Size,
+                  static_cast<uc_prot>(Seg.Perms));
+
+  SymbolTable Symbols;
+  Symbols.reserve(Img.Symbols.size());
+  for (const PrelinkedImage::Symbol &Sym : Img.Symbols)
+    Symbols.insert(reinterpret_cast<const char *>(Img.Addr + Sym.NameOffset),
+                   Sym.Addr);
+  LLP->setSymbols(move(Symbols));
+
+  // Binder slots are allocated anew.
+  size_t First = LazyBindings.size();
+  for (const PrelinkedImage::LazyBinding &B : Img.LazyBindings)
+    LazyBindings.push_back(
+        {reinterpret_cast<uint32_t *>(Img.Addr + B.PtrOffset),
+         reinterpret_cast<const char *>(Img.Addr + B.LibOffset),
+         reinterpret_cast<const char *>(Img.Addr + B.SymOffset)});
+  installLazyBindings(First);
 
   return LLP;
 }
 
+void DynamicLoader::storePrelinked(const string &Path, uint64_t Hash,
+                                   LoadedDylib &LL, PrelinkedImage &Img,
+                                   size_t FirstLazy,
+                                   const set<const LoadedLibrary *> &Deps) {
+  auto Offset = [&](const void *Ptr) {
+    return reinterpret_cast<uint64_t>(Ptr) - Img.Addr;
+  };
+  auto IsInside = [&](const void *Ptr) { return Offset(Ptr) < Img.Size; };
+
+  LL.getSymbols().forEach([&](const char *Name, uint64_t Addr) {
+    Img.Symbols.push_back({Offset(Name), Addr});
+  });
+  for (size_t I = FirstLazy, End = LazyBindings.size(); I != End; ++I) {
+    const LazyBinding &B = LazyBindings[I];
+    if (!IsInside(B.Ptr) || !IsInside(B.Lib) || !IsInside(B.Sym))
+      return;
+    Img.LazyBindings.push_back({Offset(B.Ptr), Offset(B.Lib), Offset(B.Sym)});
+  }
+  for (auto &[LibPath, Lib] : LLs)
+    if (Lib.get() != &LL && Deps.count(Lib.get())) {
+      // Without a hash, the dependency couldn't be validated.
+      uint64_t DepHash = hashBinary(resolvePath(LibPath));
+      if (!DepHash)
+        return;
+      Img.Dependencies.push_back({LibPath, Lib->StartAddress, DepHash});
+    }
+
+  getPrelinkCache().store(Path, Hash, Img);
+}
+
+void *DynamicLoader::mapMachO(const BinaryPath &BP, LIEF::MachO::Binary &Bin,
+                              uint64_t LowAddr, uint64_t Size,
+                              uint64_t &Mapped) {
+  using namespace LIEF::MachO;
+  Mapped = 0;
+
+  // Find how much of the image is a flat copy of the file (except for
+  // zero-fill parts of its segments). It ends where the first segment with
+  // file contents at a different offset starts.
+  uint64_t FileBytes = Size;
+  for (SegmentCommand &Seg : Bin.segments()) {
+    uint64_t Offset = Seg.virtual_address() - LowAddr;
+    if (Seg.file_size() && Seg.file_offset() != Offset)
+      FileBytes = min(FileBytes, Offset);
+  }
+
+  if (BP.Archived) {
+    // Stored entries can be mapped right from the archive. Fat binaries have
+    // the image at some offset, we don't map those.
+    const IpaArchive::Entry *E = Archive->find(BP.Path);
+    uint32_t Magic;
+    if (!E || !Archive->readPrefix(*E, &Magic, sizeof(Magic)) ||
+        Magic != llvm::MachO::MH_MAGIC)
+      return nullptr;
+    return Archive->mapCopy(*E, FileBytes, Size, Mapped);
+  }
+
+  const string &Path = BP.Path;
+  HANDLE File = CreateFile2(to_hstring(Path).c_str(), GENERIC_READ,
+                            FILE_SHARE_READ, OPEN_EXISTING, nullptr);
+  if (File == INVALID_HANDLE_VALUE) {
+    Log.error() << "couldn't open " << Path << Log.appendWinError();
+    return nullptr;
+  }
+
+  // Fat binaries have the image at some offset, we don't map those.
+  uint32_t Magic;
+  DWORD Read;
+  if (!ReadFile(File, &Magic, sizeof(Magic), &Read, nullptr) ||
+      Read != sizeof(Magic) || Magic != llvm::MachO::MH_MAGIC) {
+    CloseHandle(File);
+    return nullptr;
+  }
+
+  // Views cannot be larger than the file.
+  FILE_STANDARD_INFO Info;
+  if (!GetFileInformationByHandleEx(File, FileStandardInfo, &Info,
+                                    sizeof(Info))) {
+    CloseHandle(File);
+    return nullptr;
+  }
+  FileBytes = min<uint64_t>(FileBytes, Info.EndOfFile.QuadPart);
+
+  HANDLE Mapping =
+      CreateFileMappingFromApp(File, nullptr, PAGE_WRITECOPY, 0, nullptr);
+  CloseHandle(File);
+  if (!Mapping) {
+    Log.error() << "couldn't create file mapping of " << Path
+                << Log.appendWinError();
+    return nullptr;
+  }
+
+  // Note that the view keeps the mapping alive.
+  void *Ptr = mapFilePrefix(Mapping, 0, FileBytes, Size, Mapped);
+  CloseHandle(Mapping);
+  return Ptr;
+}
+
+// The memory is first reserved as one placeholder, which is then split, so
+// that no other allocation can get between the view and the private memory.
+void *DynamicLoader::mapFilePrefix(void *Mapping, uint64_t Offset,
+                                   uint64_t FileBytes, uint64_t Size,
+                                   uint64_t &Mapped) {
+  Mapped = min(FileBytes, Size) & ~(AllocationGranularity - 1);
+  if (!Mapped)
+    return nullptr;
+
+  auto *Ptr = reinterpret_cast<uint8_t *>(VirtualAlloc2FromApp(
+      GetCurrentProcess(), nullptr, Size, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER,
+      PAGE_NOACCESS, nullptr, 0));
+  if (!Ptr) {
+    Log.error() << "couldn't reserve memory for image" << Log.appendWinError();
+    Mapped = 0;
+    return nullptr;
+  }
+  if (Mapped < Size &&
+      !VirtualFree(Ptr, Mapped, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER)) {
+    Log.error() << "couldn't split memory for image" << Log.appendWinError();
+    VirtualFree(Ptr, 0, MEM_RELEASE);
+    Mapped = 0;
+    return nullptr;
+  }
+
+  void *View = MapViewOfFile3FromApp(Mapping, GetCurrentProcess(), Ptr, Offset,
+                                     Mapped, MEM_REPLACE_PLACEHOLDER,
+                                     PAGE_WRITECOPY, nullptr, 0);
+  if (!View) {
+    Log.error() << "couldn't map view of image" << Log.appendWinError();
+    VirtualFree(Ptr, 0, MEM_RELEASE);
+    if (Mapped < Size)
+      VirtualFree(Ptr + Mapped, 0, MEM_RELEASE);
+    Mapped = 0;
+    return nullptr;
+  }
+  if (Mapped < Size &&
+      !VirtualAlloc2FromApp(GetCurrentProcess(), Ptr + Mapped, Size - Mapped,
+                            MEM_RESERVE | MEM_COMMIT | MEM_REPLACE_PLACEHOLDER,
+                            PAGE_READWRITE, nullptr, 0)) {
+    Log.error() << "couldn't allocate memory for image" << Log.appendWinError();
+    UnmapViewOfFile(View);
+    VirtualFree(Ptr + Mapped, 0, MEM_RELEASE);
+    Mapped = 0;
+    return nullptr;
+  }
+  return Ptr;
+}
+
 LoadedLibrary *DynamicLoader::loadPE(const string &Path) {
   using namespace LIEF::PE;
 
@@ -316,7 +911,9 @@ LoadedLibrary *DynamicLoader::loadPE(const string &Path) {
   LLs[Path] = move(LL);
 
   // Load it into memory.
+  ProfileScope Scope(IpaSim.Prof, "LoadPackagedLibrary", Path);
   HMODULE Lib = LoadPackagedLibrary(to_hstring(Path).c_str(), 0);
+  Scope.end();
   if (!Lib) {
     Log.error() << "couldn't load DLL: " << Path << Log.appendWinError();
     LLs.erase(Path);
@@ -342,6 +939,7 @@ LoadedLibrary *DynamicLoader::loadPE(const string &Path) {
     LLP->Size = Info.SizeOfImage;
     LLP->MachOPoser = false;
   }
+  indexLibrary(Path);
 
   // Load the library into Unicorn engine.
   uint64_t StartAddr = alignToPageSize(LLP->StartAddress);
@@ -351,13 +949,54 @@ LoadedLibrary *DynamicLoader::loadPE(const string &Path) {
   return LLP;
 }
 
-LibraryInfo DynamicLoader::lookup(uint64_t Addr) {
-  for (auto &Pair : LLs) {
-    LoadedLibrary *LL = Pair.second.get();
-    if (LL->isInRange(Addr))
-      return {&Pair.first, LL};
+void DynamicLoader::indexLibrary(const string &Path) {
+  auto I = LLs.find(Path);
+  assert(I != LLs.end() && "Library must be loaded before it's indexed.");
+  LoadedLibrary *LL = I->second.get();
+  if (!LL->Size)
+    return;
+
+  // Check that the new library doesn't overlap with its neighbors.
+  unique_lock<shared_mutex> Lock(LLsByAddrMutex);
+  auto Next = LLsByAddr.lower_bound(LL->StartAddress);
+  if ((Next != LLsByAddr.end() && LL->isInRange(Next->first)) ||
+      (Next != LLsByAddr.begin() &&
+       prev(Next)->second.Lib->isInRange(LL->StartAddress))) {
+    Log.error() << "library " << Path << " overlaps with another library"
+                << Log.end();
+    return;
   }
-  return {nullptr, nullptr};
+
+  LLsByAddr.emplace_hint(Next, LL->StartAddress, LibraryInfo{&I->first, LL});
+}
+
+LibraryInfo DynamicLoader::lookup(uint64_t Addr) {
+  // Consecutive lookups usually target the same library. Note that libraries
+  // are never unloaded, so the cached one stays valid.
+  LibraryInfo &Last = LastLookup.get();
+  if (Last.Lib && Last.Lib->isInRange(Addr))
+    return Last;
+
+  // Find the last library starting before (or at) `Addr`.
+  shared_lock<shared_mutex> Lock(LLsByAddrMutex);
+  auto I = LLsByAddr.upper_bound(Addr);
+  if (I == LLsByAddr.begin())
+    return {nullptr, nullptr};
+  --I;
+  if (!I->second.Lib->isInRange(Addr))
+    return {nullptr, nullptr};
+
+  Last = I->second;
+  return Last;
+}
+
+LoadedLibrary *DynamicLoader::findLoaded(const string &Path) {
+  BinaryPath BP(resolvePath(Path));
+  shared_lock<shared_mutex> Lock(LLsByAddrMutex);
+  for (auto &[Addr, LI] : LLsByAddr)
+    if (*LI.LibPath == BP.Path)
+      return LI.Lib;
+  return nullptr;
 }
 
 LogStream::Handler DynamicLoader::dumpAddr(uint64_t Addr) {
@@ -386,7 +1025,7 @@ LogStream::Handler DynamicLoader::dumpAddr(uint64_t Addr,
       return;
     }
     if (LI.Lib->hasMachO())
-      if (ObjCMethod M = LI.Lib->getMachO().findMethod(Addr)) {
+      if (ObjCMethod M = LI.Lib->findMethod(Addr)) {
         S << dumpAddr(Addr, LI, M);
         return;
       }
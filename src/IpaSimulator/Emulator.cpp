@@ -4,49 +4,489 @@
 
 #include "ipasim/IpaSimulator.hpp"
 
+#include <algorithm>
+#include <iterator>
 #include <unicorn/unicorn.h>
+#include <vector>
 
 using namespace ipasim;
 
+Emulator::Emulator(DynamicLoader &Dyld)
+    : Dyld(Dyld), OpsBase(0), Generation(0),
+      Engines([this]() { return createEngine(); },
+              [this](std::unique_ptr<Engine> E) {
+                releaseEngine(std::move(E));
+              }) {}
+
 Emulator::~Emulator() {
-  if (UC)
-    callUCStatic(uc_close(UC));
+  Engines.forEach([](Engine &E) { closeEngine(E); });
+  for (auto &E : FreeEngines)
+    closeEngine(*E);
+}
+
+void Emulator::closeEngine(Engine &E) {
+  if (E.Nested)
+    closeEngine(*E.Nested);
+  callUCStatic(uc_close(E.UC));
+}
+
+Emulator::Engine &Emulator::getEngine() {
+  Engine *E = &Engines.get();
+  while (E->Suspended)
+    E = &getNested(*E);
+  return *E;
+}
+
+Emulator::Engine &Emulator::getNested(Engine &E) {
+  if (!E.Nested) {
+    std::unique_ptr<Engine> Nested = createEngine();
+    // `interrupt` walks the nested engines from other threads.
+    std::lock_guard<std::mutex> Lock(E.StopMutex);
+    E.Nested = std::move(Nested);
+  }
+  if (!E.NestedUsed) {
+    // Nested emulation continues on the same stack.
+    E.NestedUsed = true;
+    uint32_t SP;
+    callUCStatic(uc_reg_read(E.UC, UC_ARM_REG_SP, &SP));
+    callUCStatic(uc_reg_write(E.Nested->UC, UC_ARM_REG_SP, &SP));
+  }
+  return *E.Nested;
+}
+
+Emulator::Engine *Emulator::findEngine() {
+  Engine *E = Engines.find();
+  while (E && E->Suspended && E->NestedUsed)
+    E = E->Nested.get();
+  return E;
+}
+
+void Emulator::suspend() {
+  Engine &E = getEngine();
+  E.Suspended = true;
+  E.NestedUsed = false;
+}
+
+bool Emulator::resume() {
+  Engine *E = &Engines.get();
+  while (E->Nested && E->Nested->Suspended)
+    E = E->Nested.get();
+  assert(E->Suspended && "Engine must be suspended.");
+  E->Suspended = false;
+  return E->NestedUsed;
+}
+
+bool Emulator::readMemory(uint64_t Addr, void *Data, size_t Size) {
+  return uc_mem_read(getEngine().UC, Addr, Data, Size) == UC_ERR_OK;
 }
 
 uint32_t Emulator::readReg(uc_arm_reg RegId) {
+  Engine &E = getEngine();
   uint32_t Result;
-  callUC(uc_reg_read(UC, RegId, &Result));
+  callUC(E, uc_reg_read(E.UC, RegId, &Result));
   return Result;
 }
 void Emulator::writeReg(uc_arm_reg RegId, uint32_t Value) {
-  callUC(uc_reg_write(UC, RegId, &Value));
+  Engine &E = getEngine();
+  callUC(E, uc_reg_write(E.UC, RegId, &Value));
+}
+
+void Emulator::readRegs(const uc_arm_reg *RegIds, uint32_t *Values,
+                        size_t Count) {
+  assert(Count <= MaxBatch && "Too many registers.");
+  Engine &E = getEngine();
+  int Ids[MaxBatch];
+  void *Ptrs[MaxBatch];
+  for (size_t I = 0; I != Count; ++I) {
+    Ids[I] = RegIds[I];
+    Ptrs[I] = &Values[I];
+  }
+  callUC(E, uc_reg_read_batch(E.UC, Ids, Ptrs, Count));
+}
+void Emulator::writeRegs(const uc_arm_reg *RegIds, const uint32_t *Values,
+                         size_t Count) {
+  assert(Count <= MaxBatch && "Too many registers.");
+  Engine &E = getEngine();
+  int Ids[MaxBatch];
+  void *Ptrs[MaxBatch];
+  for (size_t I = 0; I != Count; ++I) {
+    Ids[I] = RegIds[I];
+    Ptrs[I] = const_cast<uint32_t *>(&Values[I]);
+  }
+  callUC(E, uc_reg_write_batch(E.UC, Ids, Ptrs, Count));
+}
+
+ArgumentFrame Emulator::readFrame() {
+  static constexpr uc_arm_reg RegIds[] = {
+      UC_ARM_REG_R0, UC_ARM_REG_R1, UC_ARM_REG_R2, UC_ARM_REG_R3,
+      UC_ARM_REG_SP, UC_ARM_REG_LR, UC_ARM_REG_PC};
+  uint32_t Values[std::size(RegIds)];
+  readRegs(RegIds, Values, std::size(RegIds));
+
+  ArgumentFrame Frame;
+  std::copy(Values, Values + ArgumentFrame::RegArgs, Frame.Args);
+  Frame.SP = Values[4];
+  Frame.LR = Values[5];
+  Frame.PC = Values[6];
+  return Frame;
+}
+
+void Emulator::writeArgs(const uint32_t *Args, size_t Count) {
+  static constexpr uc_arm_reg RegIds[ArgumentFrame::RegArgs] = {
+      UC_ARM_REG_R0, UC_ARM_REG_R1, UC_ARM_REG_R2, UC_ARM_REG_R3};
+  assert(Count <= ArgumentFrame::RegArgs && "Too many arguments.");
+  writeRegs(RegIds, Args, Count);
 }
 
-// TODO: What if the mappings overlap?
 void Emulator::mapMemory(uint64_t Addr, uint64_t Size, uc_prot Perms) {
-  if (uc_mem_map_ptr(UC, Addr, Size, Perms, reinterpret_cast<void *>(Addr)))
-    Log.error() << "couldn't map memory at 0x" << to_hex_string(Addr)
-                << " of size 0x" << to_hex_string(Size) << Log.end();
+  std::lock_guard<std::mutex> Lock(Mutex);
+  uint64_t End = Addr + Size;
+
+  // Map gaps between existing regions and change protection of their parts
+  // that are overlapped. Note that only the previous region can start before
+  // `Addr`.
+  std::vector<MemoryOp> NewOps;
+  uint64_t Gap = Addr;
+  auto I = Regions.upper_bound(Addr);
+  if (I != Regions.begin() && std::prev(I)->second.End > Addr)
+    --I;
+  for (; I != Regions.end() && I->first < End; ++I) {
+    uint64_t PartStart = std::max(I->first, Addr),
+             PartEnd = std::min(I->second.End, End);
+    if (Gap < PartStart)
+      NewOps.push_back(MemoryOp{Gap, PartStart, Perms, MemoryOp::Map});
+    if (I->second.Perms != Perms)
+      NewOps.push_back(MemoryOp{PartStart, PartEnd, Perms, MemoryOp::Protect});
+    Gap = PartEnd;
+  }
+  if (Gap < End)
+    NewOps.push_back(MemoryOp{Gap, End, Perms, MemoryOp::Map});
+
+  setRegion(Addr, End, Perms);
+  for (const MemoryOp &Op : NewOps)
+    record(Op);
+
+  // The caller (e.g., a hook handling unmapped memory) expects the mapping to
+  // be usable right away.
+  if (Engine *E = findEngine())
+    syncEngine(*E);
+}
+
+void Emulator::unmapMemory(uint64_t Addr, uint64_t Size) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  uint64_t End = Addr + Size;
+  auto I = Regions.upper_bound(Addr);
+  if (I != Regions.begin())
+    --I;
+  std::vector<std::pair<uint64_t, uint64_t>> Parts;
+  for (; I != Regions.end() && I->first < End; ++I)
+    if (I->second.End > Addr)
+      Parts.emplace_back(std::max(I->first, Addr),
+                         std::min(I->second.End, End));
+  for (auto [PartStart, PartEnd] : Parts)
+    unmapRegion(PartStart, PartEnd);
+  if (Engine *E = findEngine())
+    syncEngine(*E);
 }
 
-void Emulator::start(uint64_t Addr) { callUC(uc_emu_start(UC, Addr, 0, 0, 0)); }
+bool Emulator::clipToUnmapped(uint64_t Addr, uint64_t &Start, uint64_t &End) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  auto Next = Regions.upper_bound(Addr);
+  if (Next != Regions.begin()) {
+    auto Prev = std::prev(Next);
+    if (Prev->second.End > Addr)
+      return false;
+    if (Prev->second.End > Start)
+      Start = Prev->second.End;
+  }
+  if (Next != Regions.end() && Next->first < End)
+    End = Next->first;
+  return true;
+}
+
+size_t Emulator::getRegionCount() {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  return Regions.size();
+}
 
-void Emulator::stop() { callUC(uc_emu_stop(UC)); }
+bool Emulator::syncMemory(uint64_t Addr) {
+  Engine &E = getEngine();
+  std::lock_guard<std::mutex> Lock(Mutex);
+  syncEngine(E);
 
-void Emulator::hook(uc_hook_type Type, void *Handler, void *Instance) {
-  uc_hook Hook;
-  callUC(uc_hook_add(UC, &Hook, Type, Handler, Instance, 1, 0));
+  auto I = Regions.upper_bound(Addr);
+  return I != Regions.begin() && std::prev(I)->second.End > Addr;
 }
 
-void Emulator::ignoreNextError() {
-  assert(!IgnoreError && "Only one next error can be ignored.");
-  IgnoreError = true;
+void Emulator::dumpMemoryMap() {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Log.info() << "memory map has " << Regions.size() << " regions, shared by "
+             << Engines.size() << " engines" << Log.end();
+  for (auto &[Start, R] : Regions)
+    Log.info() << "0x" << to_hex_string(Start) << "-0x" << to_hex_string(R.End)
+               << ' ' << ((R.Perms & UC_PROT_READ) ? 'r' : '-')
+               << ((R.Perms & UC_PROT_WRITE) ? 'w' : '-')
+               << ((R.Perms & UC_PROT_EXEC) ? 'x' : '-') << Log.end();
+}
+
+void Emulator::setRegion(uint64_t Start, uint64_t End, uc_prot Perms) {
+  // Cut out parts of regions overlapping the range.
+  auto I = Regions.upper_bound(Start);
+  if (I != Regions.begin() && std::prev(I)->second.End > Start)
+    --I;
+  while (I != Regions.end() && I->first < End) {
+    uint64_t RStart = I->first;
+    Region R = I->second;
+    I = Regions.erase(I);
+    if (RStart < Start)
+      Regions[RStart] = Region{Start, R.Perms};
+    if (End < R.End)
+      Regions[End] = R;
+  }
+
+  // Merge with neighbours that have the same protection.
+  auto J = Regions.emplace(Start, Region{End, Perms}).first;
+  if (J != Regions.begin()) {
+    auto Prev = std::prev(J);
+    if (Prev->second.End == Start && Prev->second.Perms == Perms) {
+      Prev->second.End = End;
+      Regions.erase(J);
+      J = Prev;
+    }
+  }
+  auto Next = std::next(J);
+  if (Next != Regions.end() && Next->first == J->second.End &&
+      Next->second.Perms == Perms) {
+    J->second.End = Next->second.End;
+    Regions.erase(Next);
+  }
 }
 
-uc_engine *Emulator::initUC() {
-  uc_engine *UC;
-  callUCStatic(uc_open(UC_ARCH_ARM, UC_MODE_ARM, &UC));
-  return UC;
+// Range [`Start`, `End`) must lie inside one region of `Regions`.
+void Emulator::unmapRegion(uint64_t Start, uint64_t End) {
+  // Unicorn splits the region if needed, so we do the same.
+  auto I = std::prev(Regions.upper_bound(Start));
+  uint64_t RStart = I->first;
+  Region R = I->second;
+  assert(RStart <= Start && End <= R.End && "Range must lie inside a region.");
+  Regions.erase(I);
+  if (RStart < Start)
+    Regions[RStart] = Region{Start, R.Perms};
+  if (End < R.End)
+    Regions[End] = R;
+
+  record(MemoryOp{Start, End, UC_PROT_NONE, MemoryOp::Unmap});
+}
+
+void Emulator::record(const MemoryOp &Op) {
+  Ops.push_back(Op);
+  ++Generation;
+  trimOps();
+}
+
+void Emulator::apply(Engine &E, const MemoryOp &Op) {
+  uint64_t Size = Op.End - Op.Start;
+  switch (Op.Kind) {
+  case MemoryOp::Map:
+    if (uc_mem_map_ptr(E.UC, Op.Start, Size, Op.Perms,
+                       reinterpret_cast<void *>(Op.Start)))
+      Log.error() << "couldn't map memory at 0x" << to_hex_string(Op.Start)
+                  << " of size 0x" << to_hex_string(Size) << Log.end();
+    break;
+  case MemoryOp::Unmap:
+    if (uc_mem_unmap(E.UC, Op.Start, Size))
+      Log.error() << "couldn't unmap memory at 0x" << to_hex_string(Op.Start)
+                  << " of size 0x" << to_hex_string(Size) << Log.end();
+    break;
+  case MemoryOp::Protect:
+    if (uc_mem_protect(E.UC, Op.Start, Size, Op.Perms))
+      Log.error() << "couldn't protect memory at 0x" << to_hex_string(Op.Start)
+                  << " of size 0x" << to_hex_string(Size) << Log.end();
+    break;
+  }
+}
+
+void Emulator::syncEngine(Engine &E) {
+  if (E.Ops < OpsBase)
+    rebuildMemory(E);
+  else
+    for (size_t I = E.Ops - OpsBase, End = Ops.size(); I != End; ++I)
+      apply(E, Ops[I]);
+  E.Ops = OpsBase + Ops.size();
+
+  // Install new hooks and remove those whose handles were reset.
+  E.Hooks.resize(Hooks.size(), 0);
+  for (size_t I = 0, End = Hooks.size(); I != End; ++I) {
+    Hook &H = Hooks[I];
+    uc_hook &Handle = E.Hooks[I];
+    if (H.Active && !Handle) {
+      callUCStatic(uc_hook_add(E.UC, &Handle, H.Type, H.Handler, H.Instance,
+                               H.Begin, H.End));
+      if (Handle)
+        ++H.Installed;
+    } else if (!H.Active && Handle) {
+      callUCStatic(uc_hook_del(E.UC, Handle));
+      Handle = 0;
+      if (!--H.Installed)
+        H.Data.reset();
+    }
+  }
+  E.Generation = Generation;
+}
+
+void Emulator::rebuildMemory(Engine &E) {
+  uc_mem_region *EngineRegions;
+  uint32_t Count;
+  if (uc_mem_regions(E.UC, &EngineRegions, &Count) == UC_ERR_OK) {
+    for (uint32_t I = 0; I != Count; ++I)
+      callUCStatic(uc_mem_unmap(E.UC, EngineRegions[I].begin,
+                                EngineRegions[I].end -
+                                    EngineRegions[I].begin + 1));
+    uc_free(EngineRegions);
+  }
+  for (auto &[Start, R] : Regions)
+    apply(E, MemoryOp{Start, R.End, R.Perms, MemoryOp::Map});
+}
+
+// Discards older half of recorded `MemoryOp`s, so that an idle engine cannot
+// make them grow without bound. Note that this doesn't need to look at the
+// engines, those that haven't applied the discarded ones (including one that
+// is just being created) rebuild their memory map when they sync.
+void Emulator::trimOps() {
+  if (Ops.size() <= MaxOps)
+    return;
+  size_t Discarded = Ops.size() - MaxOps / 2;
+  Ops.erase(Ops.begin(), Ops.begin() + Discarded);
+  OpsBase += Discarded;
+}
+
+std::unique_ptr<Emulator::Engine> Emulator::createEngine() {
+  {
+    // Reuse engine of an exited thread. It's brought in sync incrementally,
+    // or its memory map is rebuilt if it fell too far behind.
+    std::lock_guard<std::mutex> Lock(Mutex);
+    if (!FreeEngines.empty()) {
+      std::unique_ptr<Engine> E(std::move(FreeEngines.back()));
+      FreeEngines.pop_back();
+      E->IgnoreError = false;
+      syncEngine(*E);
+      return E;
+    }
+  }
+
+  auto E = std::make_unique<Engine>();
+  callUCStatic(uc_open(UC_ARCH_ARM, UC_MODE_ARM, &E->UC));
+  E->IgnoreError = false;
+
+  // Replay the current memory map and all hooks.
+  std::lock_guard<std::mutex> Lock(Mutex);
+  rebuildMemory(*E);
+  E->Ops = OpsBase + Ops.size();
+  syncEngine(*E);
+  return E;
+}
+
+// Called when the engine's thread exits.
+void Emulator::releaseEngine(std::unique_ptr<Engine> E) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  FreeEngines.push_back(std::move(E));
+}
+
+bool Emulator::start(uint64_t Addr, uint64_t Until) {
+  Engine &E = getEngine();
+  if (E.Generation != Generation) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    syncEngine(E);
+  }
+  {
+    std::lock_guard<std::mutex> Lock(E.StopMutex);
+    E.Running = true;
+    E.Interrupted = false;
+  }
+  uc_err Err = uc_emu_start(E.UC, Addr, Until, 0, 0);
+  bool Interrupted;
+  {
+    std::lock_guard<std::mutex> Lock(E.StopMutex);
+    E.Running = false;
+    Interrupted = E.Interrupted;
+  }
+  callUC(E, Err);
+
+  // `interrupt` might have come before Unicorn started or after it had
+  // already stopped on its own, in which case the request is simply ignored by
+  // Unicorn. So the flag alone doesn't mean emulation can be resumed.
+  return Interrupted && Err == UC_ERR_OK && readReg(UC_ARM_REG_PC) != Until;
+}
+
+void Emulator::stop() {
+  Engine &E = getEngine();
+  callUC(E, uc_emu_stop(E.UC));
+}
+
+// Note that `uc_emu_stop` can be called from another thread (Unicorn itself
+// does that to implement timeouts). If the engine stops on its own meanwhile,
+// it does nothing.
+void Emulator::interrupt() {
+  Engines.forEach([](Engine &Base) {
+    for (Engine *E = &Base; E; E = E->Nested.get()) {
+      std::lock_guard<std::mutex> Lock(E->StopMutex);
+      if (E->Running) {
+        E->Interrupted = true;
+        callUCStatic(uc_emu_stop(E->UC));
+      }
+    }
+  });
+}
+
+HookHandle Emulator::hook(uc_hook_type Type, void *Handler, void *Instance,
+                          std::shared_ptr<void> Data, uint64_t Begin,
+                          uint64_t End) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+
+  // Reuse slot of a hook that has already been removed from all engines.
+  Hook New{Type, Handler, Instance, Begin, End, /* Active */ true,
+           /* Installed */ 0, std::move(Data)};
+  auto I = std::find_if(Hooks.begin(), Hooks.end(), [](const Hook &H) {
+    return !H.Active && !H.Installed;
+  });
+  size_t Id = I - Hooks.begin();
+  if (I != Hooks.end())
+    *I = std::move(New);
+  else
+    Hooks.push_back(std::move(New));
+
+  ++Generation;
+  if (Engine *E = findEngine())
+    syncEngine(*E);
+  return HookHandle(*this, Id);
+}
+
+// Other engines remove the hook when they sync. Its data are kept alive until
+// then, because those engines can be running it meanwhile.
+void Emulator::unhook(size_t Id) {
+  std::lock_guard<std::mutex> Lock(Mutex);
+  Hook &H = Hooks[Id];
+  H.Active = false;
+  if (!H.Installed)
+    H.Data.reset();
+  ++Generation;
+  if (Engine *E = findEngine())
+    syncEngine(*E);
+
+  // Nobody runs free engines, so the hook can be removed from them right away.
+  for (auto &E : FreeEngines)
+    syncEngine(*E);
+}
+
+void HookHandle::reset() {
+  if (Emu)
+    std::exchange(Emu, nullptr)->unhook(Id);
+}
+
+void Emulator::ignoreNextError() {
+  Engine &E = getEngine();
+  assert(!E.IgnoreError && "Only one next error can be ignored.");
+  E.IgnoreError = true;
 }
 
 void Emulator::callUCStatic(uc_err Err) {
@@ -54,10 +494,10 @@ void Emulator::callUCStatic(uc_err Err) {
     Log.error() << "unicorn failed: " << uc_strerror(Err) << Log.end();
 }
 
-void Emulator::callUC(uc_err Err) {
+void Emulator::callUC(Engine &E, uc_err Err) {
   if (Err != UC_ERR_OK) {
-    if (IgnoreError)
-      IgnoreError = false;
+    if (E.IgnoreError)
+      E.IgnoreError = false;
     else
       Log.error() << "unicorn failed at "
                   << Dyld.dumpAddr(readReg(UC_ARM_REG_PC)) << ": "
@@ -0,0 +1,110 @@
+// HostMemoryMapper.cpp: Implementation of class `HostMemoryMapper`.
+
+#include "ipasim/HostMemoryMapper.hpp"
+
+#include "ipasim/Common.hpp"
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+
+#include <Windows.h>
+#include <algorithm>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+bool isAccessible(const MEMORY_BASIC_INFORMATION &Info) {
+  return Info.State == MEM_COMMIT &&
+         !(Info.Protect & (PAGE_NOACCESS | PAGE_GUARD));
+}
+
+} // namespace
+
+HostMemoryMapper::HostMemoryMapper(Emulator &Emu, uint64_t Granule)
+    : Emu(Emu), Granule(DynamicLoader::roundToPageSize(Granule)), Faults(0) {}
+
+bool HostMemoryMapper::handleFault(uint64_t Addr) {
+  lock_guard<mutex> Lock(Mutex);
+
+  uint64_t Start, End, AllocBase;
+  do {
+    // Some other thread could have mapped the memory already. Note that it
+    // doesn't have to go through this class (e.g., `DynamicLoader` maps
+    // images), so it can also happen right before we clip the range below.
+    if (Emu.syncMemory(Addr))
+      return true;
+
+    if (!findCommitted(Addr, Start, End, AllocBase)) {
+      // Map at least the page, as we always did. It can become committed
+      // before it's actually accessed.
+      Start = AllocBase = DynamicLoader::alignToPageSize(Addr);
+      End = Start + DynamicLoader::PageSize;
+    }
+  } while (!Emu.clipToUnmapped(Addr, Start, End));
+  ++Faults;
+  if (Start >= End)
+    return false;
+  RegionStats &Region = Regions[AllocBase];
+  ++Region.Faults;
+  Region.Mapped += End - Start;
+
+  if constexpr (PrintEmuInfo)
+    Log.info() << "mapping host memory 0x" << to_hex_string(Start) << "-0x"
+               << to_hex_string(End) << " (fault at 0x" << to_hex_string(Addr)
+               << ")" << Log.end();
+
+  // Note that `Emulator` merges this with adjacent mappings.
+  Emu.mapMemory(Start, End - Start, UC_PROT_READ | UC_PROT_WRITE);
+  return true;
+}
+
+// Note that `VirtualQuery` describes pages from the queried one up, so we have
+// to walk from the beginning of the granule (or the allocation region).
+bool HostMemoryMapper::findCommitted(uint64_t Addr, uint64_t &Start,
+                                     uint64_t &End, uint64_t &AllocBase) {
+  MEMORY_BASIC_INFORMATION Info;
+  if (!VirtualQuery(reinterpret_cast<void *>(Addr), &Info, sizeof(Info)) ||
+      !isAccessible(Info))
+    return false;
+  AllocBase = reinterpret_cast<uint64_t>(Info.AllocationBase);
+
+  uint64_t Begin = AllocBase, Limit = UINT64_MAX;
+  if (Granule) {
+    uint64_t GranuleStart = Addr - Addr % Granule;
+    Begin = max(Begin, GranuleStart);
+    Limit = GranuleStart + Granule;
+  }
+
+  // Find run of accessible pages containing `Addr`.
+  Start = End = Begin;
+  for (uint64_t P = Begin; P < Limit;) {
+    if (!VirtualQuery(reinterpret_cast<void *>(P), &Info, sizeof(Info)) ||
+        reinterpret_cast<uint64_t>(Info.AllocationBase) != AllocBase)
+      break;
+    uint64_t RegionEnd =
+        reinterpret_cast<uint64_t>(Info.BaseAddress) + Info.RegionSize;
+    if (isAccessible(Info))
+      End = RegionEnd;
+    else if (P <= Addr)
+      Start = End = RegionEnd;
+    else
+      break;
+    P = RegionEnd;
+  }
+  End = min(End, Limit);
+  return Start <= Addr && Addr < End;
+}
+
+void HostMemoryMapper::reportFaults() {
+  lock_guard<mutex> Lock(Mutex);
+
+  for (auto &[Base, Region] : Regions)
+    Log.info() << "host region at 0x" << to_hex_string(Base) << " faulted "
+               << Region.Faults << " times, mapped 0x"
+               << to_hex_string(Region.Mapped) << " bytes" << Log.end();
+  Log.info() << "total host memory faults: " << Faults << " (granule 0x"
+             << to_hex_string(Granule) << ", " << Emu.getRegionCount()
+             << " emulator regions)" << Log.end();
+}
@@ -0,0 +1,642 @@
+// IpaArchive.cpp: Implementation of class `IpaArchive`.
+
+#include "ipasim/IpaArchive.hpp"
+
+#include "ipasim/Common.hpp"
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/IpaSimulator.hpp"
+
+#include <Windows.h>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <winrt/base.h>
+
+using namespace ipasim;
+using namespace std;
+using namespace winrt;
+
+namespace {
+
+// Signatures of ZIP headers (see `APPNOTE.TXT`)
+constexpr uint32_t LocalHeaderSig = 0x04034b50;
+constexpr uint32_t CentralHeaderSig = 0x02014b50;
+constexpr uint32_t EndOfCentralDirSig = 0x06054b50;
+constexpr size_t LocalHeaderSize = 30;
+constexpr size_t CentralHeaderSize = 46;
+constexpr size_t EndOfCentralDirSize = 22;
+constexpr uint16_t Stored = 0;
+constexpr uint16_t Deflated = 8;
+
+uint16_t read16(const uint8_t *P) { return P[0] | (P[1] << 8); }
+uint32_t read32(const uint8_t *P) { return read16(P) | (read16(P + 2) << 16); }
+
+uint32_t crc32(const uint8_t *Data, size_t Size) {
+  static const auto Table = []() {
+    array<uint32_t, 256> Table;
+    for (uint32_t I = 0; I != 256; ++I) {
+      uint32_t C = I;
+      for (int K = 0; K != 8; ++K)
+        C = (C & 1) ? 0xedb88320 ^ (C >> 1) : C >> 1;
+      Table[I] = C;
+    }
+    return Table;
+  }();
+
+  uint32_t C = 0xffffffff;
+  for (const uint8_t *End = Data + Size; Data != End; ++Data)
+    C = Table[(C ^ *Data) & 0xff] ^ (C >> 8);
+  return C ^ 0xffffffff;
+}
+
+// Decodes raw DEFLATE data (RFC 1951) into a buffer of known size. Stops when
+// the buffer is full. Inspired by `puff.c` from zlib's `contrib`.
+class Inflater {
+public:
+  Inflater(const uint8_t *In, size_t InSize, uint8_t *Out, size_t OutSize)
+      : In(In), InSize(InSize), InPos(0), Out(Out), OutSize(OutSize),
+        OutPos(0), BitBuf(0), BitCount(0), Error(false) {}
+
+  // Returns `false` if the data are malformed.
+  bool run() {
+    bool Last;
+    do {
+      Last = bits(1);
+      switch (bits(2)) {
+      case 0:
+        stored();
+        break;
+      case 1:
+        fixed();
+        break;
+      case 2:
+        dynamic();
+        break;
+      default:
+        Error = true;
+      }
+    } while (!Last && !Error && !isFull());
+    return !Error;
+  }
+  size_t getOutSize() { return OutPos; }
+
+private:
+  static constexpr int MaxBits = 15;
+  static constexpr int MaxLengthCodes = 286, MaxDistCodes = 30;
+  static constexpr int FixedLengthCodes = 288;
+
+  struct Huffman {
+    uint16_t Count[MaxBits + 1]; // Number of symbols of each length
+    uint16_t Symbol[FixedLengthCodes]; // Symbols ordered by their codes
+  };
+
+  bool isFull() { return OutPos == OutSize; }
+
+  uint32_t bits(int Need) {
+    uint32_t Value = BitBuf;
+    while (BitCount < Need) {
+      if (InPos == InSize) {
+        Error = true;
+        return 0;
+      }
+      Value |= static_cast<uint32_t>(In[InPos++]) << BitCount;
+      BitCount += 8;
+    }
+    BitBuf = Value >> Need;
+    BitCount -= Need;
+    return Value & ((1u << Need) - 1);
+  }
+
+  void stored() {
+    // Discard bits up to the byte boundary.
+    BitBuf = 0;
+    BitCount = 0;
+
+    if (InPos + 4 > InSize) {
+      Error = true;
+      return;
+    }
+    size_t Len = read16(In + InPos);
+    if (read16(In + InPos + 2) != (~Len & 0xffff)) {
+      Error = true;
+      return;
+    }
+    InPos += 4;
+    if (InPos + Len > InSize) {
+      Error = true;
+      return;
+    }
+    Len = min(Len, OutSize - OutPos);
+    memcpy(Out + OutPos, In + InPos, Len);
+    InPos += Len;
+    OutPos += Len;
+  }
+
+  // Returns the next symbol or -1 on error. This is the faster variant from
+  // `puff.c` which takes the bits from `BitBuf` directly.
+  int decode(const Huffman &H) {
+    int Code = 0, First = 0, Index = 0, Len = 1;
+    uint32_t Buf = BitBuf;
+    int Left = BitCount;
+    const uint16_t *Next = H.Count + 1;
+    for (;;) {
+      while (Left--) {
+        Code |= Buf & 1;
+        Buf >>= 1;
+        int Count = *Next++;
+        if (Code - Count < First) {
+          BitBuf = Buf;
+          BitCount = (BitCount - Len) & 7;
+          return H.Symbol[Index + (Code - First)];
+        }
+        Index += Count;
+        First += Count;
+        First <<= 1;
+        Code <<= 1;
+        ++Len;
+      }
+      Left = (MaxBits + 1) - Len;
+      if (Left == 0)
+        break;
+      if (InPos == InSize)
+        break;
+      Buf = In[InPos++];
+      if (Left > 8)
+        Left = 8;
+    }
+    Error = true;
+    return -1;
+  }
+
+  // Returns 0 for a complete code, a negative number for an over-subscribed
+  // code and a positive number for an incomplete code.
+  static int construct(Huffman &H, const uint16_t *Lengths, int N) {
+    fill(begin(H.Count), end(H.Count), 0);
+    for (int Sym = 0; Sym != N; ++Sym)
+      ++H.Count[Lengths[Sym]];
+    if (H.Count[0] == N)
+      return 0;
+
+    int Left = 1;
+    for (int Len = 1; Len <= MaxBits; ++Len) {
+      Left <<= 1;
+      Left -= H.Count[Len];
+      if (Left < 0)
+        return Left;
+    }
+
+    uint16_t Offs[MaxBits + 1];
+    Offs[1] = 0;
+    for (int Len = 1; Len < MaxBits; ++Len)
+      Offs[Len + 1] = Offs[Len] + H.Count[Len];
+    for (int Sym = 0; Sym != N; ++Sym)
+      if (Lengths[Sym])
+        H.Symbol[Offs[Lengths[Sym]]++] = Sym;
+    return Left;
+  }
+
+  void codes(const Huffman &LenCode, const Huffman &DistCode) {
+    static constexpr uint16_t LenBase[29] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static constexpr uint16_t LenExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                              1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                              4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static constexpr uint16_t DistBase[30] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static constexpr uint16_t DistExtra[30] = {0, 0, 0,  0,  1,  1,  2,  2,
+                                               3, 3, 4,  4,  5,  5,  6,  6,
+                                               7, 7, 8,  8,  9,  9,  10, 10,
+                                               11, 11, 12, 12, 13, 13};
+
+    for (;;) {
+      int Sym = decode(LenCode);
+      if (Error || Sym == 256 || isFull())
+        return;
+
+      if (Sym < 256) {
+        Out[OutPos++] = static_cast<uint8_t>(Sym);
+        continue;
+      }
+
+      // Length and distance
+      Sym -= 257;
+      if (Sym >= 29) {
+        Error = true;
+        return;
+      }
+      size_t Len = LenBase[Sym] + bits(LenExtra[Sym]);
+      Sym = decode(DistCode);
+      if (Error || Sym >= 30) {
+        Error = true;
+        return;
+      }
+      size_t Dist = DistBase[Sym] + bits(DistExtra[Sym]);
+      if (Error || Dist > OutPos) {
+        Error = true;
+        return;
+      }
+      Len = min(Len, OutSize - OutPos);
+      for (; Len; --Len, ++OutPos)
+        Out[OutPos] = Out[OutPos - Dist];
+    }
+  }
+
+  void fixed() {
+    static const auto Codes = []() {
+      pair<Huffman, Huffman> Codes;
+      uint16_t Lengths[FixedLengthCodes];
+      int Sym = 0;
+      for (; Sym < 144; ++Sym)
+        Lengths[Sym] = 8;
+      for (; Sym < 256; ++Sym)
+        Lengths[Sym] = 9;
+      for (; Sym < 280; ++Sym)
+        Lengths[Sym] = 7;
+      for (; Sym < FixedLengthCodes; ++Sym)
+        Lengths[Sym] = 8;
+      construct(Codes.first, Lengths, FixedLengthCodes);
+      fill_n(Lengths, MaxDistCodes, 5);
+      construct(Codes.second, Lengths, MaxDistCodes);
+      return Codes;
+    }();
+    codes(Codes.first, Codes.second);
+  }
+
+  void dynamic() {
+    static constexpr uint8_t Order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                          11, 4,  12, 3, 13, 2, 14, 1, 15};
+
+    int NLen = bits(5) + 257;
+    int NDist = bits(5) + 1;
+    int NCode = bits(4) + 4;
+    if (Error || NLen > MaxLengthCodes || NDist > MaxDistCodes) {
+      Error = true;
+      return;
+    }
+
+    // Read code length code lengths.
+    uint16_t Lengths[MaxLengthCodes + MaxDistCodes];
+    int Index = 0;
+    for (; Index < NCode; ++Index)
+      Lengths[Order[Index]] = bits(3);
+    for (; Index < 19; ++Index)
+      Lengths[Order[Index]] = 0;
+    Huffman LenCode, DistCode;
+    if (Error || construct(LenCode, Lengths, 19) != 0) {
+      Error = true;
+      return;
+    }
+
+    // Read length and distance code lengths.
+    Index = 0;
+    while (Index < NLen + NDist) {
+      int Sym = decode(LenCode);
+      if (Error)
+        return;
+      if (Sym < 16) {
+        Lengths[Index++] = Sym;
+        continue;
+      }
+
+      uint16_t Len = 0;
+      if (Sym == 16) {
+        if (Index == 0) {
+          Error = true;
+          return;
+        }
+        Len = Lengths[Index - 1];
+        Sym = 3 + bits(2);
+      } else if (Sym == 17)
+        Sym = 3 + bits(3);
+      else
+        Sym = 11 + bits(7);
+      if (Error || Index + Sym > NLen + NDist) {
+        Error = true;
+        return;
+      }
+      while (Sym--)
+        Lengths[Index++] = Len;
+    }
+    if (Lengths[256] == 0) {
+      Error = true;
+      return;
+    }
+
+    // Incomplete codes are allowed only for a single length.
+    int Err = construct(LenCode, Lengths, NLen);
+    if (Err && (Err < 0 || NLen != LenCode.Count[0] + LenCode.Count[1])) {
+      Error = true;
+      return;
+    }
+    Err = construct(DistCode, Lengths + NLen, NDist);
+    if (Err && (Err < 0 || NDist != DistCode.Count[0] + DistCode.Count[1])) {
+      Error = true;
+      return;
+    }
+
+    codes(LenCode, DistCode);
+  }
+
+  const uint8_t *In;
+  size_t InSize, InPos;
+  uint8_t *Out;
+  size_t OutSize, OutPos;
+  uint32_t BitBuf;
+  int BitCount;
+  bool Error;
+};
+
+} // namespace
+
+IpaArchive::IpaArchive(const string &Path)
+    : Path(Path), Mapping(nullptr), View(nullptr), FileSize(0) {
+  // Note that `CreateFile2FromAppW` can open files picked by the user, as well.
+  HANDLE File = CreateFile2FromAppW(to_hstring(Path).c_str(), GENERIC_READ,
+                                    FILE_SHARE_READ, OPEN_EXISTING, nullptr);
+  if (File == INVALID_HANDLE_VALUE) {
+    Log.error() << "couldn't open " << Path << Log.appendWinError();
+    return;
+  }
+
+  FILE_STANDARD_INFO Info;
+  if (!GetFileInformationByHandleEx(File, FileStandardInfo, &Info,
+                                    sizeof(Info))) {
+    Log.error() << "couldn't get size of " << Path << Log.appendWinError();
+    CloseHandle(File);
+    return;
+  }
+  FileSize = Info.EndOfFile.QuadPart;
+
+  // Pages of the mapping can be copied on write (see `mapCopy`).
+  Mapping = CreateFileMappingFromApp(File, nullptr, PAGE_WRITECOPY, 0, nullptr);
+  CloseHandle(File);
+  if (!Mapping) {
+    Log.error() << "couldn't create file mapping of " << Path
+                << Log.appendWinError();
+    return;
+  }
+  View = reinterpret_cast<const uint8_t *>(
+      MapViewOfFileFromApp(Mapping, FILE_MAP_READ, 0, 0));
+  if (!View) {
+    Log.error() << "couldn't map view of " << Path << Log.appendWinError();
+    return;
+  }
+
+  if (!index()) {
+    Log.error() << "invalid archive " << Path << Log.end();
+    UnmapViewOfFile(View);
+    View = nullptr;
+  }
+}
+
+IpaArchive::~IpaArchive() {
+  if (View)
+    UnmapViewOfFile(View);
+  if (Mapping)
+    CloseHandle(Mapping);
+}
+
+bool IpaArchive::index() {
+  // Find the end of central directory record. It's followed only by a comment
+  // of at most 64 KiB.
+  if (FileSize < EndOfCentralDirSize)
+    return false;
+  const uint8_t *EOCD = nullptr;
+  uint64_t MinOffset =
+      FileSize > EndOfCentralDirSize + 0xffff
+          ? FileSize - EndOfCentralDirSize - 0xffff
+          : 0;
+  for (uint64_t Offset = FileSize - EndOfCentralDirSize + 1;
+       Offset-- > MinOffset;)
+    if (read32(View + Offset) == EndOfCentralDirSig) {
+      EOCD = View + Offset;
+      break;
+    }
+  if (!EOCD)
+    return false;
+
+  uint16_t Count = read16(EOCD + 10);
+  uint64_t DirSize = read32(EOCD + 12);
+  uint64_t DirOffset = read32(EOCD + 16);
+  if (DirOffset == 0xffffffff) {
+    Log.error("ZIP64 archives are not supported");
+    return false;
+  }
+  if (DirOffset + DirSize > FileSize)
+    return false;
+
+  // Index the central directory.
+  Entries.reserve(Count);
+  const uint8_t *P = View + DirOffset, *End = P + DirSize;
+  for (uint16_t I = 0; I != Count; ++I) {
+    if (P + CentralHeaderSize > End || read32(P) != CentralHeaderSig)
+      return false;
+    uint16_t NameLen = read16(P + 28);
+    uint16_t ExtraLen = read16(P + 30);
+    uint16_t CommentLen = read16(P + 32);
+    if (P + CentralHeaderSize + NameLen > End)
+      return false;
+
+    Entry E;
+    E.Method = read16(P + 10);
+    E.CRC = read32(P + 16);
+    E.CompressedSize = read32(P + 20);
+    E.Size = read32(P + 24);
+    E.LocalOffset = read32(P + 42);
+    string Name(reinterpret_cast<const char *>(P + CentralHeaderSize),
+                NameLen);
+
+    // Skip directories and entries we cannot read.
+    if (read16(P + 8) & 1)
+      Log.warning() << "skipping encrypted entry " << Name << Log.end();
+    else if (E.Method != Stored && E.Method != Deflated)
+      Log.warning() << "skipping entry " << Name
+                    << " with unsupported compression method " << E.Method
+                    << Log.end();
+    else if (E.Method == Stored && E.Size != E.CompressedSize)
+      Log.warning() << "skipping stored entry " << Name
+                    << " with mismatched sizes" << Log.end();
+    else if (!Name.empty() && Name.back() != '/') {
+      // The app bundle is the only folder inside `Payload/`.
+      constexpr ConstexprString Payload("Payload/");
+      size_t BundleEnd = Name.find(".app/", Payload.Len);
+      if (Bundle.empty() && startsWith(Name, Payload) &&
+          BundleEnd != string::npos)
+        Bundle = Name.substr(0, BundleEnd + 5);
+
+      Entries.emplace(move(Name), E);
+    }
+
+    P += CentralHeaderSize + NameLen + ExtraLen + CommentLen;
+  }
+
+  if (Bundle.empty()) {
+    Log.error() << "couldn't find app bundle inside " << Path << Log.end();
+    return false;
+  }
+
+  // Index folders of the bundle, so that the runtime can enumerate them (see
+  // `listResources`). Archives don't always contain entries for folders, so
+  // they are inferred from paths of files.
+  Folders[""];
+  for (const auto &[Name, E] : Entries) {
+    if (!startsWith(Name, Bundle))
+      continue;
+    string Child(Name.substr(Bundle.length()));
+    for (;;) {
+      size_t Slash = Child.rfind('/');
+      string Parent(Slash == string::npos ? "" : Child.substr(0, Slash));
+      auto [I, New] = Folders.try_emplace(Parent);
+      I->second.push_back(Child.substr(Slash + 1));
+      if (!New || Parent.empty())
+        break;
+      Child = move(Parent);
+    }
+  }
+  return true;
+}
+
+// The main binary has the same name as the bundle, without `.app`.
+string IpaArchive::getMainBinary() {
+  size_t NameStart = Bundle.rfind('/', Bundle.length() - 2) + 1;
+  return Bundle + Bundle.substr(NameStart, Bundle.length() - NameStart - 5);
+}
+
+const IpaArchive::Entry *IpaArchive::find(const string &Name) {
+  auto I = Entries.find(Name);
+  return I != Entries.end() ? &I->second : nullptr;
+}
+
+// Note that sizes in the local header can differ from those in the central
+// directory (if they are stored in a data descriptor), only lengths of name and
+// extra field matter here.
+uint64_t IpaArchive::getDataOffset(const Entry &E) {
+  if (E.LocalOffset + LocalHeaderSize > FileSize)
+    return FileSize;
+  const uint8_t *P = View + E.LocalOffset;
+  if (read32(P) != LocalHeaderSig)
+    return FileSize;
+  return E.LocalOffset + LocalHeaderSize + read16(P + 26) + read16(P + 28);
+}
+
+const uint8_t *IpaArchive::getData(const Entry &E) {
+  uint64_t Offset = getDataOffset(E);
+  if (Offset + E.CompressedSize > FileSize) {
+    Log.error() << "entry at 0x" << to_hex_string(E.LocalOffset) << " of "
+                << Path << " is out of bounds" << Log.end();
+    return nullptr;
+  }
+  return View + Offset;
+}
+
+bool IpaArchive::readPrefix(const Entry &E, void *Buffer, size_t Size) {
+  if (Size > E.Size)
+    return false;
+  const uint8_t *Data = getData(E);
+  if (!Data)
+    return false;
+  if (E.Method == Stored) {
+    memcpy(Buffer, Data, Size);
+    return true;
+  }
+  Inflater Inf(Data, E.CompressedSize, reinterpret_cast<uint8_t *>(Buffer),
+               Size);
+  return Inf.run() && Inf.getOutSize() == Size;
+}
+
+bool IpaArchive::read(const Entry &E, vector<uint8_t> &Data) {
+  const uint8_t *Source = getData(E);
+  if (!Source)
+    return false;
+  Data.resize(E.Size);
+  if (E.Method == Stored)
+    memcpy(Data.data(), Source, E.Size);
+  else {
+    Inflater Inf(Source, E.CompressedSize, Data.data(), Data.size());
+    if (!Inf.run() || Inf.getOutSize() != E.Size) {
+      Log.error() << "couldn't inflate entry at 0x"
+                  << to_hex_string(E.LocalOffset) << " of " << Path
+                  << Log.end();
+      return false;
+    }
+  }
+
+  if (crc32(Data.data(), Data.size()) != E.CRC) {
+    Log.error() << "CRC mismatch in entry at 0x"
+                << to_hex_string(E.LocalOffset) << " of " << Path << Log.end();
+    return false;
+  }
+  return true;
+}
+
+void *IpaArchive::mapCopy(const Entry &E, uint64_t FileBytes, uint64_t Size,
+                          uint64_t &Mapped) {
+  Mapped = 0;
+  if (E.Method != Stored)
+    return nullptr;
+
+  // Views must start at multiples of allocation granularity, but we need only
+  // the data to be page-aligned.
+  constexpr uint64_t Granularity = DynamicLoader::AllocationGranularity;
+  uint64_t Offset = getDataOffset(E);
+  uint64_t ViewOffset = Offset & ~(Granularity - 1);
+  uint64_t Delta = Offset - ViewOffset;
+  if (Delta % DynamicLoader::PageSize != 0 || Offset + E.Size > FileSize)
+    return nullptr;
+
+  // Unlike past the end of a file, there is other data of the archive past the
+  // end of the entry, so that isn't mapped. The view must also reach past the
+  // preceding data of the archive. Note that the view is never unmapped, it's
+  // used by the loaded image.
+  uint64_t ViewBytes = Delta + min(FileBytes, E.Size);
+  if (ViewBytes < Granularity)
+    return nullptr;
+  auto *Ptr = reinterpret_cast<uint8_t *>(DynamicLoader::mapFilePrefix(
+      Mapping, ViewOffset, ViewBytes, Delta + Size, Mapped));
+  if (!Ptr) {
+    Log.error() << "couldn't map entry at 0x" << to_hex_string(E.LocalOffset)
+                << " of " << Path << Log.end();
+    return nullptr;
+  }
+  Mapped -= Delta;
+  return Ptr + Delta;
+}
+
+// Note that the bundle itself can also be referred to without the trailing
+// slash (e.g., when the runtime strips the main binary's name from
+// `ipaSim_processPath`).
+string IpaArchive::getBundlePath(const string &Name) {
+  if (Name.length() + 1 == Bundle.length() && startsWith(Bundle, Name))
+    return "";
+  string Result(startsWith(Name, Bundle) ? Name.substr(Bundle.length()) : Name);
+  if (!Result.empty() && Result.back() == '/')
+    Result.pop_back();
+  return Result;
+}
+
+const uint8_t *IpaArchive::getResource(const string &Name, size_t &Size) {
+  const Entry *E = find(Bundle + getBundlePath(Name));
+  if (!E)
+    return nullptr;
+  Size = E->Size;
+  if (E->Method == Stored)
+    return getData(*E);
+
+  lock_guard<mutex> Lock(Mutex);
+  auto I = Inflated.find(E);
+  if (I == Inflated.end()) {
+    vector<uint8_t> Data;
+    if (!read(*E, Data))
+      return nullptr;
+    I = Inflated.emplace(E, move(Data)).first;
+  }
+  return I->second.data();
+}
+
+const vector<string> *IpaArchive::listResources(const string &Dir) {
+  auto I = Folders.find(getBundlePath(Dir));
+  return I != Folders.end() ? &I->second : nullptr;
+}
@@ -33,6 +33,13 @@ using namespace IpaSimApp::implementation;
 #endif
 constexpr bool ShowLogWindow = IPASIM_SHOW_LOG_WINDOW;
 
+// If enabled, the user is first asked for an `.ipa` archive, which is run
+// without extracting it.
+#if !defined(IPASIM_PICK_IPA)
+#define IPASIM_PICK_IPA 1
+#endif
+constexpr bool PickIpa = IPASIM_PICK_IPA;
+
 /// <summary>
 /// Initializes the singleton application object.  This is the first line of
 /// authored code executed, and as such is the logical equivalent of main() or
@@ -67,8 +74,32 @@ static IAsyncOperation<StorageFolder> copyFolder(StorageFolder Source,
 }
 
 // TODO: Move these into `IpaSimLibrary` when possible.
+static void run(const hstring &Path,
+                const LaunchActivatedEventArgs &LaunchArgs) {
+  // Execute the main logic inside `IpaSimLibrary`.
+  ipasim::start(Path, LaunchArgs);
+
+  // Change status from "Loading..." to "Done.".
+  if (auto F = Window::Current().Content().try_as<Frame>())
+    if (auto Page = F.Content().try_as<IpaSimApp::MainPage>())
+      Page.Loaded(true);
+}
 static IAsyncAction startCore(LaunchActivatedEventArgs LaunchArgs) {
-  // Ask user for folder containing the binary.
+  if constexpr (PickIpa) {
+    // Ask user for the app's `.ipa` archive. It's run right from the archive,
+    // so nothing has to be extracted or copied.
+    FileOpenPicker FOP;
+    FOP.FileTypeFilter().Append(L".ipa");
+    if (StorageFile Ipa = co_await FOP.PickSingleFileAsync()) {
+      StorageApplicationPermissions::FutureAccessList().AddOrReplace(
+          L"PickedIpaToken", Ipa);
+      ApplicationView::GetForCurrentView().Title(Ipa.DisplayName());
+      run(Ipa.Path(), LaunchArgs);
+      co_return;
+    }
+  }
+
+  // Otherwise, ask user for folder containing the binary.
   FolderPicker FP;
   FP.FileTypeFilter().Append(L"*");
   StorageFolder Folder(co_await FP.PickSingleFolderAsync());
@@ -103,14 +134,7 @@ static IAsyncAction startCore(LaunchActivatedEventArgs LaunchArgs) {
   Folder = co_await copyFolder(Folder,
                                ApplicationData::Current().LocalCacheFolder());
   Bin = co_await Folder.GetFileAsync(Bin.Name());
-
-  // Execute the main logic inside `IpaSimLibrary`.
-  ipasim::start(Bin.Path(), LaunchArgs);
-
-  // Change status from "Loading..." to "Done.".
-  if (auto F = Window::Current().Content().try_as<Frame>())
-    if (auto Page = F.Content().try_as<IpaSimApp::MainPage>())
-      Page.Loaded(true);
+  run(Bin.Path(), LaunchArgs);
 }
 static IAsyncAction start(LaunchActivatedEventArgs LaunchArgs) {
   if constexpr (ShowLogWindow) {
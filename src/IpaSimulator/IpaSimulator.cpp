@@ -3,29 +3,94 @@
 
 #include "ipasim/IpaSimulator.hpp"
 
+#include "ipasim/Benchmarks.hpp"
 #include "ipasim/DynamicLoader.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
 #include "ipasim/LoadedLibrary.hpp"
 
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <psapi.h>
 #include <string>
+#include <vector>
+#include <winrt/Windows.Storage.h>
 
 using namespace ipasim;
 using namespace std;
 using namespace winrt;
 using namespace Windows::ApplicationModel::Activation;
+using namespace Windows::Storage;
+
+static string getTracePath(const char *Name) {
+  filesystem::path Path(
+      to_string(ApplicationData::Current().LocalFolder().Path()));
+  return (Path / Name).string();
+}
 
 // TODO: This Emu-Dyld circular reference is not very cool.
-IpaSimulator::IpaSimulator() : Emu(Dyld), Dyld(Emu), Sys(Dyld, Emu) {}
+IpaSimulator::IpaSimulator()
+    : Emu(Dyld), Dyld(Emu), Sys(Dyld, Emu), Trace(Emu, Dyld),
+      Sampler(Emu, Dyld) {}
+
+// Logs statistics of the dynamic loader. Called once the app is loaded and
+// again at exit, when lazy bindings performed at runtime are included.
+static void reportLoader(const char *When) {
+  const SysTranslator::GateStats &Gates = IpaSim.Sys.getGateStats();
+  size_t Hits = IpaSim.Dyld.getPrelinkHits();
+  size_t Misses = IpaSim.Dyld.getPrelinkMisses();
+  PROCESS_MEMORY_COUNTERS Counters;
+  Counters.cb = sizeof(Counters);
+  // Startup times are only comparable between runs of the same kind (see
+  // `ipaSim_clearPrelinkCache`).
+  Log.info() << "loader " << When << " ("
+             << (!Hits ? "cold" : !Misses ? "warm" : "partially warm")
+             << "): prelink cache hits: " << Hits << ", misses: " << Misses
+             << ", lazy binds: " << IpaSim.Dyld.getLazyBindCount()
+             << ", gated calls: " << Gates.Direct.load() << " direct, "
+             << Gates.Deferred.load() << " deferred";
+  // Compare these between runs with and without `MapImages`.
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &Counters, sizeof(Counters)))
+    Log.infs() << ", working set: " << (Counters.WorkingSetSize / 1024)
+               << " KiB (peak " << (Counters.PeakWorkingSetSize / 1024)
+               << " KiB, images " << (MapImages ? "mapped" : "copied") << ")";
+  Log.infs() << Log.end();
+}
 
 void ipasim::start(const hstring &Path,
                    const LaunchActivatedEventArgs &LaunchArgs) {
   // Load the binary.
   IpaSim.MainBinary = to_string(Path);
+  auto StartTime = chrono::steady_clock::now();
+  if (endsWith(IpaSim.MainBinary, ".ipa")) {
+    // Run the app right from the archive, without extracting it. Bundle
+    // resources can be served from the archive, too (see `ipaSim_getResource`
+    // and i31).
+    ProfileScope Scope(IpaSim.Prof, "open archive", IpaSim.MainBinary);
+    IpaSim.Archive = make_unique<IpaArchive>(IpaSim.MainBinary);
+    if (!IpaSim.Archive->isValid())
+      return;
+    IpaSim.Dyld.setArchive(IpaSim.Archive.get());
+    IpaSim.MainBinary = IpaSim.Archive->getMainBinary();
+  }
+  ProfileScope Scope(IpaSim.Prof, "load app", IpaSim.MainBinary);
   LoadedLibrary *App = IpaSim.Dyld.load(IpaSim.MainBinary);
+  Scope.end();
   if (!App)
     return;
+  Log.info() << "loaded app in "
+             << chrono::duration_cast<chrono::milliseconds>(
+                    chrono::steady_clock::now() - StartTime)
+                    .count()
+             << " ms" << Log.end();
+  reportLoader("at startup");
+  // Functions registered now run before destructors of `IpaSim` and `Log`.
+  atexit([]() { reportLoader("at exit"); });
 
   // Execute it.
   IpaSim.Sys.execute(App);
+  if constexpr (RunBenchmarks)
+    Benchmarks(IpaSim.Dyld, IpaSim.Sys).run();
 
   // Call `UIApplicationLaunched`. `get_abi` converts C++/WinRT object to its
   // C++/CX equivalent.
@@ -47,9 +112,91 @@ IPASIM_API void ipaSim_translate4(uint32_t *Addr) {
 IPASIM_API void *ipaSim_translateC(void *FP, size_t ArgC) {
   return IpaSim.Sys.translate(FP, ArgC);
 }
+// Every call of `ipaSim_translate*` takes a reference to the returned
+// trampoline. These should be called wherever such callback is unregistered
+// (e.g., when a block is released or a delegate is replaced), so that the
+// trampoline can be freed. Calling the pointer afterwards logs an error.
+IPASIM_API void ipaSim_release(void *FP) { IpaSim.Sys.release(FP); }
+// Counterpart of `ipaSim_translate4`. Restores the emulated pointer.
+IPASIM_API void ipaSim_release4(uint32_t *Addr) {
+  Addr[1] = reinterpret_cast<uint32_t>(
+      IpaSim.Sys.release(reinterpret_cast<void *>(Addr[1])));
+}
+IPASIM_API void ipaSim_reportTrampolines() { IpaSim.Sys.reportTrampolines(); }
+// Should be called before the app is started.
+IPASIM_API void ipaSim_clearPrelinkCache() { IpaSim.Dyld.clearPrelinkCache(); }
+IPASIM_API void ipaSim_runBenchmarks() {
+  Benchmarks(IpaSim.Dyld, IpaSim.Sys).run();
+}
+IPASIM_API void ipaSim_reportStackUsage() { IpaSim.Sys.reportStackUsage(); }
+IPASIM_API void ipaSim_reportMemoryFaults() {
+  IpaSim.Sys.reportMemoryFaults();
+}
+IPASIM_API void ipaSim_dumpMemoryMap() { IpaSim.Emu.dumpMemoryMap(); }
+// Starts recording a trace into `trace.bin` in the app's local folder (see
+// `Tracer`). Nothing is recorded until some ranges are added. Note that
+// `MemWrites` slows down all emulated writes (see `Tracer::Options`).
+IPASIM_API bool ipaSim_startTracing(uint32_t Period, bool Instructions,
+                                    bool MemWrites) {
+  Tracer::Options Opts;
+  Opts.Period = Period;
+  Opts.Instructions = Instructions;
+  Opts.MemWrites = MemWrites;
+  return IpaSim.Trace.start(getTracePath("trace.bin"), Opts);
+}
+// Records library `Lib`, which must already be loaded.
+IPASIM_API bool ipaSim_traceLibrary(const char *Lib) {
+  return IpaSim.Trace.addLibrary(Lib);
+}
+IPASIM_API bool ipaSim_traceSymbol(const char *Lib, const char *Name) {
+  return IpaSim.Trace.addSymbol(Lib, Name);
+}
+// Records code in [`Begin`, `End`).
+IPASIM_API void ipaSim_traceRange(const void *Begin, const void *End) {
+  IpaSim.Trace.addRange(reinterpret_cast<uint64_t>(Begin),
+                        reinterpret_cast<uint64_t>(End) - 1);
+}
+IPASIM_API void ipaSim_stopTracing() { IpaSim.Trace.stop(); }
+// Symbolizes the last trace into `trace.txt` next to it.
+IPASIM_API bool ipaSim_decodeTrace() {
+  return IpaSim.Trace.decode(getTracePath("trace.bin"),
+                             getTracePath("trace.txt"));
+}
+// Starts sampling emulated code `Frequency` times per second (or
+// `SamplingFrequency` times if it's 0).
+IPASIM_API bool ipaSim_startSampling(unsigned Frequency) {
+  return IpaSim.Sampler.start(Frequency ? Frequency : SamplingFrequency);
+}
+IPASIM_API void ipaSim_reportSampling() { IpaSim.Sampler.report(); }
+// If the app is run from an `.ipa` archive, this returns path of the main
+// binary inside the archive (see `ipaSim_isArchived`).
 IPASIM_API const char *ipaSim_processPath() {
   return IpaSim.MainBinary.c_str();
 }
+// Returns `true` if the app is run from an `.ipa` archive. In that case, the
+// runtime's bundle lookup (i.e., `CFBundle`'s file access) must go through
+// `ipaSim_getResource` and `ipaSim_listResource` instead of the file system
+// (see i31).
+IPASIM_API bool ipaSim_isArchived() { return IpaSim.Archive != nullptr; }
+// Returns contents of file `Name` (relative to the app bundle or inside
+// `ipaSim_processPath`'s folder) if the app is run from an `.ipa` archive.
+// Otherwise (or if it doesn't exist), returns `nullptr`.
+IPASIM_API const void *ipaSim_getResource(const char *Name, size_t *Size) {
+  if (!IpaSim.Archive)
+    return nullptr;
+  return IpaSim.Archive->getResource(Name, *Size);
+}
+// Returns name of the `Index`-th file or folder inside folder `Dir` of the app
+// bundle (interpreted like `Name` in `ipaSim_getResource`) or `nullptr` if
+// there are no more of them.
+IPASIM_API const char *ipaSim_listResource(const char *Dir, size_t Index) {
+  if (!IpaSim.Archive)
+    return nullptr;
+  const vector<string> *Names = IpaSim.Archive->listResources(Dir);
+  if (!Names || Index >= Names->size())
+    return nullptr;
+  return (*Names)[Index].c_str();
+}
 IPASIM_API void ipaSim_callBack1(void *FP, void *Arg0) {
   IpaSim.Sys.callBack(FP, Arg0);
 }
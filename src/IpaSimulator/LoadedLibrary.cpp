@@ -3,76 +3,163 @@
 
 #include "ipasim/LoadedLibrary.hpp"
 
+#include "ipasim/DyldInfo.hpp"
 #include "ipasim/DynamicLoader.hpp"
 #include "ipasim/IpaSimulator.hpp"
 
+#include <algorithm>
+#include <cstring>
+
 using namespace ipasim;
 using namespace std;
 
-DylibSymbolIterator DylibSymbolIterator::begin() {
-  return DylibSymbolIterator(RVA, Symbols.begin()).next();
+bool LoadedLibrary::isInRange(uint64_t Addr) {
+  return StartAddress <= Addr && Addr < StartAddress + Size;
 }
 
-DylibSymbolIterator &DylibSymbolIterator::next() {
-  while (Symbols != Symbols.end() && Symbols->value() != RVA)
-    ++Symbols;
-  return *this;
+void LoadedLibrary::checkInRange(uint64_t Addr) {
+  if (!isInRange(Addr))
+    Log.error() << "address " << Addr << " out of range" << Log.end();
 }
 
-DylibSymbolIterator &DylibSymbolIterator::operator++() {
-  ++Symbols;
-  return next();
+ObjCMethod LoadedLibrary::findMethod(uint64_t Addr) {
+  assert(hasMachO());
+  return Methods.find(getMachO(), Addr);
 }
 
-bool DylibSymbolIterator::operator!=(const DylibSymbolIterator &Other) {
-  return Symbols != Other.Symbols;
+ObjCMethod LoadedLibrary::findPrecedingMethod(uint64_t Addr, uint64_t &Start) {
+  assert(hasMachO());
+  return Methods.findPreceding(getMachO(), Addr, Start);
 }
 
-LIEF::MachO::Symbol &DylibSymbolIterator::operator*() { return *Symbols; }
+uint64_t LoadedDylib::findSymbol(DynamicLoader &DL, const char *Name) {
+  if (const uint64_t *Addr = getSymbols().find(Name))
+    return *Addr;
 
-bool LoadedLibrary::isInRange(uint64_t Addr) {
-  return StartAddress <= Addr && Addr < StartAddress + Size;
+  if (Reexports.empty())
+    return 0;
+  {
+    lock_guard<mutex> Lock(ReexportMutex);
+    auto I = ReexportMemo.find(Name);
+    if (I != ReexportMemo.end())
+      return I->second;
+  }
+
+  // Try also re-exported libraries. The mutex isn't held meanwhile, because
+  // they can re-export this library back.
+  uint64_t SymAddr = 0;
+  for (const char *LibName : Reexports) {
+    LoadedLibrary *LL = DL.load(LibName);
+    if (!LL)
+      continue;
+
+    // If the target library is DLL, it doesn't have underscore prefixes, so we
+    // need to remove it.
+    if (!LL->hasUnderscorePrefix() && Name[0] == '_')
+      SymAddr = LL->findSymbol(DL, Name + 1);
+    else
+      SymAddr = LL->findSymbol(DL, Name);
+
+    if (SymAddr)
+      break;
+  }
+
+  lock_guard<mutex> Lock(ReexportMutex);
+  ReexportMemo.emplace(Name, SymAddr);
+  return SymAddr;
 }
 
-void LoadedLibrary::checkInRange(uint64_t Addr) {
-  if (!isInRange(Addr))
-    Log.error() << "address " << Addr << " out of range" << Log.end();
+SymbolTable &LoadedDylib::getSymbols() {
+  call_once(SymbolsIndexed, [&]() { indexSymbols(); });
+  return Symbols;
 }
 
-uint64_t LoadedDylib::findSymbol(DynamicLoader &DL, const string &Name) {
-  using namespace LIEF::MachO;
+void LoadedDylib::setSymbols(SymbolTable &&Table) {
+  call_once(SymbolsIndexed, [&]() {
+    Symbols = move(Table);
+    indexReexports();
+  });
+}
+
+void LoadedDylib::indexReexports() {
+  DyldInfo Info(getMachO().getHeader(), StartAddress);
+  Reexports = Info.getReexports();
+}
 
-  if (!Bin.has_symbol(Name)) {
-    // Try also re-exported libraries.
-    for (DylibCommand &Lib : Bin.libraries()) {
-      if (Lib.command() != LOAD_COMMAND_TYPES::LC_REEXPORT_DYLIB)
-        continue;
+// Symbols are read from the loaded image rather than from LIEF's binary, so
+// that their names live as long as the image and this works even without LIEF.
+void LoadedDylib::indexSymbols() {
+  DyldInfo Info(getMachO().getHeader(), StartAddress);
+  Reexports = Info.getReexports();
+  Info.forEachSymbol(
+      [&](const char *Name, uint64_t Addr) { Symbols.insert(Name, Addr); });
+}
 
-      LoadedLibrary *LL = DL.load(Lib.name());
-      if (!LL)
-        continue;
+uint64_t LoadedDll::findSymbol(DynamicLoader &DL, const char *Name) {
+  return (uint64_t)GetProcAddress(Ptr, Name);
+}
 
-      // If the target library is DLL, it doesn't have underscore prefixes, so
-      // we need to remove it.
-      uint64_t SymAddr;
-      if (!LL->hasUnderscorePrefix() && Name[0] == '_')
-        SymAddr = LL->findSymbol(DL, Name.substr(1));
-      else
-        SymAddr = LL->findSymbol(DL, Name);
+// The symbol table is used rather than LIEF's binary, so that this works also
+// for images loaded from `PrelinkCache`.
+vector<const char *> LoadedDylib::lookup(uint64_t Addr) {
+  vector<const char *> Names;
+  getSymbols().forEach([&](const char *Name, uint64_t SymAddr) {
+    if ((SymAddr & ~1ULL) == (Addr & ~1ULL))
+      Names.push_back(Name);
+  });
+  return Names;
+}
 
-      if (SymAddr)
-        return SymAddr;
-    }
-    return 0;
-  }
-  return StartAddress + Bin.get_symbol(Name).value();
+// FNV-1a
+uint32_t SymbolTable::hash(const char *Name) {
+  uint32_t Hash = 2166136261u;
+  for (; *Name; ++Name)
+    Hash = (Hash ^ static_cast<uint8_t>(*Name)) * 16777619u;
+  return Hash;
 }
 
-uint64_t LoadedDll::findSymbol(DynamicLoader &DL, const string &Name) {
-  return (uint64_t)GetProcAddress(Ptr, Name.c_str());
+const uint64_t *SymbolTable::find(const char *Name) {
+  if (Entries.empty())
+    return nullptr;
+  Entry &E = findEntry(Name, hash(Name));
+  return E.Name ? &E.Addr : nullptr;
+}
+
+void SymbolTable::insert(const char *Name, uint64_t Addr) {
+  // Keep load factor under 3/4.
+  if ((Count + 1) * 4 > Entries.size() * 3)
+    rehash(max<size_t>(Entries.size() * 2, 16));
+
+  uint32_t Hash = hash(Name);
+  Entry &E = findEntry(Name, Hash);
+  if (E.Name)
+    return;
+  E = Entry{Name, Addr, Hash};
+  ++Count;
+}
+
+void SymbolTable::reserve(size_t Count) {
+  size_t Capacity = 16;
+  while (Capacity * 3 < Count * 4)
+    Capacity *= 2;
+  if (Capacity > Entries.size())
+    rehash(Capacity);
+}
+
+// Returns either entry containing `Name` or an empty entry where it belongs.
+SymbolTable::Entry &SymbolTable::findEntry(const char *Name, uint32_t Hash) {
+  size_t Mask = Entries.size() - 1;
+  for (size_t I = Hash & Mask;; I = (I + 1) & Mask) {
+    Entry &E = Entries[I];
+    if (!E.Name || (E.Hash == Hash && !strcmp(E.Name, Name)))
+      return E;
+  }
 }
 
-DylibSymbolIterator LoadedDylib::lookup(uint64_t Addr) {
-  uint64_t RVA = Addr - StartAddress;
-  return DylibSymbolIterator(RVA, Bin.exported_symbols());
+void SymbolTable::rehash(size_t Capacity) {
+  vector<Entry> Old(Capacity, Entry{nullptr, 0, 0});
+  Old.swap(Entries);
+  for (Entry &E : Old)
+    if (E.Name)
+      findEntry(E.Name, E.Hash) = E;
 }
@@ -4,9 +4,12 @@
 
 #include "ipasim/Common.hpp"
 
+#include <algorithm>
 #include <llvm/BinaryFormat/MachO.h>
+#include <mutex>
 
 using namespace ipasim;
+using namespace std;
 
 // Inspired by
 // https://opensource.apple.com/source/cctools/cctools-895/libmacho/getsecbyname.c.auto.html.
@@ -76,6 +79,7 @@ struct method_list_t {
 
 constexpr int FAST_DATA_MASK = 0xfffffffcUL;
 constexpr int RW_REALIZED = 1 << 31;
+constexpr int RO_META = 1 << 0;
 
 struct class_ro_t {
   uint32_t flags;
@@ -184,6 +188,17 @@ const char *ObjCMethod::getName() {
 const char *ObjCMethod::getType() {
   return reinterpret_cast<method_t *>(MethodData)->types;
 }
+bool ObjCMethod::isClassMethod() {
+  if (Category) {
+    // Find out which list of the category contains the method.
+    method_list_t *List =
+        reinterpret_cast<category_t *>(ClassData)->classMethods;
+    auto *Method = reinterpret_cast<method_t *>(MethodData);
+    return List && Method >= List->methods &&
+           Method < List->methods + List->count;
+  }
+  return reinterpret_cast<objc_class *>(ClassData)->getInfo()->flags & RO_META;
+}
 const char *ObjCClass::getName() {
   if (Category)
     return reinterpret_cast<category_t *>(Data)->name;
@@ -259,3 +274,76 @@ ObjCMethod MachO::findMethod(uint64_t Addr) {
 
   return ObjCMethod();
 }
+
+void ObjCMethodIndex::build(MachO Image) {
+  auto AddList = [this](bool Category, void *ClassData,
+                        method_list_t *Methods) {
+    if (!Methods)
+      return;
+    for (size_t I = 0; I != Methods->count; ++I)
+      Entries.push_back(
+          Entry{reinterpret_cast<uint64_t>(Methods->methods[I].imp), Category,
+                ClassData, Methods});
+  };
+  // Note that `class_ro_t` is immutable and for realized classes, it's only
+  // reachable from `class_rw_t`, which the runtime fills before publishing it.
+  auto AddClass = [&AddList](objc_class *Class) {
+    AddList(/* Category */ false, Class, Class->getInfo()->baseMethodList);
+  };
+
+  // Entries are added in the same order `MachO::findMethod` would find them.
+  // Together with stable sorting, this ensures both return the same method if
+  // there are more with the same implementation.
+  for (const char *Section : {"__objc_classlist", "__objc_nlclslist"}) {
+    size_t Count;
+    if (auto *ClassList = Image.getSectionData<objc_class *>(
+            MachO::DataSegment, Section, &Count))
+      for (size_t I = 0; I != Count; ++I) {
+        AddClass(ClassList[I]);
+        AddClass(ClassList[I]->isa);
+      }
+  }
+  size_t Count;
+  if (auto *Categories = Image.getSectionData<category_t *>(
+          MachO::DataSegment, "__objc_catlist", &Count))
+    for (size_t I = 0; I != Count; ++I) {
+      category_t *Category = Categories[I];
+      AddList(/* Category */ true, Category, Category->classMethods);
+      AddList(/* Category */ true, Category, Category->instanceMethods);
+    }
+
+  stable_sort(Entries.begin(), Entries.end(),
+              [](const Entry &A, const Entry &B) { return A.Addr < B.Addr; });
+}
+
+ObjCMethod ObjCMethodIndex::findBuilt(uint64_t Addr) {
+  auto I = lower_bound(
+      Entries.begin(), Entries.end(), Addr,
+      [](const Entry &E, uint64_t Addr) { return E.Addr < Addr; });
+  for (auto End = Entries.end(); I != End && I->Addr == Addr; ++I)
+    // Note that the runtime sorts method lists in place when realizing
+    // classes, so we cannot remember the exact `method_t`, only its list.
+    if (method_t *M =
+            findMethodImpl(reinterpret_cast<method_list_t *>(I->Methods), Addr))
+      return ObjCMethod(I->Category, I->ClassData, M);
+  return ObjCMethod();
+}
+
+ObjCMethod ObjCMethodIndex::find(MachO Image, uint64_t Addr) {
+  call_once(Built, [&]() { build(Image); });
+  if (ObjCMethod M = findBuilt(Addr))
+    return M;
+  return Image.findMethod(Addr);
+}
+
+ObjCMethod ObjCMethodIndex::findPreceding(MachO Image, uint64_t Addr,
+                                          uint64_t &Start) {
+  call_once(Built, [&]() { build(Image); });
+  auto I = upper_bound(
+      Entries.begin(), Entries.end(), Addr,
+      [](uint64_t Addr, const Entry &E) { return Addr < E.Addr; });
+  if (I == Entries.begin())
+    return ObjCMethod();
+  Start = prev(I)->Addr;
+  return findBuilt(Start);
+}
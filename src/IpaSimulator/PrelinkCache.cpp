@@ -0,0 +1,208 @@
+// PrelinkCache.cpp: Implementation of class `PrelinkCache`.
+
+#include "ipasim/PrelinkCache.hpp"
+
+#include "ipasim/Common.hpp"
+#include "ipasim/IpaSimulator.hpp"
+
+#include <Windows.h>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+constexpr uint32_t Magic = 0x4b4c5049; // "IPLK"
+constexpr uint32_t Version = 4;
+// Views of files must start at offsets aligned to allocation granularity.
+constexpr uint64_t ImageAlignment = 0x10000;
+
+struct EntryHeader {
+  uint32_t Magic, Version;
+  uint64_t Hash;
+  uint64_t Addr, Size, StartAddress, Entrypoint, Imagebase;
+  uint64_t SegmentCount, SymbolCount, LazyBindingCount, DependencyCount;
+  uint64_t LibraryCount;
+};
+
+constexpr uint64_t FNVOffset = 14695981039346656037ull;
+constexpr uint64_t FNVPrime = 1099511628211ull;
+
+uint64_t hashBytes(uint64_t Hash, const char *Data, size_t Size) {
+  for (const char *End = Data + Size; Data != End; ++Data)
+    Hash = (Hash ^ static_cast<uint8_t>(*Data)) * FNVPrime;
+  return Hash;
+}
+
+template <typename T> void write(ofstream &Out, const T &Value) {
+  Out.write(reinterpret_cast<const char *>(&Value), sizeof(T));
+}
+template <typename T> void write(ofstream &Out, const vector<T> &Values) {
+  Out.write(reinterpret_cast<const char *>(Values.data()),
+            Values.size() * sizeof(T));
+}
+void write(ofstream &Out, const string &Value) {
+  write(Out, static_cast<uint32_t>(Value.size()));
+  Out.write(Value.data(), Value.size());
+}
+
+template <typename T> bool read(ifstream &In, T &Value) {
+  return bool(In.read(reinterpret_cast<char *>(&Value), sizeof(T)));
+}
+template <typename T> bool read(ifstream &In, vector<T> &Values, size_t Count) {
+  Values.resize(Count);
+  return bool(
+      In.read(reinterpret_cast<char *>(Values.data()), Count * sizeof(T)));
+}
+bool read(ifstream &In, string &Value) {
+  uint32_t Size;
+  if (!read(In, Size))
+    return false;
+  Value.resize(Size);
+  return bool(In.read(Value.data(), Size));
+}
+
+} // namespace
+
+PrelinkCache::PrelinkCache(filesystem::path Folder) : Folder(move(Folder)) {
+  error_code Error;
+  filesystem::create_directories(this->Folder, Error);
+  if (Error)
+    Log.error() << "couldn't create prelink cache folder: " << Error.message()
+                << Log.end();
+}
+
+uint64_t PrelinkCache::hashFile(const string &Path) {
+  error_code Error;
+  uint64_t Size = filesystem::file_size(Path, Error);
+  if (Error)
+    return 0;
+  auto Time = filesystem::last_write_time(Path, Error).time_since_epoch();
+  if (Error)
+    return 0;
+
+  int64_t Ticks = Time.count();
+  uint64_t Hash = hashBytes(FNVOffset, reinterpret_cast<const char *>(&Size),
+                            sizeof(Size));
+  return hashBytes(Hash, reinterpret_cast<const char *>(&Ticks),
+                   sizeof(Ticks));
+}
+
+bool PrelinkCache::open(const string &Path, uint64_t Hash, PrelinkedImage &Img,
+                        ifstream &In) {
+  In.open(getEntryPath(Path), ios::binary);
+  if (!In)
+    return false;
+
+  EntryHeader Hdr;
+  if (!read(In, Hdr) || Hdr.Magic != Magic || Hdr.Version != Version ||
+      Hdr.Hash != Hash)
+    return false;
+  Img.Addr = Hdr.Addr;
+  Img.Size = Hdr.Size;
+  Img.StartAddress = Hdr.StartAddress;
+  Img.Entrypoint = Hdr.Entrypoint;
+  Img.Imagebase = Hdr.Imagebase;
+
+  if (!read(In, Img.Segments, Hdr.SegmentCount) ||
+      !read(In, Img.Symbols, Hdr.SymbolCount) ||
+      !read(In, Img.LazyBindings, Hdr.LazyBindingCount))
+    return false;
+  Img.Dependencies.resize(Hdr.DependencyCount);
+  for (PrelinkedImage::Dependency &Dep : Img.Dependencies)
+    if (!read(In, Dep.Path) || !read(In, Dep.StartAddress) ||
+        !read(In, Dep.Hash))
+      return false;
+  Img.Libraries.resize(Hdr.LibraryCount);
+  for (string &Lib : Img.Libraries)
+    if (!read(In, Lib))
+      return false;
+  uint64_t Offset = In.tellg();
+  return bool(In.seekg((Offset + ImageAlignment - 1) & ~(ImageAlignment - 1)));
+}
+
+void *PrelinkCache::map(const string &Path, uint64_t Offset,
+                        const PrelinkedImage &Img) {
+  HANDLE File = CreateFile2(getEntryPath(Path).wstring().c_str(), GENERIC_READ,
+                            FILE_SHARE_READ, OPEN_EXISTING, nullptr);
+  if (File == INVALID_HANDLE_VALUE)
+    return nullptr;
+  HANDLE Mapping =
+      CreateFileMappingFromApp(File, nullptr, PAGE_WRITECOPY, 0, nullptr);
+  CloseHandle(File);
+  if (!Mapping)
+    return nullptr;
+
+  // Note that the view keeps the mapping alive.
+  void *View = MapViewOfFile3FromApp(
+      Mapping, GetCurrentProcess(), reinterpret_cast<void *>(Img.Addr), Offset,
+      Img.Size, 0, PAGE_WRITECOPY, nullptr, 0);
+  CloseHandle(Mapping);
+  if (View && reinterpret_cast<uint64_t>(View) != Img.Addr) {
+    UnmapViewOfFile(View);
+    return nullptr;
+  }
+  return View;
+}
+
+void PrelinkCache::store(const string &Path, uint64_t Hash,
+                         const PrelinkedImage &Img) {
+  filesystem::path EntryPath(getEntryPath(Path));
+  ofstream Out(EntryPath, ios::binary | ios::trunc);
+  if (!Out) {
+    Log.error() << "couldn't create prelink cache entry " << EntryPath.string()
+                << Log.end();
+    return;
+  }
+
+  write(Out, EntryHeader{Magic, Version, Hash, Img.Addr, Img.Size,
+                         Img.StartAddress, Img.Entrypoint, Img.Imagebase,
+                         Img.Segments.size(), Img.Symbols.size(),
+                         Img.LazyBindings.size(), Img.Dependencies.size(),
+                         Img.Libraries.size()});
+  write(Out, Img.Segments);
+  write(Out, Img.Symbols);
+  write(Out, Img.LazyBindings);
+  for (const PrelinkedImage::Dependency &Dep : Img.Dependencies) {
+    write(Out, Dep.Path);
+    write(Out, Dep.StartAddress);
+    write(Out, Dep.Hash);
+  }
+  for (const string &Lib : Img.Libraries)
+    write(Out, Lib);
+  uint64_t Offset = Out.tellp();
+  string Padding((ImageAlignment - Offset % ImageAlignment) % ImageAlignment,
+                 '\0');
+  Out.write(Padding.data(), Padding.size());
+  Out.write(reinterpret_cast<const char *>(Img.Addr), Img.Size);
+
+  if (!Out) {
+    Log.error() << "couldn't write prelink cache entry " << EntryPath.string()
+                << Log.end();
+    Out.close();
+    error_code Error;
+    filesystem::remove(EntryPath, Error);
+  }
+}
+
+void PrelinkCache::clear() {
+  error_code Error;
+  size_t Removed = 0, Failed = 0;
+  for (auto &Entry : filesystem::directory_iterator(Folder, Error)) {
+    if (Entry.path().extension() != ".prelink")
+      continue;
+    if (filesystem::remove(Entry.path(), Error))
+      ++Removed;
+    else
+      ++Failed;
+  }
+  Log.info() << "removed " << Removed << " prelink cache entries" << Log.end();
+  if (Failed)
+    Log.error() << "couldn't remove " << Failed << " prelink cache entries"
+                << Log.end();
+}
+
+filesystem::path PrelinkCache::getEntryPath(const string &Path) {
+  uint64_t Hash = hashBytes(FNVOffset, Path.data(), Path.size());
+  return Folder / (to_hex_string(Hash) + ".prelink");
+}
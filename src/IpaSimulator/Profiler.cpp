@@ -0,0 +1,151 @@
+// Profiler.cpp: Implementation of class `Profiler`.
+
+#include "ipasim/Profiler.hpp"
+
+#include "ipasim/IpaSimulator.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <winrt/Windows.Storage.h>
+
+using namespace ipasim;
+using namespace std;
+using namespace winrt;
+using namespace Windows::Storage;
+
+namespace {
+
+thread_local uint32_t Depth = 0;
+
+void writeJSONString(ostream &OS, const string &S) {
+  OS << '"';
+  for (char C : S) {
+    if (C == '"' || C == '\\')
+      OS << '\\' << C;
+    else if (static_cast<unsigned char>(C) < 0x20)
+      OS << "\\u" << hex << setw(4) << setfill('0') << static_cast<int>(C)
+         << dec << setfill(' ');
+    else
+      OS << C;
+  }
+  OS << '"';
+}
+
+} // namespace
+
+Profiler::Profiler()
+    : Origin(chrono::steady_clock::now()), Recording(ProfileStartup) {}
+
+uint64_t Profiler::now() {
+  return chrono::duration_cast<chrono::microseconds>(
+             chrono::steady_clock::now() - Origin)
+      .count();
+}
+
+uint32_t Profiler::enter() { return Depth++; }
+
+void Profiler::exit(Span &&S) {
+  --Depth;
+  S.Thread = getThreadIndex();
+  lock_guard<mutex> Lock(Mutex);
+  Spans.push_back(move(S));
+}
+
+// Chrome identifies threads by numbers, so we give each thread a small one.
+uint32_t Profiler::getThreadIndex() {
+  static atomic<uint32_t> Count(0);
+  thread_local uint32_t Index = Count++;
+  return Index;
+}
+
+void Profiler::writeChromeTrace(ostream &OS) {
+  lock_guard<mutex> Lock(Mutex);
+  OS << "{\"traceEvents\":[";
+  for (size_t I = 0, End = Spans.size(); I != End; ++I) {
+    const Span &S = Spans[I];
+    if (I)
+      OS << ',';
+    OS << "\n{\"name\":";
+    writeJSONString(OS, S.Name);
+    OS << ",\"cat\":\"startup\",\"ph\":\"X\",\"ts\":" << S.Start
+       << ",\"dur\":" << S.Duration << ",\"pid\":1,\"tid\":" << S.Thread;
+    if (!S.Detail.empty()) {
+      OS << ",\"args\":{\"detail\":";
+      writeJSONString(OS, S.Detail);
+      OS << '}';
+    }
+    OS << '}';
+  }
+  OS << "\n]}\n";
+}
+
+void Profiler::writeSummary(ostream &OS) {
+  struct Stats {
+    uint64_t Count = 0, Total = 0, Self = 0, Max = 0;
+  };
+
+  lock_guard<mutex> Lock(Mutex);
+
+  // Sort spans of each thread so that parents precede their children. Then
+  // subtract time of each span from its parent to get self times.
+  vector<const Span *> Sorted;
+  Sorted.reserve(Spans.size());
+  for (const Span &S : Spans)
+    Sorted.push_back(&S);
+  sort(Sorted.begin(), Sorted.end(), [](const Span *A, const Span *B) {
+    return tie(A->Thread, A->Start, A->Depth) <
+           tie(B->Thread, B->Start, B->Depth);
+  });
+  map<string, Stats> ByName;
+  vector<pair<const Span *, Stats *>> Open;
+  for (const Span *S : Sorted) {
+    while (!Open.empty() && (Open.back().first->Thread != S->Thread ||
+                             Open.back().first->Depth >= S->Depth))
+      Open.pop_back();
+    Stats &St = ByName[S->Name];
+    ++St.Count;
+    St.Total += S->Duration;
+    St.Self += S->Duration;
+    St.Max = max(St.Max, S->Duration);
+    if (!Open.empty())
+      Open.back().second->Self -= S->Duration;
+    Open.emplace_back(S, &St);
+  }
+
+  vector<pair<string, Stats>> Rows(ByName.begin(), ByName.end());
+  sort(Rows.begin(), Rows.end(), [](const auto &A, const auto &B) {
+    return A.second.Total > B.second.Total;
+  });
+  OS << left << setw(24) << "span" << right << setw(8) << "count"
+     << setw(12) << "total us" << setw(12) << "self us" << setw(12)
+     << "max us" << '\n';
+  for (auto &[Name, St] : Rows)
+    OS << left << setw(24) << Name << right << setw(8) << St.Count
+       << setw(12) << St.Total << setw(12) << St.Self << setw(12) << St.Max
+       << '\n';
+}
+
+void Profiler::report() {
+  if (!isRecording())
+    return;
+  Recording = false;
+
+  filesystem::path Path(
+      to_string(ApplicationData::Current().LocalFolder().Path()));
+  Path /= "startup-trace.json";
+  ofstream OS(Path);
+  writeChromeTrace(OS);
+  if (!OS)
+    Log.error() << "couldn't write startup trace to " << Path.string()
+                << Log.end();
+
+  ostringstream Summary;
+  writeSummary(Summary);
+  Log.info() << "startup profile (trace written to " << Path.string()
+             << "):\n"
+             << Summary.str();
+}
@@ -0,0 +1,278 @@
+// SamplingProfiler.cpp: Implementation of class `SamplingProfiler`.
+
+#include "ipasim/SamplingProfiler.hpp"
+
+#include "ipasim/Common.hpp"
+#include "ipasim/IpaSimulator.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <winrt/Windows.Storage.h>
+
+using namespace ipasim;
+using namespace std;
+using namespace winrt;
+using namespace Windows::Storage;
+
+namespace {
+
+// Sorts counts in descending order and logs at most `Limit` of them.
+template <typename KeyTy, typename F>
+void writeRows(ostream &OS, const map<KeyTy, size_t> &Counts, size_t Total,
+               size_t Limit, F &&WriteKey) {
+  vector<pair<size_t, const KeyTy *>> Rows;
+  Rows.reserve(Counts.size());
+  for (auto &[Key, Count] : Counts)
+    Rows.emplace_back(Count, &Key);
+  sort(Rows.begin(), Rows.end(),
+       [](const auto &A, const auto &B) { return A.first > B.first; });
+  if (Rows.size() > Limit)
+    Rows.resize(Limit);
+
+  for (auto &[Count, Key] : Rows) {
+    OS << right << setw(8) << Count << setw(7) << fixed << setprecision(1)
+       << 100.0 * Count / Total << "%  ";
+    WriteKey(*Key);
+    OS << '\n';
+  }
+}
+
+} // namespace
+
+SamplingProfiler::SamplingProfiler(Emulator &Emu, DynamicLoader &Dyld)
+    : Emu(Emu), Dyld(Dyld), Running(false), TimerHandle(nullptr),
+      StopEvent(CreateEventExW(nullptr, nullptr, 0, EVENT_ALL_ACCESS)),
+      Ticks(0), PauseTime(0) {}
+
+SamplingProfiler::~SamplingProfiler() {
+  stop();
+  if (StopEvent)
+    CloseHandle(StopEvent);
+}
+
+bool SamplingProfiler::start(unsigned Frequency) {
+  stop();
+  Threads.forEach([](ThreadSamples &T) {
+    lock_guard<mutex> Lock(T.Mutex);
+    T.Samples.clear();
+    T.Frames.clear();
+  });
+  Ticks = 0;
+  PauseTime = 0;
+  StartTime = chrono::steady_clock::now();
+
+  // Normal waits have resolution of the system timer (15.6 ms by default),
+  // which is too coarse. High-resolution waitable timers are not.
+  TimerHandle = CreateWaitableTimerExW(nullptr, nullptr,
+                                       CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+                                       TIMER_ALL_ACCESS);
+  if (!TimerHandle || !StopEvent) {
+    Log.error() << "couldn't create sampling timer" << Log.appendWinError();
+    return false;
+  }
+  long Period = 1000 / clamp(Frequency, 1U, 1000U); // In milliseconds
+  LARGE_INTEGER DueTime;
+  DueTime.QuadPart = -10000LL * Period; // Relative, in 100-ns units
+  if (!SetWaitableTimer(TimerHandle, &DueTime, Period, nullptr, nullptr,
+                        FALSE)) {
+    Log.error() << "couldn't start sampling timer" << Log.appendWinError();
+    CloseHandle(TimerHandle);
+    TimerHandle = nullptr;
+    return false;
+  }
+
+  Running = true;
+  Timer = thread([this]() { run(); });
+  return true;
+}
+
+void SamplingProfiler::stop() {
+  if (!Running.exchange(false))
+    return;
+
+  SetEvent(StopEvent);
+  Timer.join();
+  CancelWaitableTimer(TimerHandle);
+  CloseHandle(TimerHandle);
+  TimerHandle = nullptr;
+}
+
+void SamplingProfiler::run() {
+  HANDLE Handles[] = {StopEvent, TimerHandle};
+  while (WaitForMultipleObjects(2, Handles, FALSE, INFINITE) ==
+         WAIT_OBJECT_0 + 1) {
+    Emu.interrupt();
+    ++Ticks;
+  }
+}
+
+void SamplingProfiler::record(uint32_t PC, uint32_t LR, uint32_t FP) {
+  ThreadSamples &T = Threads.get();
+  lock_guard<mutex> Lock(T.Mutex);
+  uint32_t First = static_cast<uint32_t>(T.Frames.size());
+
+  // Each frame starts with the caller's R7 followed by the return address.
+  // Frames must go up the stack, anything else means R7 isn't a frame pointer
+  // (e.g., in leaf functions or code compiled without frame pointers). Memory
+  // is read through Unicorn, so that garbage in R7 doesn't crash us. Returning
+  // to kernel means the rest of the stack is native.
+  uint32_t KernelAddr = static_cast<uint32_t>(Dyld.getKernelAddr());
+  for (size_t I = 0; I != MaxFrames && FP && !(FP & 3); ++I) {
+    uint32_t Frame[2];
+    if (!Emu.readMemory(FP, Frame, sizeof(Frame)) || Frame[1] == KernelAddr)
+      break;
+    // If the function has already saved LR, it's the same as in its frame.
+    if (I || Frame[1] != LR)
+      T.Frames.push_back(Frame[1]);
+    if (Frame[0] <= FP)
+      break;
+    FP = Frame[0];
+  }
+  T.Samples.push_back(
+      {PC, LR, First, static_cast<uint32_t>(T.Frames.size()) - First});
+}
+
+void SamplingProfiler::report() {
+  stop();
+
+  auto Duration = chrono::steady_clock::now() - StartTime;
+  vector<Sample> Samples;
+  vector<uint32_t> Frames;
+  Threads.forEach([&Samples, &Frames](ThreadSamples &T) {
+    lock_guard<mutex> Lock(T.Mutex);
+    auto Offset = static_cast<uint32_t>(Frames.size());
+    for (Sample S : T.Samples) {
+      S.FirstFrame += Offset;
+      Samples.push_back(S);
+    }
+    Frames.insert(Frames.end(), T.Frames.begin(), T.Frames.end());
+  });
+  if (Samples.empty()) {
+    Log.info() << "no guest samples were taken" << Log.end();
+    return;
+  }
+
+  // Fold samples by function. Caller of a function called from native code
+  // (i.e., returning to kernel) is empty. Whole stacks are folded, too, from
+  // the outermost frame.
+  map<string, size_t> Self;
+  map<pair<string, string>, size_t> Calls;
+  map<string, size_t> Stacks;
+  size_t Depth = 0;
+  for (const Sample &S : Samples) {
+    const string &Callee = getFunction(S.PC);
+    bool Native = S.LR == Dyld.getKernelAddr();
+    const string &Caller = Native ? string() : getFunction(S.LR & ~1U);
+    ++Self[Callee.empty() ? "[unknown]" : Callee];
+    ++Calls[{Caller, Callee.empty() ? "[unknown]" : Callee}];
+
+    string Stack;
+    for (uint32_t I = S.FrameCount; I != 0; --I) {
+      const string &Function = getFunction(Frames[S.FirstFrame + I - 1] & ~1U);
+      Stack += (Function.empty() ? "[unknown]" : Function) + ';';
+    }
+    if (!Native)
+      Stack += (Caller.empty() ? "[unknown]" : Caller) + ';';
+    Stack += Callee.empty() ? "[unknown]" : Callee;
+    ++Stacks[Stack];
+    Depth += S.FrameCount + !Native + 1;
+  }
+
+  filesystem::path Path(
+      to_string(ApplicationData::Current().LocalFolder().Path()));
+  Path /= "guest-profile.folded";
+  ofstream OS(Path);
+  for (auto &[Stack, Count] : Stacks)
+    OS << Stack << ' ' << Count << '\n';
+  if (!OS)
+    Log.error() << "couldn't write guest profile to " << Path.string()
+                << Log.end();
+
+  ostringstream Summary;
+  Summary << "flat profile:\n";
+  writeRows(Summary, Self, Samples.size(), ReportedRows,
+            [&Summary](const string &Name) { Summary << Name; });
+  Summary << "callers:\n";
+  writeRows(Summary, Calls, Samples.size(), ReportedRows,
+            [&Summary](const pair<string, string> &Edge) {
+              Summary << (Edge.first.empty() ? "[native]" : Edge.first)
+                      << " -> " << Edge.second;
+            });
+  // Pauses include unwinding, so this is the whole overhead of sampling (except
+  // what Unicorn spends stopping and restarting).
+  auto Wall = chrono::duration_cast<chrono::nanoseconds>(Duration).count();
+  ostringstream Overhead;
+  Overhead << fixed << setprecision(2)
+           << (Wall ? 100.0 * PauseTime / Wall : 0.0) << "% of "
+           << Wall / 1000000 << " ms, " << PauseTime / Samples.size()
+           << " ns per sample, average stack depth "
+           << static_cast<double>(Depth) / Samples.size();
+  Log.info() << "guest profile of " << Samples.size() << " samples ("
+             << Ticks.load() << " timer ticks, emulation paused for "
+             << PauseTime / 1000 << " us, i.e., " << Overhead.str()
+             << ", collapsed stacks written to " << Path.string() << "):\n"
+             << Summary.str();
+}
+
+const string &SamplingProfiler::getFunction(uint64_t Addr) {
+  auto [I, New] = Functions.try_emplace(Addr);
+  if (New)
+    I->second = findFunction(Addr);
+  return I->second;
+}
+
+// Finds the closest Objective-C method or exported symbol starting before (or
+// at) `Addr`. Note that addresses of Thumb functions have the lowest bit set.
+string SamplingProfiler::findFunction(uint64_t Addr) {
+  LibraryInfo LI(Dyld.lookup(Addr));
+  if (!LI.Lib)
+    return string();
+  const string &LibPath = *LI.LibPath;
+  string Lib = LibPath.substr(LibPath.find_last_of("/\\") + 1);
+
+  uint64_t Start = 0;
+  string Name;
+  uint64_t MethodStart;
+  if (LI.Lib->hasMachO())
+    if (ObjCMethod M = LI.Lib->findPrecedingMethod(Addr | 1, MethodStart)) {
+      Start = MethodStart & ~1ULL;
+      ObjCClass C = M.getClass();
+      Name = M.isClassMethod() ? "+[" : "-[";
+      if (ObjCClass Cls = C.getCategoryClass())
+        Name = Name + Cls.getName() + "(" + C.getName() + ")";
+      else
+        Name += C.getName();
+      Name = Name + " " + M.getName() + "]";
+    }
+
+  if (auto *Dylib = dynamic_cast<LoadedDylib *>(LI.Lib)) {
+    SymbolList &Syms = getSymbols(*Dylib);
+    auto I = upper_bound(
+        Syms.begin(), Syms.end(), Addr | 1,
+        [](uint64_t Addr, const auto &Sym) { return Addr < Sym.first; });
+    if (I != Syms.begin() && (Name.empty() || (prev(I)->first & ~1ULL) > Start))
+      // Strip the underscore prefix of C symbols.
+      Name = prev(I)->second + (prev(I)->second[0] == '_');
+  }
+
+  if (Name.empty())
+    return Lib + "!0x" + to_hex_string(Addr - LI.Lib->StartAddress);
+  return Lib + "!" + Name;
+}
+
+SamplingProfiler::SymbolList &SamplingProfiler::getSymbols(LoadedDylib &Dylib) {
+  auto [I, New] = Symbols.try_emplace(&Dylib);
+  if (New) {
+    // Skip absolute symbols.
+    Dylib.getSymbols().forEach([&](const char *Name, uint64_t Addr) {
+      if (Dylib.isInRange(Addr))
+        I->second.emplace_back(Addr, Name);
+    });
+    sort(I->second.begin(), I->second.end());
+  }
+  return I->second;
+}
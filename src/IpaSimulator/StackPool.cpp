@@ -0,0 +1,127 @@
+// StackPool.cpp: Implementation of class `StackPool`.
+
+#include "ipasim/StackPool.hpp"
+
+#include "ipasim/Common.hpp"
+#include "ipasim/DynamicLoader.hpp"
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+
+#include <Windows.h>
+#include <algorithm>
+#include <cassert>
+
+using namespace ipasim;
+using namespace std;
+
+uint64_t GuestStack::getBottom() const {
+  return Addr + DynamicLoader::PageSize;
+}
+
+bool GuestStack::isGuard(uint64_t Addr) const {
+  return this->Addr <= Addr && Addr < getBottom();
+}
+
+StackPool::StackPool(Emulator &Emu, uint64_t StackSize)
+    : Emu(Emu), StackSize(DynamicLoader::roundToPageSize(StackSize)) {}
+
+StackPool::~StackPool() {
+  for (auto &Stack : Stacks)
+    VirtualFree(reinterpret_cast<void *>(Stack->Addr), 0, MEM_RELEASE);
+}
+
+GuestStack *StackPool::acquire() {
+  lock_guard<mutex> Lock(Mutex);
+
+  GuestStack *&Stack = Assigned[this_thread::get_id()];
+  if (!Stack) {
+    if (Free.empty()) {
+      Stack = create();
+      if (!Stack) {
+        Assigned.erase(this_thread::get_id());
+        return nullptr;
+      }
+    } else {
+      Stack = Free.back();
+      Free.pop_back();
+    }
+  }
+
+  ++Stack->RefCount;
+  return Stack;
+}
+
+void StackPool::release(GuestStack &Stack) {
+  lock_guard<mutex> Lock(Mutex);
+
+  assert(Stack.RefCount && "Stack released too many times.");
+  if (--Stack.RefCount)
+    return;
+
+  Assigned.erase(this_thread::get_id());
+  Free.push_back(&Stack);
+
+  // Note that we don't compute the high-water mark here, it's expensive (see
+  // `reportUsage`).
+  if constexpr (PrintEmuInfo)
+    Log.info() << "returned stack at 0x" << to_hex_string(Stack.getBottom())
+               << " to pool" << Log.end();
+}
+
+GuestStack *StackPool::findGuard(uint64_t Addr) {
+  lock_guard<mutex> Lock(Mutex);
+
+  for (auto &Stack : Stacks)
+    if (Stack->isGuard(Addr))
+      return Stack.get();
+  return nullptr;
+}
+
+// Stack memory starts zeroed and is never cleared, so the lowest non-zero word
+// marks the deepest point the stack has ever reached. That's only an
+// approximation (the deepest words could have been zero), but it's good enough
+// for sizing stacks. Note that it reads (and thus faults in) every page below
+// the deepest point.
+uint64_t StackPool::getHighWaterMark(const GuestStack &Stack) {
+  auto *Begin = reinterpret_cast<const uint32_t *>(Stack.getBottom());
+  auto *End = reinterpret_cast<const uint32_t *>(Stack.getTop());
+  auto *Used = find_if(Begin, End, [](uint32_t Word) { return Word != 0; });
+  return reinterpret_cast<uint64_t>(End) - reinterpret_cast<uint64_t>(Used);
+}
+
+void StackPool::reportUsage() {
+  lock_guard<mutex> Lock(Mutex);
+
+  for (auto &Stack : Stacks)
+    Log.info() << "stack at 0x" << to_hex_string(Stack->getBottom())
+               << " used 0x" << to_hex_string(getHighWaterMark(*Stack))
+               << " of 0x" << to_hex_string(Stack->Size) << " bytes"
+               << Log.end();
+}
+
+GuestStack *StackPool::create() {
+  // The whole stack is committed, because Unicorn accesses it directly and we
+  // couldn't commit pages on demand. That only charges the commit limit,
+  // physical pages are allocated (zeroed, which is what `getHighWaterMark`
+  // relies on) when they are first touched.
+  uint64_t TotalSize = StackSize + DynamicLoader::PageSize;
+  void *Ptr = VirtualAllocFromApp(nullptr, TotalSize, MEM_RESERVE | MEM_COMMIT,
+                                  PAGE_READWRITE);
+  if (!Ptr) {
+    Log.error() << "couldn't allocate stack of size 0x"
+                << to_hex_string(StackSize) << Log.appendWinError();
+    return nullptr;
+  }
+
+  uint64_t Addr = reinterpret_cast<uint64_t>(Ptr);
+  Emu.mapMemory(Addr, DynamicLoader::PageSize, UC_PROT_NONE);
+  Emu.mapMemory(Addr + DynamicLoader::PageSize, StackSize,
+                UC_PROT_READ | UC_PROT_WRITE);
+
+  if constexpr (PrintEmuInfo)
+    Log.info() << "allocated stack at 0x"
+               << to_hex_string(Addr + DynamicLoader::PageSize) << Log.end();
+
+  Stacks.push_back(make_unique<GuestStack>(GuestStack{Addr, StackSize, 0}));
+  return Stacks.back().get();
+}
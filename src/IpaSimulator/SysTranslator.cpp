@@ -1,5 +1,5 @@
-// SysTranslator.cpp: Implementation of classes `SysTranslator`, `DynamicCaller`
-// and `TypeDecoder`.
+// SysTranslator.cpp: Implementation of classes `SysTranslator`,
+// `TrampolinePool`, `DynamicCaller` and `TypeDecoder`.
 
 #include "ipasim/SysTranslator.hpp"
 
@@ -8,53 +8,49 @@
 #include "ipasim/IpaSimulator/Config.hpp"
 #include "ipasim/WrapperIndex.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <thread>
 
 using namespace ipasim;
 using namespace std;
 
-namespace {
-
-struct Trampoline {
-  ffi_cif CIF;
-  bool Returns;
-  size_t ArgC;
-  uint64_t Addr;
-};
-
-} // namespace
-
 void SysTranslator::execute(LoadedLibrary *Lib) {
   auto *Dylib = dynamic_cast<LoadedDylib *>(Lib);
   if (!Dylib) {
     Log.error("we can only execute Dylibs right now");
     return;
   }
-
-  // Initialize the stack.
-  size_t StackSize = 8 * 1024 * 1024; // 8 MiB
-  void *StackPtr = _aligned_malloc(StackSize, DynamicLoader::PageSize);
-  uint64_t StackAddr = reinterpret_cast<uint64_t>(StackPtr);
-  Emu.mapMemory(StackAddr, StackSize, UC_PROT_READ | UC_PROT_WRITE);
-  // Reserve 12 bytes on the stack, so that our instruction logger can read
-  // them.
-  Emu.writeReg(UC_ARM_REG_SP, StackAddr + StackSize - 12);
+  ProfileScope Scope(IpaSim.Prof, "execute");
 
   // Install hooks.
   // This hook handles calls across platform boundaries (iOS -> Windows). It
   // works thanks to mapping Windows DLLs as non-executable.
-  Emu.hook(UC_HOOK_MEM_FETCH_PROT, &SysTranslator::handleFetchProtMem, this);
+  Hooks.push_back(Emu.hook(UC_HOOK_MEM_FETCH_PROT,
+                           &SysTranslator::handleFetchProtMem, this));
+  // These log everything for debugging purposes. See `Tracer` for tracing
+  // chosen ranges at runtime.
   if constexpr (PrintInstructions)
-    // This hook logs execution for debugging purposes.
-    Emu.hook(UC_HOOK_CODE, &SysTranslator::handleCode, this);
+    Hooks.push_back(Emu.hook(UC_HOOK_CODE, &SysTranslator::handleCode, this));
   if constexpr (PrintMemoryWrites)
-    // This hook logs all memory writes.
-    Emu.hook(UC_HOOK_MEM_WRITE, &SysTranslator::handleMemWrite, this);
+    Hooks.push_back(Emu.hook(UC_HOOK_MEM_WRITE,
+                             &SysTranslator::handleMemWrite, this));
   // This hook allows through reading and writing to unmapped memory (probably
   // heap or other external objects).
-  Emu.hook(UC_HOOK_MEM_READ_UNMAPPED | UC_HOOK_MEM_WRITE_UNMAPPED,
-           &SysTranslator::handleMemUnmapped, this);
+  Hooks.push_back(Emu.hook(UC_HOOK_MEM_READ_UNMAPPED |
+                               UC_HOOK_MEM_WRITE_UNMAPPED,
+                           &SysTranslator::handleMemUnmapped, this));
+  // This hook allows executing code mapped by other threads.
+  Hooks.push_back(Emu.hook(UC_HOOK_MEM_FETCH_UNMAPPED,
+                           &SysTranslator::handleFetchUnmapped, this));
+  // This hook reports stack overflows.
+  Hooks.push_back(Emu.hook(UC_HOOK_MEM_READ_PROT | UC_HOOK_MEM_WRITE_PROT,
+                           &SysTranslator::handleMemProt, this));
+  // This hook handles calls through native call gates.
+  if constexpr (DirectCalls)
+    initGates();
 
   // TODO: Do this also for all non-wrapper Dylibs (i.e., Dylibs that come with
   // the `.ipa` file).
@@ -63,10 +59,16 @@ void SysTranslator::execute(LoadedLibrary *Lib) {
   // `MachOInitializer.cpp` does.
   uint64_t Hdr = Dylib->findSymbol(Dyld, "__mh_execute_header");
   IpaSim.Dyld.registerMachO(reinterpret_cast<void *>(Hdr));
+  Scope.next("_objc_init");
   call("libobjc.dll", "_objc_init");
+  Scope.end();
+
+  // Startup ends here, because execution of the entry point usually doesn't
+  // end until the app is closed.
+  IpaSim.Prof.report();
 
   // Start at entry point.
-  execute(Dylib->Bin.entrypoint() + Dylib->StartAddress);
+  execute(Dylib->Entrypoint + Dylib->StartAddress);
 }
 
 void SysTranslator::execute(uint64_t Addr) {
@@ -74,34 +76,86 @@ void SysTranslator::execute(uint64_t Addr) {
     Log.info() << "starting emulation at " << Dyld.dumpAddr(Addr)
                << " in thread " << this_thread::get_id() << Log.end();
 
-  // Save LR.
-  LRs.push(Emu.readReg(UC_ARM_REG_LR));
+  // Get stack of the current thread. Without it, the code cannot run.
+  GuestStack *Stack = Stacks.acquire();
+  if (!Stack) {
+    Log.error() << "couldn't start emulation at " << Dyld.dumpAddr(Addr)
+                << " without a stack" << Log.end();
+    return;
+  }
 
-  // Point return address to kernel.
-  Emu.writeReg(UC_ARM_REG_LR, Dyld.getKernelAddr());
+  ThreadState &T = Threads.get();
+
+  // Switch to the stack (unless we are already using it).
+  static constexpr uc_arm_reg SPAndLR[] = {UC_ARM_REG_SP, UC_ARM_REG_LR};
+  uint32_t Saved[2];
+  Emu.readRegs(SPAndLR, Saved, 2);
+  uint32_t SavedSP = Saved[0];
+  bool SwitchStack = !Stack->contains(SavedSP);
+
+  // Save LR.
+  T.LRs.push(Saved[1]);
+
+  // Point return address to kernel. Unicorn stops when it gets there, so that
+  // returning from emulated code doesn't have to go through fault handling.
+  // Also, reserve 12 bytes on the new stack, so that our instruction logger can
+  // read them.
+  uint64_t KernelAddr = Dyld.getKernelAddr();
+  uint32_t New[2] = {static_cast<uint32_t>(Stack->getTop() - 12),
+                     static_cast<uint32_t>(KernelAddr)};
+  if (SwitchStack)
+    Emu.writeRegs(SPAndLR, New, 2);
+  else
+    Emu.writeReg(UC_ARM_REG_LR, New[1]);
 
   // Start execution.
+  chrono::steady_clock::time_point PausedAt;
+  bool Paused = false;
   for (;;) {
-    Emu.start(Addr);
+    if (Paused) {
+      IpaSim.Sampler.addPause(chrono::steady_clock::now() - PausedAt);
+      Paused = false;
+    }
+    bool Interrupted = Emu.start(Addr, KernelAddr);
 
-    if (Continue) {
-      Continue = false;
-      Continuation();
-      Continuation = nullptr;
+    if (T.Continue) {
+      T.Continue = false;
+      T.Continuation();
     }
 
-    if (Restart) {
+    if (T.Restart) {
       // If restarting, continue where we left off.
-      Restart = false;
-      if (RestartFromLRs) {
-        RestartFromLRs = false;
-        Addr = LRs.top();
-        LRs.pop();
+      T.Restart = false;
+      if (T.RestartFromLRs) {
+        T.RestartFromLRs = false;
+        Addr = T.LRs.top();
+        T.LRs.pop();
       } else
         Addr = Emu.readReg(UC_ARM_REG_LR);
+    } else if (Interrupted) {
+      // Emulation was interrupted by `SamplingProfiler`. Record where it
+      // stopped and continue from there. Time until then is reported as the
+      // profiler's overhead.
+      PausedAt = chrono::steady_clock::now();
+      Paused = true;
+      static constexpr uc_arm_reg Regs[] = {UC_ARM_REG_PC, UC_ARM_REG_LR,
+                                            UC_ARM_REG_CPSR, UC_ARM_REG_R7};
+      uint32_t Values[4];
+      Emu.readRegs(Regs, Values, 4);
+      IpaSim.Sampler.record(Values[0], Values[1], Values[3]);
+
+      // Stay in Thumb mode if the CPSR's T bit is set.
+      Addr = Values[0] | ((Values[2] >> 5) & 1);
     } else
       break;
   }
+
+  returnToKernel();
+
+  // Restore SP.
+  if (SwitchStack)
+    Emu.writeReg(UC_ARM_REG_SP, SavedSP);
+  Stacks.release(*Stack);
 }
 
 void SysTranslator::returnToKernel() {
@@ -110,11 +164,9 @@ void SysTranslator::returnToKernel() {
                << to_hex_string(Dyld.getKernelAddr()) << Log.end();
 
   // Restore LR.
-  Emu.writeReg(UC_ARM_REG_LR, LRs.top());
-  LRs.pop();
-
-  // Stop execution.
-  Emu.stop();
+  ThreadState &T = Threads.get();
+  Emu.writeReg(UC_ARM_REG_LR, T.LRs.top());
+  T.LRs.pop();
 }
 
 void SysTranslator::returnToEmulation() {
@@ -122,21 +174,7 @@ void SysTranslator::returnToEmulation() {
     Log.info() << "returning to " << Dyld.dumpAddr(Emu.readReg(UC_ARM_REG_LR))
                << Log.end();
 
-  Restart = true;
-}
-
-// Calling `uc_emu_start` inside `uc_emu_start` (e.g., inside a hook) is not
-// very good idea. Instead, we need to call it when emulation completely stops
-// (i.e., Unicorn returns from `uc_emu_start`). That's what this function is
-// used for. All code that calls or could call `uc_emu_start` should be deferred
-// using this function. See also
-// <https://github.com/unicorn-engine/unicorn/issues/591>.
-void SysTranslator::continueOutsideEmulation(function<void()> &&Cont) {
-  assert(!Continue && "Only one continuation is supported.");
-  Continue = true;
-  Continuation = move(Cont);
-
-  Emu.stop();
+  Threads.get().Restart = true;
 }
 
 // Note that we never return `true` from this handler, so that protected memory
@@ -144,17 +182,53 @@ void SysTranslator::continueOutsideEmulation(function<void()> &&Cont) {
 // memory, and it would get into the cache, effectively becoming unprotected.
 bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
                                        int Size, int64_t Value) {
-  // Handle return to kernel.
+  // Handle return to kernel. Normally, Unicorn stops right at `KernelAddr`
+  // (see `execute`), but if it tries to fetch the page anyway, we stop here
+  // and `execute` finishes as if it stopped on its own.
   if (Addr == Dyld.getKernelAddr()) {
-    returnToKernel();
-
     Emu.ignoreNextError();
     return false;
   }
 
+  ThreadState &T = Threads.get();
+  lock_guard<recursive_mutex> Lock(Mutex);
+
   // Check that the target address is in some loaded library.
   LibraryInfo LI(Dyld.lookup(Addr));
   if (!LI.Lib) {
+    // Handle first call through a lazy pointer. Lazy binder slots aren't
+    // inside any library, so this is checked only here, off the hot path.
+    // Binding can load libraries (and run their `DllMain`), so it's done
+    // outside emulation.
+    size_t Binding;
+    if (Dyld.findLazyBinding(Addr, Binding)) {
+      if (Binding == DynamicLoader::NoLazyBinding)
+        return false;
+
+      continueOutsideEmulation([this, Binding]() {
+        lock_guard<recursive_mutex> Lock(Mutex);
+        uint32_t *Ptr;
+        uint64_t Target = Dyld.bindLazy(Binding, Ptr);
+        if (!Target)
+          return;
+
+        // Calls into wrapper DLLs go through a native call gate from now on.
+        if (uint64_t Gate = getGate(Target)) {
+          *Ptr = static_cast<uint32_t>(Gate);
+          Target = Gate;
+        }
+
+        // Continue as if the lazy pointer was already bound.
+        ThreadState &T = Threads.get();
+        T.Restart = true;
+        T.RestartFromLRs = true;
+        T.LRs.push(Target);
+      });
+
+      Emu.ignoreNextError();
+      return false;
+    }
+
     Log.error() << "non-library address fetched (" << Dyld.dumpAddr(Addr) << ")"
                 << Log.end();
     return false;
@@ -179,7 +253,7 @@ bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
     // arguments and return value.
     uint32_t R0 = Emu.readReg(UC_ARM_REG_R0);
 
-    continueOutsideEmulation([=]() {
+    continueOutsideEmulation([this, R0, Addr]() {
       // Call the target function.
       auto *Func = reinterpret_cast<void (*)(uint32_t)>(Addr);
       Func(R0);
@@ -192,52 +266,34 @@ bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
   }
 
   // If the target is not a wrapper DLL, we must find and call the corresponding
-  // wrapper instead.
-  filesystem::path DLLPath(*LI.LibPath);
-  filesystem::path WrapperPath(
-      filesystem::path("gen") /
-      DLLPath.filename().replace_extension(".wrapper.dll"));
-  LoadedLibrary *WrapperLib = Dyld.load(WrapperPath.string());
-  if (!WrapperLib) {
-    Log.error() << "cannot find wrapper DLL " << WrapperPath << Log.end();
-    return false;
-  }
-
-  // Load `WrapperIndex`.
-  uint64_t IdxAddr =
-      WrapperLib->findSymbol(Dyld, "?Idx@@3UWrapperIndex@ipasim@@A");
-  auto *Idx = reinterpret_cast<WrapperIndex *>(IdxAddr);
-
-  uint64_t RVA = Addr - LI.Lib->StartAddress + DLLBase;
-
-  // Find Dylib with the corresponding wrapper.
-  auto Entry = Idx->Map.find(RVA);
-  if (Entry != Idx->Map.end()) {
-    const string &Dylib = Idx->Dylibs[Entry->second];
-    LoadedLibrary *WrapperDylib = Dyld.load(Dylib);
-    if (!WrapperDylib) {
-      Log.error() << "cannot load wrapper Dylib " << Dylib << Log.end();
+  // wrapper instead. We remember wrappers we have already found.
+  uint64_t WrapperAddr;
+  auto Cached = WrapperCache.find(Addr);
+  if (Cached != WrapperCache.end()) {
+    ++WrapperStats.Hits;
+    WrapperAddr = Cached->second;
+  } else {
+    ++WrapperStats.Misses;
+    if (!findWrapper(Addr, LI, WrapperAddr))
       return false;
-    }
+    WrapperCache[Addr] = WrapperAddr;
 
-    // Find the correct wrapper using its alias.
-    Addr = WrapperDylib->findSymbol(
-        Dyld, WrapsPrefix.S + DLLPath.stem().string() + "_" + to_string(RVA));
-    if (!Addr) {
-      Log.error() << "cannot find wrapper for 0x" << to_hex_string(RVA)
-                  << " in " << *LI.LibPath << Log.end();
-      return false;
-    }
+    if constexpr (PrintEmuInfo)
+      Log.info() << "wrapper cache miss (hits: " << WrapperStats.Hits
+                 << ", misses: " << WrapperStats.Misses << ")" << Log.end();
+  }
 
+  if (WrapperAddr) {
     if constexpr (PrintEmuInfo)
-      Log.info() << "found wrapper at " << Dyld.dumpAddr(Addr) << Log.end();
+      Log.info() << "found wrapper at " << Dyld.dumpAddr(WrapperAddr)
+                 << Log.end();
 
     // Note that doing just `Emu.writeReg(UC_ARM_REG_PC, Addr);` instead of all
     // this didn't work in Release mode for some reason.
     Emu.stop();
-    Restart = true;
-    RestartFromLRs = true;
-    LRs.push(Addr);
+    T.Restart = true;
+    T.RestartFromLRs = true;
+    T.LRs.push(WrapperAddr);
 
     Emu.ignoreNextError();
     return false;
@@ -245,7 +301,7 @@ bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
 
   // If there's no corresponding wrapper, maybe this is a simple Objective-C
   // method and we can translate it dynamically.
-  ObjCMethod M = LI.Lib->getMachO().findMethod(Addr);
+  ObjCMethod M = LI.Lib->findMethod(Addr);
   if (!M) {
     Log.error() << "cannot find Objective-C method for "
                 << Dyld.dumpAddr(Addr, LI) << Log.end();
@@ -256,37 +312,22 @@ bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
     Log.info() << "dynamically handling method " << Dyld.dumpAddr(Addr, LI, M)
                << Log.end();
 
-  // Handle return value.
-  TypeDecoder TD(M.getType());
-  bool Returns;
-  switch (TD.getNextTypeSize()) {
-  case 0:
-    Returns = false;
-    break;
-  case 4:
-    Returns = true;
-    break;
-  default:
-    Log.error() << "unsupported return type of " << Dyld.dumpAddr(Addr, LI, M)
+  // Process function arguments.
+  MethodSignature *Sig = getSignature(M.getType());
+  if (!Sig) {
+    Log.error() << "unsupported signature of " << Dyld.dumpAddr(Addr, LI, M)
                 << Log.end();
     return false;
   }
+  // Note that `Caller` can be safely reused by nested calls which can happen
+  // while the target function is running, because libffi copies the arguments
+  // before calling it.
+  DynamicCaller *Caller = &T.Caller;
+  Caller->loadArgs(*Sig);
 
-  // Process function arguments.
-  auto DC = make_unique<DynamicCaller>(Emu);
-  while (TD.hasNext()) {
-    size_t Size = TD.getNextTypeSize();
-    if (Size == TypeDecoder::InvalidSize)
-      return false;
-    DC->loadArg(Size);
-  }
-
-  continueOutsideEmulation([=, DCP = DC.release()]() {
-    unique_ptr<DynamicCaller> DC(DCP);
-
+  continueOutsideEmulation([this, Caller, Sig, Addr]() {
     // Call the function.
-    if (!DC->call(Returns, Addr))
-      return;
+    Caller->call(*Sig, Addr);
 
     returnToEmulation();
   });
@@ -295,18 +336,244 @@ bool SysTranslator::handleFetchProtMem(uc_mem_type Type, uint64_t Addr,
   return false;
 }
 
+void SysTranslator::initGates() {
+  // Fill the gates. They are never written to again, only their targets are.
+  size_t Size = MaxGates * GateSize;
+  auto *Code = reinterpret_cast<uint32_t *>(VirtualAllocFromApp(
+      nullptr, Size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+  if (!Code) {
+    Log.error("couldn't allocate native call gates");
+    return;
+  }
+  for (size_t I = 0; I != MaxGates; ++I) {
+    Code[2 * I] = 0xef000000;     // svc #0
+    Code[2 * I + 1] = 0xe12fff1e; // bx lr
+  }
+  GatesAddr = reinterpret_cast<uint64_t>(Code);
+  Gates = make_unique<CallGate[]>(MaxGates);
+  Emu.mapMemory(GatesAddr, Size, UC_PROT_READ | UC_PROT_EXEC);
+
+  Hooks.push_back(
+      Emu.hook(UC_HOOK_INTR, &SysTranslator::handleInterrupt, this));
+}
+
+// Returns address of the native call gate of `Target`, or 0 if `Target` is
+// not a function of a wrapper DLL (or there are no free gates left). `Mutex`
+// must be locked.
+uint64_t SysTranslator::getGate(uint64_t Target) {
+  if (!GatesAddr)
+    return 0;
+  auto It = GatesByTarget.find(Target);
+  if (It != GatesByTarget.end())
+    return It->second;
+
+  LoadedLibrary *Lib = Dyld.lookup(Target).Lib;
+  if (!Lib || Lib->isDylib() || !Lib->IsWrapper)
+    return 0;
+  size_t Index = GateCount.load(memory_order_relaxed);
+  if (Index == MaxGates) {
+    Log.warning() << "no free native call gates left" << Log.end();
+    return 0;
+  }
+
+  Gates[Index].Target.store(Target, memory_order_relaxed);
+  // Publish the gate before any lazy pointer can point to it.
+  GateCount.store(Index + 1, memory_order_release);
+  uint64_t Gate = GatesAddr + Index * GateSize;
+  GatesByTarget[Target] = Gate;
+  return Gate;
+}
+
+// Handles `svc` of native call gates (see `getGate`). Unlike
+// `handleFetchProtMem`, this doesn't stop Unicorn. As long as the target
+// doesn't call back into emulated code, it is called right here and emulation
+// continues with the gate's `bx lr`. Otherwise, the current engine is suspended
+// meanwhile (see `Emulator::suspend`) and the gate is marked as reentrant, so
+// that next time, the target is called outside emulation as other functions.
+void SysTranslator::handleInterrupt(uint32_t IntNo) {
+  // Note that PC already points after the `svc`.
+  static constexpr uc_arm_reg Regs[] = {UC_ARM_REG_PC, UC_ARM_REG_R0};
+  uint32_t Values[2];
+  Emu.readRegs(Regs, Values, 2);
+  uint64_t Index = (Values[0] - GatesAddr) / GateSize;
+  if (IntNo != 2 /* EXCP_SWI */ || Values[0] < GatesAddr ||
+      Index >= GateCount.load(memory_order_acquire)) {
+    Log.error() << "unexpected interrupt " << IntNo << " at "
+                << Dyld.dumpAddr(Values[0]) << Log.end();
+    Emu.stop();
+    return;
+  }
+
+  CallGate &G = Gates[Index];
+  auto *Func = reinterpret_cast<void (*)(uint32_t)>(
+      G.Target.load(memory_order_relaxed));
+  uint32_t R0 = Values[1];
+
+  if constexpr (PrintEmuInfo)
+    Log.info() << "native call gate to "
+               << Dyld.dumpAddr(reinterpret_cast<uint64_t>(Func)) << Log.end();
+
+  if (G.Reentrant.load(memory_order_relaxed)) {
+    ++Calls.Deferred;
+    continueOutsideEmulation([this, Func, R0]() {
+      Func(R0);
+      returnToEmulation();
+    });
+    return;
+  }
+
+  ++Calls.Direct;
+  Emu.suspend();
+  Func(R0);
+  if (Emu.resume())
+    G.Reentrant.store(true, memory_order_relaxed);
+}
+
+// Finds wrapper of function at `Addr` which is inside non-wrapper DLL `LI`.
+// Sets `WrapperAddr` to 0 if there is no such wrapper. Returns `false` on
+// error.
+bool SysTranslator::findWrapper(uint64_t Addr, const LibraryInfo &LI,
+                                uint64_t &WrapperAddr) {
+  filesystem::path DLLPath(*LI.LibPath);
+  filesystem::path WrapperPath(
+      filesystem::path("gen") /
+      DLLPath.filename().replace_extension(".wrapper.dll"));
+  LoadedLibrary *WrapperLib = Dyld.load(WrapperPath.string());
+  if (!WrapperLib) {
+    Log.error() << "cannot find wrapper DLL " << WrapperPath << Log.end();
+    return false;
+  }
+
+  // Load `WrapperIndex`.
+  uint64_t IdxAddr =
+      WrapperLib->findSymbol(Dyld, "?Idx@@3UWrapperIndex@ipasim@@A");
+  auto *Idx = reinterpret_cast<WrapperIndex *>(IdxAddr);
+
+  uint64_t RVA = Addr - LI.Lib->StartAddress + DLLBase;
+
+  // Find Dylib with the corresponding wrapper.
+  auto Entry = Idx->Map.find(RVA);
+  if (Entry == Idx->Map.end()) {
+    WrapperAddr = 0;
+    return true;
+  }
+  const string &Dylib = Idx->Dylibs[Entry->second];
+  LoadedLibrary *WrapperDylib = Dyld.load(Dylib);
+  if (!WrapperDylib) {
+    Log.error() << "cannot load wrapper Dylib " << Dylib << Log.end();
+    return false;
+  }
+
+  // Find the correct wrapper using its alias.
+  WrapperAddr = WrapperDylib->findSymbol(
+      Dyld, WrapsPrefix.S + DLLPath.stem().string() + "_" + to_string(RVA));
+  if (!WrapperAddr) {
+    Log.error() << "cannot find wrapper for 0x" << to_hex_string(RVA) << " in "
+                << *LI.LibPath << Log.end();
+    return false;
+  }
+  return true;
+}
+
+// Returns decoded signature of methods with type encoding `Types` or `nullptr`
+// if some of the types are not supported. Note that type encodings usually live
+// in Objective-C metadata which is never deallocated, so we can remember them
+// by address and avoid hashing the strings.
+MethodSignature *SysTranslator::getSignature(const char *Types) {
+  auto [P, NewPtr] = SignaturesByPtr.try_emplace(Types, nullptr);
+  if (!NewPtr)
+    return P->second;
+
+  auto [I, New] = Signatures.try_emplace(Types, nullptr);
+  if (New)
+    I->second = createSignature(Types);
+  P->second = I->second.get();
+  return P->second;
+}
+
+static uint32_t alignTo(uint32_t Value, uint32_t Alignment) {
+  return (Value + Alignment - 1) / Alignment * Alignment;
+}
+
+unique_ptr<MethodSignature> SysTranslator::createSignature(const char *Types) {
+  auto Sig = make_unique<MethodSignature>();
+  TypeDecoder TD(Types);
+
+  // Decide how the return value is passed. Composite types bigger than 4 bytes
+  // are returned in memory.
+  TypeDecoder::Type Ret = TD.getNextType(*Sig);
+  if (!Ret.FFI)
+    return nullptr;
+  if (Ret.FFI == &ffi_type_void)
+    Sig->Returns = ReturnKind::Void;
+  else if (Ret.Size <= 4)
+    Sig->Returns = ReturnKind::Word;
+  else if (!Ret.Composite && Ret.Size == 8)
+    Sig->Returns = ReturnKind::DoubleWord;
+  else
+    Sig->Returns = ReturnKind::Memory;
+
+  // Assign arguments to registers and stack. Note that in iOS ABI, arguments
+  // are aligned only to 4 bytes, even 64-bit ones, so they simply occupy
+  // consecutive words.
+  uint32_t Word = Sig->Returns == ReturnKind::Memory ? 1 : 0;
+  while (TD.hasNext()) {
+    TypeDecoder::Type Arg = TD.getNextType(*Sig);
+    if (!Arg.FFI)
+      return nullptr;
+    if (Arg.FFI == &ffi_type_void) {
+      Log.error() << "void argument in " << Types << Log.end();
+      return nullptr;
+    }
+    Sig->Args.push_back(MethodSignature::Arg{Arg.Size, Arg.Alignment, Word});
+    Sig->ArgTypes.push_back(Arg.FFI);
+    Word += alignTo(Arg.Size, 4) / 4;
+  }
+  Sig->Words = Word;
+  if (Sig->Words > DynamicCaller::MaxWords) {
+    Log.error() << "too many arguments in " << Types << Log.end();
+    return nullptr;
+  }
+
+  if (ffi_prep_cif(&Sig->CIF, FFI_MS_CDECL, Sig->ArgTypes.size(), Ret.FFI,
+                   Sig->ArgTypes.data()) != FFI_OK) {
+    Log.error() << "couldn't prepare CIF for " << Types << Log.end();
+    return nullptr;
+  }
+
+  // Structures are copied from the guest as they are, so their layout must be
+  // the same on the host. It isn't when they contain 64-bit fields (those are
+  // aligned to 8 bytes on the host, but only to 4 bytes in iOS ABI).
+  if (Ret.Composite && Ret.FFI->size != Ret.Size) {
+    Log.error() << "returned structure has different layout on host ("
+                << Types << ")" << Log.end();
+    return nullptr;
+  }
+  for (size_t I = 0, End = Sig->Args.size(); I != End; ++I)
+    if (Sig->ArgTypes[I]->size != Sig->Args[I].Size) {
+      Log.error() << "argument #" << I << " has different layout on host ("
+                  << Types << ")" << Log.end();
+      return nullptr;
+    }
+
+  return Sig;
+}
+
 void SysTranslator::handleCode(uint64_t Addr, uint32_t Size) {
-  auto *R13 = reinterpret_cast<uint32_t *>(Emu.readReg(UC_ARM_REG_R13));
+  static constexpr uc_arm_reg RegIds[] = {UC_ARM_REG_R0,  UC_ARM_REG_R1,
+                                          UC_ARM_REG_R7,  UC_ARM_REG_R12,
+                                          UC_ARM_REG_R13, UC_ARM_REG_R14};
+  uint32_t R[size(RegIds)];
+  Emu.readRegs(RegIds, R, size(RegIds));
+  auto *R13 = reinterpret_cast<uint32_t *>(R[4]);
   Log.info() << "executing at " << Dyld.dumpAddr(Addr) << " [R0 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R0)) << ", R1 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R1)) << ", R7 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R7)) << ", R12 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R12)) << ", R13 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R13)) << ", [R13] = 0x"
-             << to_hex_string(R13[0]) << ", [R13+4] = 0x"
+             << to_hex_string(R[0]) << ", R1 = 0x" << to_hex_string(R[1])
+             << ", R7 = 0x" << to_hex_string(R[2]) << ", R12 = 0x"
+             << to_hex_string(R[3]) << ", R13 = 0x" << to_hex_string(R[4])
+             << ", [R13] = 0x" << to_hex_string(R13[0]) << ", [R13+4] = 0x"
              << to_hex_string(R13[1]) << ", [R13+8] = 0x"
-             << to_hex_string(R13[2]) << ", R14 = 0x"
-             << to_hex_string(Emu.readReg(UC_ARM_REG_R14)) << "]" << Log.end();
+             << to_hex_string(R13[2]) << ", R14 = 0x" << to_hex_string(R[5])
+             << "]" << Log.end();
 }
 
 bool SysTranslator::handleMemWrite(uc_mem_type Type, uint64_t Addr, int Size,
@@ -325,12 +592,28 @@ bool SysTranslator::handleMemUnmapped(uc_mem_type Type, uint64_t Addr, int Size,
     Log.info() << "unmapped memory manipulation at " << Dyld.dumpAddr(Addr)
                << " (" << Size << ")" << Log.end();
 
-  // Map the memory, so that emulation can continue.
-  Addr = DynamicLoader::alignToPageSize(Addr);
-  Size = DynamicLoader::roundToPageSize(Size);
-  Emu.mapMemory(Addr, Size, UC_PROT_READ | UC_PROT_WRITE);
+  // Map the memory, so that emulation can continue. If the access crosses
+  // boundary of the mapped memory, we will get here again.
+  return HostMemory.handleFault(Addr);
+}
 
-  return true;
+bool SysTranslator::handleFetchUnmapped(uc_mem_type Type, uint64_t Addr,
+                                        int Size, int64_t Value) {
+  // If another thread has loaded some code meanwhile, map it. Otherwise,
+  // Unicorn reports the error.
+  return Emu.syncMemory(Addr);
+}
+
+bool SysTranslator::handleMemProt(uc_mem_type Type, uint64_t Addr, int Size,
+                                  int64_t Value) {
+  if (GuestStack *Stack = Stacks.findGuard(Addr))
+    Log.error() << "stack overflow (stack at 0x"
+                << to_hex_string(Stack->getBottom()) << " of size 0x"
+                << to_hex_string(Stack->Size) << ")" << Log.end();
+  else
+    Log.error() << "protected memory accessed at " << Dyld.dumpAddr(Addr)
+                << Log.end();
+  return false;
 }
 
 void SysTranslator::handleTrampoline(void *Ret, void **Args, void *Data) {
@@ -345,9 +628,10 @@ void SysTranslator::handleTrampoline(void *Ret, void **Args, void *Data) {
   }
 
   // Pass arguments.
-  uc_arm_reg RegId = UC_ARM_REG_R0;
+  uint32_t Words[ArgumentFrame::RegArgs];
   for (size_t I = 0, ArgC = Tr->ArgC; I != ArgC; ++I)
-    Emu.writeReg(RegId++, *reinterpret_cast<uint32_t *>(Args[I]));
+    Words[I] = *reinterpret_cast<uint32_t *>(Args[I]);
+  Emu.writeArgs(Words, Tr->ArgC);
 
   // Call the function.
   execute(Tr->Addr);
@@ -362,9 +646,19 @@ void SysTranslator::handleTrampolineStatic(ffi_cif *, void *Ret, void **Args,
   IpaSim.Sys.handleTrampoline(Ret, Args, Data);
 }
 
+void SysTranslator::handleReleasedTrampolineStatic(ffi_cif *, void *Ret,
+                                                   void **Args, void *Data) {
+  auto *Tr = reinterpret_cast<Trampoline *>(Data);
+  Log.error() << "called released trampoline of "
+              << IpaSim.Dyld.dumpAddr(Tr->Addr) << Log.end();
+  if (Tr->Returns)
+    *reinterpret_cast<ffi_arg *>(Ret) = 0;
+}
+
 // If `FP` points to emulated code, returns address of wrapper that should be
 // called instead. Otherwise, returns `FP` unchanged.
 void *SysTranslator::translate(void *FP) {
+  lock_guard<recursive_mutex> Lock(Mutex);
   uint64_t Addr = reinterpret_cast<uint64_t>(FP);
   LibraryInfo LI(Dyld.lookup(Addr));
 
@@ -372,7 +666,7 @@ void *SysTranslator::translate(void *FP) {
   if (!Dylib)
     return FP;
 
-  ObjCMethod M = Dylib->getMachO().findMethod(Addr);
+  ObjCMethod M = Dylib->findMethod(Addr);
   if (!M) {
     Log.error("callback not found");
     return nullptr;
@@ -387,48 +681,35 @@ void *SysTranslator::translate(void *FP) {
     Log.info() << "dynamically handling callback " << Dyld.dumpAddr(Addr, LI, M)
                << Log.end();
 
-  // First, handle the return value.
-  TypeDecoder TD(M.getType());
-  bool Returns;
-  switch (TD.getNextTypeSize()) {
-  case 0:
-    Returns = false;
-    break;
-  case 4:
-    Returns = true;
-    break;
-  default:
-    Log.error("unsupported return type of callback");
+  MethodSignature *Sig = getSignature(M.getType());
+  if (!Sig) {
+    Log.error("unsupported callback signature");
     return nullptr;
   }
 
-  // Next, process function arguments.
-  size_t ArgC = 0;
-  while (TD.hasNext()) {
-    switch (TD.getNextTypeSize()) {
-    case TypeDecoder::InvalidSize:
-      return nullptr;
-    case 4: {
-      if (ArgC > 3) {
-        Log.error("callback has too many arguments");
-        return nullptr;
-      }
-      ++ArgC;
-      break;
-    }
-    default:
+  // Trampolines pass only 32-bit integers (see `createTrampoline`).
+  if (Sig->Returns != ReturnKind::Void &&
+      (Sig->Returns != ReturnKind::Word || Sig->CIF.rtype == &ffi_type_float)) {
+    Log.error("unsupported return type of callback");
+    return nullptr;
+  }
+  if (Sig->Args.size() > 4) {
+    Log.error("callback has too many arguments");
+    return nullptr;
+  }
+  for (MethodSignature::Arg &Arg : Sig->Args)
+    if (Arg.Size > 4) {
       Log.error("unsupported callback argument type");
       return nullptr;
     }
-  }
 
   // Now, create trampoline.
-  return createTrampoline(FP, ArgC, Returns);
+  return createTrampoline(FP, Sig->Args.size(),
+                          Sig->Returns == ReturnKind::Word);
 }
 
 void *SysTranslator::translate(void *FP, size_t ArgC, bool Returns) {
-  using namespace LIEF::MachO;
-
+  lock_guard<recursive_mutex> Lock(Mutex);
   uint64_t Addr = reinterpret_cast<uint64_t>(FP);
   LibraryInfo LI(IpaSim.Dyld.lookup(Addr));
 
@@ -441,16 +722,16 @@ void *SysTranslator::translate(void *FP, size_t ArgC, bool Returns) {
   // If `FP` is a Dylib wrapper, we can skip it, we just need to find what it
   // wraps.
   if (Dylib->IsWrapper)
-    for (Symbol &Symbol : Dylib->lookup(Addr)) {
+    for (const char *Name : Dylib->lookup(Addr)) {
       // Find special symbol name.
-      if (!startsWith(Symbol.name(), WrapsPrefix))
+      if (strncmp(Name, WrapsPrefix.S, WrapsPrefix.Len))
         continue;
 
       // Parse the special name.
-      const char *Postfix = Symbol.name().c_str() + WrapsPrefix.Len;
+      const char *Postfix = Name + WrapsPrefix.Len;
       const char *Underscore = strchr(Postfix, '_');
       if (!Underscore) {
-        Log.error() << "invalid special symbol " << Symbol.name() << Log.end();
+        Log.error() << "invalid special symbol " << Name << Log.end();
         continue;
       }
       uint64_t RVA = atol(Underscore + 1);
@@ -459,19 +740,19 @@ void *SysTranslator::translate(void *FP, size_t ArgC, bool Returns) {
       // Load the wrapped library.
       LoadedLibrary *Lib = Dyld.load(DLLName);
       if (!Lib) {
-        Log.error() << "couldn't load DLL for symbol " << Symbol.name()
+        Log.error() << "couldn't load DLL for symbol " << Name
                     << Log.end();
         continue;
       }
       if (RVA >= Lib->Size) {
-        Log.error() << "RVA out of bounds for symbol " << Symbol.name()
+        Log.error() << "RVA out of bounds for symbol " << Name
                     << Log.end();
         continue;
       }
 
       Addr = Lib->StartAddress + RVA - DLLBase;
       if constexpr (PrintEmuInfo)
-        Log.info() << "skipped wrapper for symbol " << Symbol.name() << " ("
+        Log.info() << "skipped wrapper for symbol " << Name << " ("
                    << Dyld.dumpAddr(Addr) << ")" << Log.end();
       return reinterpret_cast<void *>(Addr);
     }
@@ -482,128 +763,358 @@ void *SysTranslator::translate(void *FP, size_t ArgC, bool Returns) {
 void *SysTranslator::createTrampoline(void *FP, size_t ArgC, bool Returns) {
   assert(ArgC <= 4);
 
-  // TODO: Don't create different trampolines for the same `FP`.
-  auto *Tr = new Trampoline;
-  Tr->Returns = Returns;
-  Tr->ArgC = ArgC;
-  Tr->Addr = reinterpret_cast<uint64_t>(FP);
+  // Reuse existing trampoline if possible.
+  uint64_t Addr = reinterpret_cast<uint64_t>(FP);
+  auto [I, New] =
+      Trampolines.try_emplace(TrampolineKey(Addr, ArgC, Returns), nullptr);
+  if (!New) {
+    ++I->second->RefCount;
+    return I->second->Ptr;
+  }
 
-  void *Ptr;
-  // TODO: `Closure` nor `Tr` are never deallocated.
-  auto *Closure = reinterpret_cast<ffi_closure *>(
-      ffi_closure_alloc(sizeof(ffi_closure), &Ptr));
-  if (!Closure) {
+  Trampoline *Tr = TrampolineAlloc.allocate();
+  if (!Tr) {
     Log.error("couldn't allocate closure");
+    Trampolines.erase(I);
     return nullptr;
   }
+  Tr->Returns = Returns;
+  Tr->ArgC = ArgC;
+  Tr->Addr = Addr;
+  Tr->RefCount = 1;
+
   static ffi_type *ArgTypes[4] = {&ffi_type_uint32, &ffi_type_uint32,
                                   &ffi_type_uint32, &ffi_type_uint32};
   if (ffi_prep_cif(&Tr->CIF, FFI_MS_CDECL, Tr->ArgC,
                    Tr->Returns ? &ffi_type_uint32 : &ffi_type_void,
                    ArgTypes) != FFI_OK) {
     Log.error("couldn't prepare CIF");
+    TrampolineAlloc.free(Tr);
+    Trampolines.erase(I);
     return nullptr;
   }
-  if (ffi_prep_closure_loc(Closure, &Tr->CIF, handleTrampolineStatic, Tr,
-                           Ptr) != FFI_OK) {
+  if (ffi_prep_closure_loc(Tr->Closure, &Tr->CIF, handleTrampolineStatic, Tr,
+                           Tr->Ptr) != FFI_OK) {
     Log.error("couldn't prepare closure");
+    TrampolineAlloc.free(Tr);
+    Trampolines.erase(I);
     return nullptr;
   }
-  return Ptr;
+
+  I->second = Tr;
+  TrampolinesByPtr[Tr->Ptr] = Tr;
+  return Tr->Ptr;
+}
+
+void *SysTranslator::release(void *FP) {
+  lock_guard<recursive_mutex> Lock(Mutex);
+
+  // Functions that didn't need translation don't have trampolines.
+  auto I = TrampolinesByPtr.find(FP);
+  if (I == TrampolinesByPtr.end())
+    return FP;
+
+  Trampoline *Tr = I->second;
+  void *Target = reinterpret_cast<void *>(Tr->Addr);
+  if (--Tr->RefCount)
+    return Target;
+  Trampolines.erase(TrampolineKey(Tr->Addr, Tr->ArgC, Tr->Returns));
+  TrampolinesByPtr.erase(I);
+
+  // Somebody might still hold the pointer, so make the closure fail loudly
+  // instead of calling the emulated function.
+  ffi_prep_closure_loc(Tr->Closure, &Tr->CIF, handleReleasedTrampolineStatic,
+                       Tr, Tr->Ptr);
+  TrampolineAlloc.free(Tr);
+  return Target;
+}
+
+void SysTranslator::reportTrampolines() {
+  lock_guard<recursive_mutex> Lock(Mutex);
+  size_t Refs = 0;
+  for (auto &[Key, Tr] : Trampolines) {
+    Refs += Tr->RefCount;
+    if constexpr (PrintEmuInfo)
+      Log.info() << "trampoline for " << Dyld.dumpAddr(Tr->Addr) << " ("
+                 << Tr->RefCount << " reference(s))" << Log.end();
+  }
+  Log.info() << Trampolines.size() << " live trampoline(s) with " << Refs
+             << " reference(s)" << Log.end();
 }
 
 // =============================================================================
-// DynamicCaller
+// TrampolinePool
 // =============================================================================
 
-void DynamicCaller::loadArg(size_t Size) {
-  for (size_t I = 0; I != Size; I += 4) {
-    if (RegId <= UC_ARM_REG_R3)
-      // We have some registers left, use them.
-      Args.push_back(Emu.readReg(RegId++));
-    else {
-      // Otherwise, use stack.
-      Args.push_back(*reinterpret_cast<uint32_t *>(SP));
-      SP += 4;
+TrampolinePool::~TrampolinePool() {
+  for (auto &Slab : Slabs)
+    for (size_t I = 0; I != SlabSize; ++I)
+      if (Slab[I].Closure)
+        ffi_closure_free(Slab[I].Closure);
+}
+
+void TrampolinePool::free(Trampoline *Tr) {
+  Quarantine.push_back(Tr);
+  if (Quarantine.size() > QuarantineSize) {
+    Free.push_back(Quarantine.front());
+    Quarantine.pop_front();
+  }
+}
+
+Trampoline *TrampolinePool::allocate() {
+  if (Free.empty()) {
+    Slabs.push_back(make_unique<Trampoline[]>(SlabSize));
+    Trampoline *Slab = Slabs.back().get();
+    for (size_t I = SlabSize; I != 0; --I) {
+      Slab[I - 1].Closure = nullptr;
+      Free.push_back(&Slab[I - 1]);
     }
   }
+
+  Trampoline *Tr = Free.back();
+  if (!Tr->Closure) {
+    // Closures are allocated lazily and then reused by every trampoline
+    // occupying this slot.
+    Tr->Closure = reinterpret_cast<ffi_closure *>(
+        ffi_closure_alloc(sizeof(ffi_closure), &Tr->Ptr));
+    if (!Tr->Closure)
+      return nullptr;
+  }
+  Free.pop_back();
+  return Tr;
 }
 
-bool DynamicCaller::call(bool Returns, uint32_t Addr) {
-#define CASE(N)                                                                \
-  case N:                                                                      \
-    call<N>(Returns, Addr);                                                    \
-    break
+// =============================================================================
+// DynamicCaller
+// =============================================================================
 
-  switch (Args.size()) {
-    CASE(0);
-    CASE(1);
-    CASE(2);
-    CASE(3);
-    CASE(4);
-    CASE(5);
-    CASE(6);
-  default:
-    Log.error("function has too many arguments");
-    return false;
+void DynamicCaller::loadArgs(const MethodSignature &Sig) {
+  assert(Sig.Words <= MaxWords && "Too many arguments.");
+
+  // Read registers and then stack.
+  ArgumentFrame Frame(Emu.readFrame());
+  size_t RegWords = min<size_t>(Sig.Words, ArgumentFrame::RegArgs);
+  copy(Frame.Args, Frame.Args + RegWords, Words);
+  if (Sig.Words > RegWords)
+    copy(Frame.getStack(), Frame.getStack() + Sig.Words - RegWords,
+         Words + RegWords);
+}
+
+void DynamicCaller::call(MethodSignature &Sig, uint32_t Addr) {
+  for (size_t I = 0, End = Sig.Args.size(); I != End; ++I)
+    ArgPtrs[I] = &Words[Sig.Args[I].Word];
+  auto *Func = reinterpret_cast<void (*)()>(static_cast<uintptr_t>(Addr));
+
+  if (Sig.Returns == ReturnKind::Memory) {
+    ffi_call(&Sig.CIF, Func, reinterpret_cast<void *>(Words[0]), ArgPtrs);
+    return;
   }
-  return true;
 
-#undef CASE
+  uint64_t RetVal = 0;
+  ffi_call(&Sig.CIF, Func, &RetVal, ArgPtrs);
+  if (Sig.Returns == ReturnKind::Void)
+    return;
+  uint32_t Ret[2] = {static_cast<uint32_t>(RetVal),
+                     static_cast<uint32_t>(RetVal >> 32)};
+  Emu.writeArgs(Ret, Sig.Returns == ReturnKind::DoubleWord ? 2 : 1);
 }
 
 // =============================================================================
 // TypeDecoder
 // =============================================================================
 
-size_t TypeDecoder::getNextTypeSizeImpl() {
+TypeDecoder::Type TypeDecoder::getNextTypeImpl(MethodSignature &Sig) {
+  static constexpr Type Invalid{nullptr, 0, 0, false};
+  static constexpr Type Pointer{&ffi_type_pointer, 4, 4, false};
+
+  skipQualifiers();
   switch (*T) {
   case 'v': // void
-    return 0;
+    return {&ffi_type_void, 0, 1, false};
   case 'c': // char
-  case '@': // id
-  case '#': // Class
-  case ':': // SEL
+    return {&ffi_type_sint8, 1, 1, false};
+  case 'C': // unsigned char
+  case 'B': // C++ `bool` or C99 `_Bool`
+    return {&ffi_type_uint8, 1, 1, false};
+  case 's': // short
+    return {&ffi_type_sint16, 2, 2, false};
+  case 'S': // unsigned short
+    return {&ffi_type_uint16, 2, 2, false};
   case 'i': // int
+  case 'l': // long (32-bit)
+    return {&ffi_type_sint32, 4, 4, false};
   case 'I': // unsigned int
+  case 'L': // unsigned long (32-bit)
+    return {&ffi_type_uint32, 4, 4, false};
+  // Note that in iOS ABI, 64-bit types are aligned only to 4 bytes.
+  case 'q': // long long
+    return {&ffi_type_sint64, 8, 4, false};
+  case 'Q': // unsigned long long
+    return {&ffi_type_uint64, 8, 4, false};
   case 'f': // float
-    return 4;
+    return {&ffi_type_float, 4, 4, false};
+  case 'd': // double
+    return {&ffi_type_double, 8, 4, false};
+  case '*': // char *
+  case '#': // Class
+  case ':': // SEL
+    return Pointer;
+  case '@': // id
+    // Skip block marker (`@?`) or class name (`@"NSString"`).
+    if (T[1] == '?')
+      ++T;
+    else if (T[1] == '"') {
+      for (T += 2; *T != '"'; ++T)
+        if (!*T) {
+          Log.error("class name ended unexpectedly");
+          return Invalid;
+        }
+    }
+    return Pointer;
   case '^': // pointer to type
-    ++T;
-    getNextTypeSizeImpl(); // Skip the underlying type, it's not important.
-    return 4;
-  case '{': { // struct
-    // Skip name of the struct.
+    if (!*++T) {
+      Log.error("pointer type ended unexpectedly");
+      return Invalid;
+    }
+    skipType(); // The underlying type is not important.
+    return Pointer;
+  case '{':   // struct
+  case '(': { // union
+    bool Union = *T == '(';
+
+    // Skip name.
     for (++T; *T != '='; ++T)
-      if (!*T) {
-        Log.error("struct type ended unexpectedly");
-        return InvalidSize;
+      if (!*T || *T == '}' || *T == ')') {
+        Log.error("opaque struct or union cannot be passed by value");
+        return Invalid;
       }
     ++T;
 
-    // Parse type recursively (note that the struct can be also empty).
-    size_t TotalSize = 0;
-    while (*T != '}') {
-      size_t Size = getNextTypeSize();
-      if (Size == InvalidSize)
-        return InvalidSize;
-      TotalSize += Size;
+    return getCompositeType(Sig, Union ? ')' : '}', Union);
+  }
+  case '[': { // array
+    uint32_t Count = 0;
+    for (++T; '0' <= *T && *T <= '9'; ++T)
+      Count = Count * 10 + (*T - '0');
+    Type Element = getNextType(Sig);
+    if (!Element.FFI)
+      return Invalid;
+    if (*T != ']' || !Count || Element.FFI == &ffi_type_void) {
+      Log.error("invalid array type");
+      return Invalid;
     }
 
-    return TotalSize;
+    // libffi doesn't have array types, so we represent them as structures.
+    vector<ffi_type *> Fields(Count, Element.FFI);
+    return {createStruct(Sig, Fields), Element.Size * Count, Element.Alignment,
+            true};
   }
   default:
     Log.error("unsupported type encoding");
-    return InvalidSize;
+    return Invalid;
   }
 }
 
-size_t TypeDecoder::getNextTypeSize() {
-  size_t Result = getNextTypeSizeImpl();
+// Decodes fields of a struct or union up to character `End`.
+TypeDecoder::Type TypeDecoder::getCompositeType(MethodSignature &Sig, char End,
+                                                bool Union) {
+  static constexpr Type Invalid{nullptr, 0, 0, false};
+
+  vector<ffi_type *> Fields;
+  uint32_t Size = 0, Alignment = 1;
+  while (*T != End) {
+    Type Field = getNextType(Sig);
+    if (!Field.FFI)
+      return Invalid;
+    if (Field.FFI == &ffi_type_void) {
+      Log.error("void field");
+      return Invalid;
+    }
 
-  // Skip digits.
-  for (++T; '0' <= *T && *T <= '9'; ++T)
-    ;
+    Alignment = max(Alignment, Field.Alignment);
+    if (Union)
+      Size = max(Size, Field.Size);
+    else
+      Size = alignTo(Size, Field.Alignment) + Field.Size;
+    Fields.push_back(Field.FFI);
+  }
+  if (Fields.empty()) {
+    Log.error("empty structs and unions are not supported");
+    return Invalid;
+  }
+  Size = alignTo(Size, Alignment);
+
+  // libffi doesn't support unions, so we represent them as arrays of integers
+  // with the same size and alignment.
+  if (Union) {
+    ffi_type *Int = Alignment == 1
+                        ? &ffi_type_uint8
+                        : Alignment == 2 ? &ffi_type_uint16 : &ffi_type_uint32;
+    Fields.assign(Size / Alignment, Int);
+  }
+
+  return {createStruct(Sig, Fields), Size, Alignment, true};
+}
 
+ffi_type *TypeDecoder::createStruct(MethodSignature &Sig,
+                                    const vector<ffi_type *> &Fields) {
+  auto Elements = make_unique<ffi_type *[]>(Fields.size() + 1);
+  copy(Fields.begin(), Fields.end(), Elements.get());
+  Elements[Fields.size()] = nullptr;
+
+  // Size and alignment are computed later by `ffi_prep_cif`.
+  auto Type = make_unique<ffi_type>();
+  Type->size = 0;
+  Type->alignment = 0;
+  Type->type = FFI_TYPE_STRUCT;
+  Type->elements = Elements.get();
+
+  Sig.StructElements.push_back(move(Elements));
+  Sig.StructTypes.push_back(move(Type));
+  return Sig.StructTypes.back().get();
+}
+
+TypeDecoder::Type TypeDecoder::getNextType(MethodSignature &Sig) {
+  Type Result = getNextTypeImpl(Sig);
+  if (Result.FFI)
+    skipDigits();
   return Result;
 }
+
+// Skips type qualifiers (`const`, `in`, `inout`, `out`, `bycopy`, `byref`,
+// `oneway` and `_Atomic`).
+void TypeDecoder::skipQualifiers() {
+  while (*T && strchr("rnNoORVA", *T))
+    ++T;
+}
+
+// Moves `T` to the last character of the current type.
+void TypeDecoder::skipType() {
+  switch (*T) {
+  case '^':
+    if (T[1]) {
+      ++T;
+      skipType();
+    }
+    return;
+  case '{':
+  case '(':
+  case '[': {
+    size_t Depth = 0;
+    for (; *T; ++T) {
+      if (*T == '{' || *T == '(' || *T == '[')
+        ++Depth;
+      else if ((*T == '}' || *T == ')' || *T == ']') && !--Depth)
+        return;
+    }
+    Log.error("type ended unexpectedly");
+    --T;
+    return;
+  }
+  }
+}
+
+void TypeDecoder::skipDigits() {
+  for (++T; '0' <= *T && *T <= '9'; ++T)
+    ;
+}
@@ -0,0 +1,345 @@
+// Tracer.cpp: Implementation of class `Tracer`.
+
+#include "ipasim/Tracer.hpp"
+
+#include "ipasim/Common.hpp"
+#include "ipasim/IpaSimulator.hpp"
+#include "ipasim/IpaSimulator/Config.hpp"
+#include "ipasim/LoadedLibrary.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstddef>
+#include <sstream>
+
+using namespace ipasim;
+using namespace std;
+
+namespace {
+
+constexpr uint32_t Magic = 0x52545049; // "IPTR"
+constexpr uint32_t Version = 3;
+
+// Trace files start with this header, followed by `Tracer::Record`s and then by
+// the library table (see `Tracer::writeLibraries`).
+struct TraceHeader {
+  uint32_t Magic, Version;
+  uint32_t Period;
+  uint32_t Reserved;
+  uint64_t LibrariesOffset; // 0 if the trace wasn't stopped properly
+};
+
+// Entry of the library table, followed by the library's path.
+struct LibraryEntry {
+  uint64_t StartAddress, Size, PathSize;
+};
+
+constexpr uc_arm_reg RegIds[] = {UC_ARM_REG_R0,  UC_ARM_REG_R1,
+                                 UC_ARM_REG_R7,  UC_ARM_REG_R12,
+                                 UC_ARM_REG_R13, UC_ARM_REG_R14};
+constexpr const char *RegNames[] = {"R0", "R1", "R7", "R12", "SP", "LR"};
+static_assert(size(RegIds) == Tracer::InstructionRegs);
+
+} // namespace
+
+static_assert(sizeof(Tracer::Record) == 12, "Records must be packed.");
+
+Tracer::Tracer(Emulator &Emu, DynamicLoader &Dyld)
+    : Emu(Emu), Dyld(Dyld), Active(false), NextThread(0),
+      Threads([this]() {
+        auto T = make_unique<ThreadState>();
+        T->Buffer.reserve(BufferSize);
+        T->Index = NextThread++;
+        return T;
+      }) {}
+
+bool Tracer::start(const string &Path, const Options &Opts) {
+  stop();
+
+  // Nothing is recorded now, so we can reset all threads.
+  Threads.forEach([](ThreadState &T) {
+    lock_guard<mutex> Lock(T.Mutex);
+    T.Blocks = 0;
+    T.Sampled = false;
+  });
+
+  lock_guard<mutex> Lock(Mutex);
+  Out.open(Path, ios::binary | ios::trunc);
+  if (!Out) {
+    Log.error() << "couldn't create trace file " << Path << Log.end();
+    return false;
+  }
+  this->Opts = Opts;
+  if (!this->Opts.Period)
+    this->Opts.Period = 1;
+  TraceHeader Header{Magic, Version, this->Opts.Period, 0, 0};
+  Out.write(reinterpret_cast<const char *>(&Header), sizeof(Header));
+  Active = true;
+  return true;
+}
+
+void Tracer::addRange(uint64_t Begin, uint64_t End) {
+  lock_guard<mutex> Lock(Mutex);
+  if (!Active) {
+    Log.error() << "tracing hasn't been started" << Log.end();
+    return;
+  }
+
+  if constexpr (PrintEmuInfo)
+    Log.info() << "tracing 0x" << to_hex_string(Begin) << "-0x"
+               << to_hex_string(End) << Log.end();
+
+  // Sampling is decided at the beginning of each block. Note that execution
+  // can only enter the range at a block boundary.
+  Hooks.push_back(
+      Emu.hook(UC_HOOK_BLOCK, &Tracer::handleBlock, this, Begin, End));
+  if (Opts.Instructions)
+    Hooks.push_back(
+        Emu.hook(UC_HOOK_CODE, &Tracer::handleCode, this, Begin, End));
+  // Unicorn filters memory hooks by the accessed address, not by address of
+  // the code, so this hook has to cover everything (see `handleMemWrite`).
+  // That's why it's only installed if `Options::MemWrites` asks for it.
+  if (Opts.MemWrites && !Writes)
+    Writes = Emu.hook(UC_HOOK_MEM_WRITE, &Tracer::handleMemWrite, this);
+}
+
+bool Tracer::addLibrary(const string &Path) {
+  LoadedLibrary *LL = Dyld.findLoaded(Path);
+  if (!LL) {
+    Log.error() << "cannot trace " << Path << ", it's not loaded" << Log.end();
+    return false;
+  }
+  addRange(LL->StartAddress, LL->StartAddress + LL->Size - 1);
+  return true;
+}
+
+bool Tracer::addSymbol(const string &Lib, const string &Name) {
+  auto *Dylib = dynamic_cast<LoadedDylib *>(Dyld.findLoaded(Lib));
+  if (!Dylib) {
+    Log.error() << "cannot trace symbol " << Name << " of " << Lib
+                << ", it's not a loaded Mach-O library" << Log.end();
+    return false;
+  }
+  uint64_t Begin = Dylib->findSymbol(Dyld, Name);
+  if (!Begin || !Dylib->isInRange(Begin)) {
+    Log.error() << "symbol " << Name << " not found in " << Lib << Log.end();
+    return false;
+  }
+
+  // Thumb functions have the lowest bit set.
+  Begin &= ~1ULL;
+  uint64_t End = Dylib->StartAddress + Dylib->Size;
+  Dylib->getSymbols().forEach([Begin, &End](const char *, uint64_t Addr) {
+    Addr &= ~1ULL;
+    if (Addr > Begin && Addr < End)
+      End = Addr;
+  });
+  addRange(Begin, End - 1);
+  return true;
+}
+
+void Tracer::stop() {
+  if (!Active.exchange(false))
+    return;
+
+  {
+    lock_guard<mutex> Lock(Mutex);
+    Hooks.clear();
+    Writes.reset();
+  }
+
+  // Engines of other threads remove the hooks lazily, but their handlers don't
+  // record anything now that `Active` is `false`.
+  Threads.forEach([this](ThreadState &T) {
+    lock_guard<mutex> Lock(T.Mutex);
+    flush(T);
+  });
+
+  lock_guard<mutex> Lock(Mutex);
+  writeLibraries();
+  Out.close();
+}
+
+// Appends the library table and points the header to it. `Mutex` must be
+// locked.
+void Tracer::writeLibraries() {
+  uint64_t Offset = Out.tellp();
+  auto Write = [this](uint64_t StartAddress, uint64_t Size,
+                      const string &Path) {
+    LibraryEntry E{StartAddress, Size, Path.size()};
+    Out.write(reinterpret_cast<const char *>(&E), sizeof(E));
+    Out.write(Path.data(), Path.size());
+  };
+  Write(Dyld.getKernelAddr(), DynamicLoader::PageSize, "kernel");
+  Dyld.forEachLoaded([&Write](const LibraryInfo &LI) {
+    Write(LI.Lib->StartAddress, LI.Lib->Size, *LI.LibPath);
+  });
+
+  Out.seekp(offsetof(TraceHeader, LibrariesOffset));
+  Out.write(reinterpret_cast<const char *>(&Offset), sizeof(Offset));
+  if (!Out)
+    Log.error("couldn't write library table of the trace");
+}
+
+void Tracer::handleBlock(uint64_t Addr, uint32_t Size) {
+  ThreadState &T = Threads.get();
+  lock_guard<mutex> Lock(T.Mutex);
+  if (!Active)
+    return;
+
+  T.Sampled = T.Blocks++ % Opts.Period == 0;
+  if (T.Sampled) {
+    T.BlockBegin = Addr;
+    T.BlockEnd = Addr + Size;
+    append(T, RecordKind::Block, Addr, Size, nullptr, 0);
+  }
+}
+
+void Tracer::handleCode(uint64_t Addr, uint32_t Size) {
+  ThreadState &T = Threads.get();
+  lock_guard<mutex> Lock(T.Mutex);
+  if (!Active || !T.Sampled)
+    return;
+
+  uint32_t R[InstructionRegs];
+  Emu.readRegs(RegIds, R, InstructionRegs);
+  append(T, RecordKind::Instruction, Addr, Size, R, sizeof(R));
+}
+
+bool Tracer::handleMemWrite(uc_mem_type Type, uint64_t Addr, int Size,
+                            int64_t Value) {
+  if (!Active)
+    return true;
+  ThreadState &T = Threads.get();
+  lock_guard<mutex> Lock(T.Mutex);
+  if (!Active || !T.Sampled)
+    return true;
+
+  // Record only writes done by the last sampled block. Note that `Sampled`
+  // stays set when execution leaves the traced ranges, because block hooks
+  // don't fire outside of them.
+  uint32_t PC = Emu.readReg(UC_ARM_REG_PC);
+  if (PC >= T.BlockBegin && PC < T.BlockEnd)
+    append(T, RecordKind::MemWrite, Addr, Size, &Value, sizeof(Value));
+  return true;
+}
+
+void Tracer::append(ThreadState &T, RecordKind Kind, uint64_t Addr,
+                    uint32_t Size, const void *Payload, size_t PayloadSize) {
+  // Emulated addresses are 32-bit.
+  assert(Addr <= UINT32_MAX && "Address doesn't fit into a record.");
+  Record R{Kind, T.Index, 0, Size, static_cast<uint32_t>(Addr)};
+  auto *Bytes = reinterpret_cast<const uint8_t *>(&R);
+  T.Buffer.insert(T.Buffer.end(), Bytes, Bytes + sizeof(R));
+  Bytes = reinterpret_cast<const uint8_t *>(Payload);
+  T.Buffer.insert(T.Buffer.end(), Bytes, Bytes + PayloadSize);
+
+  if (T.Buffer.size() >= BufferSize)
+    flush(T);
+}
+
+// Note that the caller must hold `T.Mutex`, which is always locked before
+// `Mutex`.
+void Tracer::flush(ThreadState &T) {
+  lock_guard<mutex> Lock(Mutex);
+  Out.write(reinterpret_cast<const char *>(T.Buffer.data()), T.Buffer.size());
+  T.Buffer.clear();
+}
+
+bool Tracer::decode(const string &Path, const string &OutPath) {
+  ifstream In(Path, ios::binary);
+  TraceHeader Header;
+  if (!In.read(reinterpret_cast<char *>(&Header), sizeof(Header)) ||
+      Header.Magic != Magic || Header.Version != Version) {
+    Log.error() << "invalid trace file " << Path << Log.end();
+    return false;
+  }
+
+  // Read the library table first.
+  vector<Library> Libs;
+  uint64_t End = Header.LibrariesOffset;
+  if (End) {
+    In.seekg(End);
+    LibraryEntry E;
+    while (In.read(reinterpret_cast<char *>(&E), sizeof(E))) {
+      string LibPath(E.PathSize, '\0');
+      if (!In.read(LibPath.data(), E.PathSize))
+        break;
+      Libs.push_back({E.StartAddress, E.Size, move(LibPath)});
+    }
+    sort(Libs.begin(), Libs.end(), [](const Library &A, const Library &B) {
+      return A.StartAddress < B.StartAddress;
+    });
+    In.clear();
+    In.seekg(sizeof(Header));
+  } else
+    Log.warning() << "trace " << Path
+                  << " has no library table, it wasn't stopped properly"
+                  << Log.end();
+
+  ofstream OS(OutPath);
+  OS << "sampling period: " << Header.Period << '\n';
+  Record R;
+  while ((!End || static_cast<uint64_t>(In.tellg()) < End) &&
+         In.read(reinterpret_cast<char *>(&R), sizeof(R))) {
+    OS << "[" << static_cast<unsigned>(R.Thread) << "] ";
+    switch (R.Kind) {
+    case RecordKind::Block:
+      OS << "block " << symbolize(R.Addr, Libs) << " (" << R.Size << ")\n";
+      break;
+    case RecordKind::Instruction: {
+      uint32_t Regs[InstructionRegs];
+      if (!In.read(reinterpret_cast<char *>(Regs), sizeof(Regs)))
+        break;
+      OS << "  executing " << symbolize(R.Addr, Libs) << " [";
+      for (size_t I = 0; I != InstructionRegs; ++I)
+        OS << (I ? ", " : "") << RegNames[I] << " = 0x"
+           << to_hex_string(Regs[I]);
+      OS << "]\n";
+      break;
+    }
+    case RecordKind::MemWrite: {
+      uint64_t Value;
+      if (!In.read(reinterpret_cast<char *>(&Value), sizeof(Value)))
+        break;
+      OS << "  writing [" << symbolize(R.Addr, Libs)
+         << "] := " << symbolize(Value, Libs) << " (" << R.Size << ")\n";
+      break;
+    }
+    default:
+      Log.error() << "corrupted trace file " << Path << Log.end();
+      return false;
+    }
+  }
+
+  if (!OS) {
+    Log.error() << "couldn't write decoded trace to " << OutPath << Log.end();
+    return false;
+  }
+  return true;
+}
+
+// Similar to `DynamicLoader::dumpAddr`, but produces a string and uses the
+// trace's library table.
+string Tracer::symbolize(uint64_t Addr, const vector<Library> &Libs) {
+  auto I = upper_bound(
+      Libs.begin(), Libs.end(), Addr,
+      [](uint64_t Addr, const Library &L) { return Addr < L.StartAddress; });
+  if (I == Libs.begin() || Addr - prev(I)->StartAddress >= prev(I)->Size)
+    return "0x" + to_hex_string(Addr);
+  const Library &L = *prev(I);
+
+  // Method names are read from the library itself, so it must be the same.
+  ostringstream OS;
+  LibraryInfo LI(Dyld.lookup(Addr));
+  if (LI.Lib && LI.Lib->StartAddress == L.StartAddress &&
+      *LI.LibPath == L.Path && LI.Lib->hasMachO())
+    if (ObjCMethod M = LI.Lib->findMethod(Addr)) {
+      wostringstream WOS; // Unused, method names are narrow
+      StdStream S(OS, WOS);
+      S << M << "!";
+    }
+  OS << L.Path << "+0x" << to_hex_string(Addr - L.StartAddress);
+  return OS.str();
+}